@@ -0,0 +1,434 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure obmc-console-client throughput and keystroke latency.
+ *
+ * Rather than a real server, the client connects to a socket that we
+ * listen on, and its stdio is a pair of pipes, so we measure only the
+ * client. We run each measurement with the client's default ssh-style
+ * escape ("~."), and with an escape string (-e), as the two modes scan
+ * input differently.
+ *
+ * The workload has no '~', so that it passes through the escape scanning
+ * unchanged.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench-util.c"
+
+#define STREAM_BUF_SIZE 65536
+
+struct bench_client {
+	char console_id[32];
+	int listen_sd;
+	int sd;
+	int stdin_fd;
+	int stdout_fd;
+	pid_t pid;
+};
+
+struct stream_writer {
+	int fd;
+	size_t total;
+};
+
+static uint8_t pattern[STREAM_BUF_SIZE];
+
+static void pattern_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(pattern); i++) {
+		pattern[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+	}
+}
+
+static int bench_listen(struct bench_client *client)
+{
+	struct sockaddr_un addr;
+	ssize_t len;
+
+	snprintf(client->console_id, sizeof(client->console_id),
+		 "benchclient%d", getpid());
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = console_socket_path(addr.sun_path, client->console_id);
+	if (len < 0) {
+		warn("Can't construct socket path");
+		return -1;
+	}
+
+	client->listen_sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->listen_sd < 0) {
+		warn("socket");
+		return -1;
+	}
+
+	if (bind(client->listen_sd, (struct sockaddr *)&addr,
+		 sizeof(addr) - sizeof(addr.sun_path) + len)) {
+		warn("Can't bind socket");
+		return -1;
+	}
+
+	if (listen(client->listen_sd, 1)) {
+		warn("listen");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start the client on a pair of pipes, and accept its connection */
+static int bench_client_spawn(struct bench_client *client,
+			      const char *client_path, const char *escape,
+			      bool verbose)
+{
+	struct pollfd pollfd;
+	int in_pipe[2];
+	int out_pipe[2];
+	int devnull;
+
+	if (pipe2(in_pipe, O_CLOEXEC) || pipe2(out_pipe, O_CLOEXEC)) {
+		warn("pipe");
+		return -1;
+	}
+
+	client->pid = fork();
+	if (client->pid < 0) {
+		warn("fork");
+		return -1;
+	}
+
+	if (!client->pid) {
+		dup2(in_pipe[0], STDIN_FILENO);
+		dup2(out_pipe[1], STDOUT_FILENO);
+		if (!verbose) {
+			devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, STDERR_FILENO);
+		}
+		if (escape) {
+			execl(client_path, client_path, "-i",
+			      client->console_id, "-e", escape, NULL);
+		} else {
+			execl(client_path, client_path, "-i",
+			      client->console_id, NULL);
+		}
+		err(EXIT_FAILURE, "Can't execute %s", client_path);
+	}
+
+	close(in_pipe[0]);
+	close(out_pipe[1]);
+	client->stdin_fd = in_pipe[1];
+	client->stdout_fd = out_pipe[0];
+
+	pollfd.fd = client->listen_sd;
+	pollfd.events = POLLIN;
+	if (poll(&pollfd, 1, 5000) != 1) {
+		warnx("Timed out waiting for the client to connect");
+		return -1;
+	}
+
+	client->sd = accept4(client->listen_sd, NULL, NULL, SOCK_CLOEXEC);
+	if (client->sd < 0) {
+		warn("accept");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_client_stop(struct bench_client *client)
+{
+	uint64_t deadline;
+
+	/* the client exits when its stdin closes */
+	if (client->stdin_fd >= 0) {
+		close(client->stdin_fd);
+		client->stdin_fd = -1;
+	}
+
+	if (client->pid > 0) {
+		deadline = bench_now_ns() + 1000000000ull;
+		while (waitpid(client->pid, NULL, WNOHANG) != client->pid) {
+			if (bench_now_ns() > deadline) {
+				kill(client->pid, SIGKILL);
+				waitpid(client->pid, NULL, 0);
+				break;
+			}
+			bench_sleep_ns(1000000);
+		}
+		client->pid = -1;
+	}
+
+	if (client->stdout_fd >= 0) {
+		close(client->stdout_fd);
+		client->stdout_fd = -1;
+	}
+
+	if (client->sd >= 0) {
+		close(client->sd);
+		client->sd = -1;
+	}
+}
+
+static void *stream_writer_thread(void *arg)
+{
+	struct stream_writer *writer = arg;
+	size_t pos = 0;
+	ssize_t rc;
+	size_t len;
+
+	while (pos < writer->total) {
+		len = writer->total - pos;
+		if (len > sizeof(pattern)) {
+			len = sizeof(pattern);
+		}
+
+		rc = write(writer->fd, pattern, len);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			warn("Stream write failed");
+			break;
+		}
+		pos += rc;
+	}
+
+	return NULL;
+}
+
+/* Stream total bytes into in_fd, returning the time to read them at out_fd */
+static int measure_stream(int in_fd, int out_fd, size_t total,
+			  uint64_t *elapsed)
+{
+	struct stream_writer writer = { .fd = in_fd, .total = total };
+	uint8_t buf[STREAM_BUF_SIZE];
+	pthread_t thread;
+	size_t pos = 0;
+	uint64_t start;
+	ssize_t rc;
+
+	start = bench_now_ns();
+	if (pthread_create(&thread, NULL, stream_writer_thread, &writer)) {
+		warnx("pthread_create");
+		return -1;
+	}
+
+	while (pos < total) {
+		rc = read(out_fd, buf, sizeof(buf));
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			warnx("Stream ended after %zu of %zu bytes", pos, total);
+			break;
+		}
+		pos += rc;
+	}
+
+	*elapsed = bench_now_ns() - start;
+	pthread_join(thread, NULL);
+
+	return pos == total ? 0 : -1;
+}
+
+static int read_byte(int fd, uint8_t *c)
+{
+	ssize_t rc;
+
+	do {
+		rc = read(fd, c, 1);
+	} while (rc < 0 && errno == EINTR);
+
+	return rc == 1 ? 0 : -1;
+}
+
+/*
+ * A keystroke's round trip: from the client's stdin to the server, and
+ * the server's echo back to the client's stdout.
+ */
+static int measure_keystrokes(struct bench_client *client,
+			      unsigned int iterations,
+			      struct bench_samples *samples)
+{
+	uint64_t start;
+	unsigned int i;
+	uint8_t key;
+	uint8_t c;
+
+	for (i = 0; i < iterations; i++) {
+		key = 'a' + i % 26;
+		start = bench_now_ns();
+
+		if (write(client->stdin_fd, &key, 1) != 1 ||
+		    read_byte(client->sd, &c) || c != key ||
+		    write(client->sd, &c, 1) != 1 ||
+		    read_byte(client->stdout_fd, &c) || c != key) {
+			warnx("Keystroke %u was lost", i);
+			return -1;
+		}
+
+		bench_samples_add(samples, bench_now_ns() - start);
+	}
+
+	return 0;
+}
+
+static int run_mode(const char *name, const char *client_path,
+		    const char *escape, size_t total, unsigned int iterations,
+		    struct bench_client *client, bool verbose)
+{
+	struct bench_samples samples = { 0 };
+	char label[64];
+	uint64_t out_ns;
+	uint64_t in_ns;
+	int rc;
+
+	client->sd = -1;
+	client->stdin_fd = -1;
+	client->stdout_fd = -1;
+
+	rc = bench_client_spawn(client, client_path, escape, verbose);
+	if (rc) {
+		goto out;
+	}
+
+	rc = measure_stream(client->sd, client->stdout_fd, total, &out_ns);
+	if (rc) {
+		goto out;
+	}
+
+	rc = measure_stream(client->stdin_fd, client->sd, total, &in_ns);
+	if (rc) {
+		goto out;
+	}
+
+	rc = measure_keystrokes(client, iterations, &samples);
+	if (rc) {
+		goto out;
+	}
+
+	printf("%s: output=%.1fMB/s input=%.1fMB/s\n", name,
+	       (double)total * 1e3 / (double)out_ns,
+	       (double)total * 1e3 / (double)in_ns);
+	snprintf(label, sizeof(label), "%s-keystroke", name);
+	bench_report_latency(label, &samples);
+
+out:
+	bench_client_stop(client);
+	bench_samples_fini(&samples);
+	return rc;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] <CLIENT>\n"
+		"\n"
+		"Options:\n"
+		"  --bytes <SIZE>\t\tStream SIZE bytes each way (default 64m)\n"
+		"  --iterations <N>\tMeasure N keystrokes (default 1000)\n"
+		"  --verbose\t\tShow client output\n",
+		progname);
+}
+
+static const struct option options[] = {
+	{ "bytes", required_argument, 0, 'b' },
+	{ "iterations", required_argument, 0, 'n' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	struct bench_client client = { .listen_sd = -1 };
+	unsigned int iterations = 1000;
+	size_t total = 64 * 1024 * 1024;
+	bool verbose = false;
+	char *end;
+	int rc;
+
+	for (;;) {
+		int c;
+		int idx;
+
+		c = getopt_long(argc, argv, "", options, &idx);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		case 'b':
+			total = strtoull(optarg, &end, 0);
+			if (*end == 'k') {
+				total *= 1024;
+			} else if (*end == 'm') {
+				total *= 1024 * 1024;
+			}
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || !total || !iterations) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* a client that exits early shouldn't kill us with SIGPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	pattern_init();
+
+	rc = bench_listen(&client);
+	if (!rc) {
+		rc = run_mode("ssh-escape", argv[optind], NULL, total,
+			      iterations, &client, verbose);
+	}
+	if (!rc) {
+		rc = run_mode("str-escape", argv[optind], "~bench.", total,
+			      iterations, &client, verbose);
+	}
+
+	if (client.listen_sd >= 0) {
+		close(client.listen_sd);
+	}
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,833 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replay console traffic through obmc-console-server, as a repeatable load
+ * for benchmarking.
+ *
+ * The workload is one of:
+ *
+ *  - a raw capture of console output, replayed at a fixed byte rate;
+ *  - a script(1) typescript and its timing file, replayed with the captured
+ *    timing;
+ *  - a generated workload: "boot" (bursts of kernel log lines), "tui"
+ *    (full-screen redraws, as from a BIOS setup menu) or "idle" (occasional
+ *    short lines, as at a shell prompt).
+ *
+ * Timing may be scaled with --speed, or ignored with --max-speed. While the
+ * workload is written to the server's tty, reader clients consume the
+ * output, and typist clients send keystrokes, whose latency to the tty we
+ * measure.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench-util.c"
+
+#define MAX_TYPISTS	     26
+#define MAX_PENDING_KEYS     64
+#define RAW_CHUNK_SIZE	     64
+#define GENERATED_DURATION_S 5
+
+struct replay_chunk {
+	/* offset from the start of the replay, before scaling */
+	uint64_t at_ns;
+	size_t off;
+	size_t len;
+};
+
+struct replay {
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+	struct replay_chunk *chunks;
+	size_t n_chunks;
+	size_t chunks_alloc;
+};
+
+struct reader {
+	int fd;
+	uint64_t bytes;
+	uint64_t last_ns;
+};
+
+/* Keystrokes sent by a typist, and not yet seen on the tty */
+struct typist {
+	int fd;
+	char key;
+	uint64_t sent_ns[MAX_PENDING_KEYS];
+	unsigned int head;
+	unsigned int tail;
+	uint64_t sent;
+	uint64_t dropped;
+};
+
+struct bench {
+	struct bench_server server;
+	struct replay replay;
+	double speed;
+	bool max_speed;
+	unsigned int loops;
+
+	struct reader *readers;
+	unsigned int n_readers;
+	struct typist typists[MAX_TYPISTS];
+	unsigned int n_typists;
+	uint64_t key_interval_ns;
+
+	pthread_mutex_t lock;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t written;
+	uint64_t max_lag_ns;
+	volatile bool done;
+	volatile bool stop;
+
+	struct bench_samples key_latency;
+};
+
+static void replay_append(struct replay *r, uint64_t at_ns, const void *data,
+			  size_t len)
+{
+	struct replay_chunk *chunk;
+
+	if (r->len + len > r->alloc) {
+		r->alloc = (r->len + len) * 2;
+		r->data = realloc(r->data, r->alloc);
+		if (!r->data) {
+			err(EXIT_FAILURE, "Can't allocate replay data");
+		}
+	}
+
+	if (r->n_chunks == r->chunks_alloc) {
+		r->chunks_alloc = r->chunks_alloc ? r->chunks_alloc * 2 : 1024;
+		r->chunks = reallocarray(r->chunks, r->chunks_alloc,
+					 sizeof(*r->chunks));
+		if (!r->chunks) {
+			err(EXIT_FAILURE, "Can't allocate replay chunks");
+		}
+	}
+
+	chunk = &r->chunks[r->n_chunks++];
+	chunk->at_ns = at_ns;
+	chunk->off = r->len;
+	chunk->len = len;
+
+	memcpy(r->data + r->len, data, len);
+	r->len += len;
+}
+
+static uint8_t *read_file(const char *path, size_t *lenp)
+{
+	uint8_t *buf = NULL;
+	size_t alloc = 0;
+	size_t len = 0;
+	ssize_t rc;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		warn("Can't open %s", path);
+		return NULL;
+	}
+
+	for (;;) {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			buf = realloc(buf, alloc);
+			if (!buf) {
+				err(EXIT_FAILURE, "Can't allocate for %s",
+				    path);
+			}
+		}
+
+		rc = read(fd, buf + len, alloc - len);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0) {
+			warn("Can't read %s", path);
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+		if (rc == 0) {
+			break;
+		}
+		len += rc;
+	}
+
+	close(fd);
+	*lenp = len;
+	return buf;
+}
+
+/* A raw capture has no timing, so pace it at a fixed rate */
+static int replay_load_raw(struct replay *r, const char *path, uint64_t rate)
+{
+	uint64_t at_ns;
+	uint8_t *buf;
+	size_t len;
+	size_t off;
+	size_t n;
+
+	buf = read_file(path, &len);
+	if (!buf) {
+		return -1;
+	}
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < RAW_CHUNK_SIZE ? len - off : RAW_CHUNK_SIZE;
+		at_ns = (uint64_t)off * 1000000000ull / rate;
+		replay_append(r, at_ns, buf + off, n);
+	}
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * A script(1) capture: the timing file has a line per write, with the
+ * delay since the previous write in seconds, and the byte count. We also
+ * accept util-linux's "advanced" format, in which each line is prefixed
+ * with an entry type, and replay only the output ('O') entries.
+ */
+static int replay_load_script(struct replay *r, const char *path,
+			      const char *timing_path)
+{
+	char line[256];
+	double delay;
+	uint64_t at_ns = 0;
+	uint8_t *buf;
+	size_t len;
+	size_t off = 0;
+	size_t n;
+	char type;
+	FILE *fp;
+
+	buf = read_file(path, &len);
+	if (!buf) {
+		return -1;
+	}
+
+	/* skip the typescript header, as scriptreplay does */
+	if (len > 15 && !memcmp(buf, "Script started ", 15)) {
+		while (off < len && buf[off++] != '\n') {
+			;
+		}
+	}
+
+	fp = fopen(timing_path, "r");
+	if (!fp) {
+		warn("Can't open %s", timing_path);
+		free(buf);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		type = 'O';
+		if (sscanf(line, "%lf %zu", &delay, &n) != 2 &&
+		    sscanf(line, "%c %lf %zu", &type, &delay, &n) != 3) {
+			continue;
+		}
+
+		at_ns += (uint64_t)(delay * 1e9);
+		if (type != 'O') {
+			continue;
+		}
+
+		if (n > len - off) {
+			warnx("Timing file %s runs past the end of %s",
+			      timing_path, path);
+			n = len - off;
+		}
+
+		replay_append(r, at_ns, buf + off, n);
+		off += n;
+	}
+
+	fclose(fp);
+	free(buf);
+	return 0;
+}
+
+/* Bursts of kernel log lines, as when a host boots */
+static void replay_generate_boot(struct replay *r)
+{
+	uint64_t at_ns;
+	char line[128];
+	unsigned int i;
+	int len;
+
+	for (i = 0, at_ns = 0; at_ns < GENERATED_DURATION_S * 1000000000ull;
+	     i++) {
+		len = snprintf(line, sizeof(line),
+			       "[%5u.%06u] pci 0000:%02x:%02x.0: [8086:%04x] type 00 class 0x%06x\r\n",
+			       i / 1000, (i % 1000) * 997, i % 256, i % 32,
+			       (i * 7919) & 0xffff, (i * 104729) & 0xffffff);
+		replay_append(r, at_ns, line, len);
+
+		/* 20-line bursts, 10ms apart */
+		if (i % 20 == 19) {
+			at_ns += 10000000ull;
+		}
+	}
+}
+
+/* Full-screen redraws of an 80x25 menu, as from a BIOS setup utility */
+static void replay_generate_tui(struct replay *r)
+{
+	char screen[8192];
+	unsigned int frame;
+	unsigned int row;
+	unsigned int sel;
+	size_t len;
+
+	for (frame = 0; frame < GENERATED_DURATION_S * 10; frame++) {
+		sel = frame % 20;
+		len = snprintf(screen, sizeof(screen), "\x1b[0m\x1b[2J\x1b[H");
+		for (row = 0; row < 25; row++) {
+			len += snprintf(screen + len, sizeof(screen) - len,
+					"\x1b[%u;1H%s %-20s %-50s\x1b[0m", row + 1,
+					row == sel ? "\x1b[7m" : "\x1b[44;37m",
+					"Setup Item", "[Enabled]");
+		}
+		replay_append(r, frame * 100000000ull, screen, len);
+	}
+}
+
+/* Short bursts of output with long gaps, as at an idle shell prompt */
+static void replay_generate_idle(struct replay *r)
+{
+	static const char prompt[] = "\r\nroot@host:~# ";
+	unsigned int i;
+
+	for (i = 0; i < GENERATED_DURATION_S * 2; i++) {
+		replay_append(r, i * 500000000ull, prompt, strlen(prompt));
+	}
+}
+
+static int replay_generate(struct replay *r, const char *name)
+{
+	if (!strcmp(name, "boot")) {
+		replay_generate_boot(r);
+	} else if (!strcmp(name, "tui")) {
+		replay_generate_tui(r);
+	} else if (!strcmp(name, "idle")) {
+		replay_generate_idle(r);
+	} else {
+		warnx("Unknown workload '%s'", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t rc;
+	size_t pos;
+
+	for (pos = 0; pos < len; pos += rc) {
+		rc = write(fd, buf + pos, len - pos);
+		if (rc < 0 && errno == EINTR) {
+			rc = 0;
+			continue;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct replay *r = &bench->replay;
+	struct replay_chunk *chunk;
+	uint64_t loop_start;
+	uint64_t now;
+	uint64_t due;
+	unsigned int loop;
+	size_t i;
+
+	loop_start = bench->start_ns;
+
+	for (loop = 0; loop < bench->loops; loop++) {
+		for (i = 0; i < r->n_chunks; i++) {
+			chunk = &r->chunks[i];
+			now = bench_now_ns();
+
+			if (!bench->max_speed) {
+				due = loop_start +
+				      (uint64_t)((double)chunk->at_ns /
+						 bench->speed);
+				if (due > now) {
+					bench_sleep_ns(due - now);
+				} else if (now - due > bench->max_lag_ns) {
+					bench->max_lag_ns = now - due;
+				}
+			}
+
+			if (write_all(bench->server.master,
+				      r->data + chunk->off, chunk->len)) {
+				warn("Write to tty failed");
+				goto out;
+			}
+			bench->written += chunk->len;
+		}
+		loop_start = bench_now_ns();
+	}
+
+out:
+	bench->end_ns = bench_now_ns();
+	bench->done = true;
+	return NULL;
+}
+
+/*
+ * Consume the output sent to the reader clients. The typists receive the
+ * same output, which we discard, so they don't stall the server.
+ */
+static void *reader_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct pollfd *pollfds;
+	struct reader *reader;
+	uint8_t buf[4096];
+	uint64_t drain_end = 0;
+	unsigned int n_fds;
+	uint64_t now;
+	unsigned int i;
+	ssize_t rc;
+
+	n_fds = bench->n_readers + bench->n_typists;
+	pollfds = calloc(n_fds, sizeof(*pollfds));
+	if (!pollfds) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (i = 0; i < n_fds; i++) {
+		pollfds[i].fd = i < bench->n_readers ?
+					bench->readers[i].fd :
+					bench->typists[i - bench->n_readers].fd;
+		pollfds[i].events = POLLIN;
+	}
+
+	for (;;) {
+		now = bench_now_ns();
+
+		/* let the readers catch up after the writer has finished */
+		if (bench->done && !drain_end) {
+			drain_end = now + 1000000000ull;
+		}
+		if (drain_end && now > drain_end) {
+			break;
+		}
+
+		if (poll(pollfds, n_fds, 10) < 0 && errno != EINTR) {
+			err(EXIT_FAILURE, "poll");
+		}
+
+		now = bench_now_ns();
+		for (i = 0; i < n_fds; i++) {
+			if (!pollfds[i].revents) {
+				continue;
+			}
+
+			rc = recv(pollfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (rc <= 0) {
+				if (rc < 0 && errno == EAGAIN) {
+					continue;
+				}
+				pollfds[i].fd = -1;
+				continue;
+			}
+
+			if (i >= bench->n_readers) {
+				continue;
+			}
+
+			reader = &bench->readers[i];
+			reader->bytes += rc;
+			reader->last_ns = now;
+		}
+	}
+
+	free(pollfds);
+	return NULL;
+}
+
+/* Send a keystroke from each typist in turn */
+static void *typist_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct typist *typist;
+	unsigned int i = 0;
+	uint64_t now;
+
+	while (!bench->stop) {
+		typist = &bench->typists[i++ % bench->n_typists];
+
+		pthread_mutex_lock(&bench->lock);
+		now = bench_now_ns();
+		if (typist->tail - typist->head == MAX_PENDING_KEYS) {
+			typist->dropped++;
+		} else if (send(typist->fd, &typist->key, 1, MSG_NOSIGNAL) ==
+			   1) {
+			typist->sent_ns[typist->tail++ % MAX_PENDING_KEYS] =
+				now;
+			typist->sent++;
+		}
+		pthread_mutex_unlock(&bench->lock);
+
+		bench_sleep_ns(bench->key_interval_ns / bench->n_typists);
+	}
+
+	return NULL;
+}
+
+/* Match keystrokes arriving at the tty against those the typists sent */
+static void *keys_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct typist *typist;
+	struct pollfd pollfd;
+	uint8_t buf[256];
+	uint64_t now;
+	ssize_t rc;
+	ssize_t i;
+
+	pollfd.fd = bench->server.master;
+	pollfd.events = POLLIN;
+
+	while (!bench->stop) {
+		if (poll(&pollfd, 1, 10) <= 0) {
+			continue;
+		}
+
+		rc = read(bench->server.master, buf, sizeof(buf));
+		if (rc <= 0) {
+			continue;
+		}
+
+		now = bench_now_ns();
+		pthread_mutex_lock(&bench->lock);
+		for (i = 0; i < rc; i++) {
+			if (buf[i] < 'a' || buf[i] >= 'a' + bench->n_typists) {
+				continue;
+			}
+
+			typist = &bench->typists[buf[i] - 'a'];
+			if (typist->head == typist->tail) {
+				continue;
+			}
+
+			bench_samples_add(
+				&bench->key_latency,
+				now - typist->sent_ns[typist->head++ %
+						      MAX_PENDING_KEYS]);
+		}
+		pthread_mutex_unlock(&bench->lock);
+	}
+
+	return NULL;
+}
+
+static void report(struct bench *bench)
+{
+	uint64_t expected = bench->replay.len * bench->loops;
+	uint64_t elapsed = bench->end_ns - bench->start_ns;
+	struct reader *reader;
+	uint64_t sent = 0;
+	uint64_t dropped = 0;
+	unsigned int i;
+
+	printf("replay: bytes=%" PRIu64 " duration=%.3fs rate=%.0fB/s"
+	       " max-lag=%.3fms\n",
+	       bench->written, (double)elapsed / 1e9,
+	       (double)bench->written * 1e9 / (double)elapsed,
+	       (double)bench->max_lag_ns / 1e6);
+
+	for (i = 0; i < bench->n_readers; i++) {
+		reader = &bench->readers[i];
+		printf("reader%u: bytes=%" PRIu64 " missing=%" PRIu64
+		       " tail=%.3fms\n",
+		       i, reader->bytes,
+		       reader->bytes < expected ? expected - reader->bytes : 0,
+		       reader->last_ns > bench->end_ns ?
+			       (double)(reader->last_ns - bench->end_ns) / 1e6 :
+			       0.0);
+	}
+
+	if (bench->n_typists) {
+		for (i = 0; i < bench->n_typists; i++) {
+			sent += bench->typists[i].sent;
+			dropped += bench->typists[i].dropped;
+		}
+		printf("keys: sent=%" PRIu64 " received=%zu backlogged=%" PRIu64
+		       "\n",
+		       sent, bench->key_latency.n, dropped);
+		bench_report_latency("key-latency", &bench->key_latency);
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] <SERVER>\n"
+		"\n"
+		"Workload, one of:\n"
+		"  --raw <FILE>\t\tReplay a raw capture at --rate\n"
+		"  --script <FILE>\tReplay a script(1) typescript...\n"
+		"  --timing <FILE>\t...with its timing file\n"
+		"  --generate <NAME>\tGenerate a boot, tui or idle workload\n"
+		"\n"
+		"Options:\n"
+		"  --rate <BPS>\t\tRaw replay rate (default 11520)\n"
+		"  --speed <X>\t\tScale the workload's timing by X (default 1)\n"
+		"  --max-speed\t\tIgnore the workload's timing\n"
+		"  --loops <N>\t\tReplay the workload N times (default 1)\n"
+		"  --readers <N>\t\tConnect N reader clients (default 1)\n"
+		"  --typists <N>\t\tConnect N typing clients (default 0)\n"
+		"  --key-interval <MS>\tEach typist types every MS milliseconds\n"
+		"\t\t\t(default 100)\n"
+		"  --ringbuffer-size <SIZE>\tServer ringbuffer size\n"
+		"  --verbose\t\tShow server output\n",
+		progname);
+}
+
+static const struct option options[] = {
+	{ "raw", required_argument, 0, 'R' },
+	{ "script", required_argument, 0, 's' },
+	{ "timing", required_argument, 0, 't' },
+	{ "generate", required_argument, 0, 'g' },
+	{ "rate", required_argument, 0, 'r' },
+	{ "speed", required_argument, 0, 'x' },
+	{ "max-speed", no_argument, 0, 'm' },
+	{ "loops", required_argument, 0, 'l' },
+	{ "readers", required_argument, 0, 'n' },
+	{ "typists", required_argument, 0, 'k' },
+	{ "key-interval", required_argument, 0, 'i' },
+	{ "ringbuffer-size", required_argument, 0, 'b' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	const char *script_path = NULL;
+	const char *timing_path = NULL;
+	const char *generate = NULL;
+	const char *raw_path = NULL;
+	char extra_config[64] = "";
+	struct bench _bench = { 0 };
+	struct bench *bench = &_bench;
+	pthread_t typist = 0;
+	pthread_t writer;
+	pthread_t reader;
+	pthread_t keys;
+	bool verbose = false;
+	uint64_t rate = 11520;
+	unsigned int i;
+	int probe;
+	int rc;
+
+	bench->speed = 1.0;
+	bench->loops = 1;
+	bench->n_readers = 1;
+	bench->key_interval_ns = 100000000ull;
+	pthread_mutex_init(&bench->lock, NULL);
+
+	for (;;) {
+		int c;
+		int idx;
+
+		c = getopt_long(argc, argv, "", options, &idx);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		case 'R':
+			raw_path = optarg;
+			break;
+		case 's':
+			script_path = optarg;
+			break;
+		case 't':
+			timing_path = optarg;
+			break;
+		case 'g':
+			generate = optarg;
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'x':
+			bench->speed = strtod(optarg, NULL);
+			break;
+		case 'm':
+			bench->max_speed = true;
+			break;
+		case 'l':
+			bench->loops = atoi(optarg);
+			break;
+		case 'n':
+			bench->n_readers = atoi(optarg);
+			break;
+		case 'k':
+			bench->n_typists = atoi(optarg);
+			break;
+		case 'i':
+			bench->key_interval_ns =
+				strtoull(optarg, NULL, 0) * 1000000ull;
+			break;
+		case 'b':
+			snprintf(extra_config, sizeof(extra_config),
+				 "ringbuffer-size = %s", optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || !rate || bench->speed <= 0 ||
+	    bench->n_typists > MAX_TYPISTS || !bench->n_readers ||
+	    !!raw_path + !!script_path + !!generate != 1 ||
+	    !script_path != !timing_path) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (raw_path) {
+		rc = replay_load_raw(&bench->replay, raw_path, rate);
+	} else if (script_path) {
+		rc = replay_load_script(&bench->replay, script_path,
+					timing_path);
+	} else {
+		rc = replay_generate(&bench->replay, generate);
+	}
+	if (rc) {
+		return EXIT_FAILURE;
+	}
+
+	bench->readers = calloc(bench->n_readers, sizeof(*bench->readers));
+	if (!bench->readers) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (i = 0; i < bench->n_readers; i++) {
+		bench->readers[i].fd = -1;
+	}
+	for (i = 0; i < bench->n_typists; i++) {
+		bench->typists[i].fd = -1;
+	}
+
+	rc = bench_server_spawn(&bench->server, argv[optind], extra_config,
+				verbose);
+	if (rc) {
+		goto out;
+	}
+
+	probe = bench_server_wait(&bench->server, 5000000000ull);
+	if (probe < 0) {
+		rc = -1;
+		goto out;
+	}
+	close(probe);
+
+	for (i = 0; i < bench->n_readers; i++) {
+		bench->readers[i].fd =
+			bench_client_connect(bench->server.console_id);
+		if (bench->readers[i].fd < 0) {
+			warn("Can't connect reader");
+			rc = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < bench->n_typists; i++) {
+		bench->typists[i].key = (char)('a' + i);
+		bench->typists[i].fd =
+			bench_client_connect(bench->server.console_id);
+		if (bench->typists[i].fd < 0) {
+			warn("Can't connect typist");
+			rc = -1;
+			goto out;
+		}
+	}
+
+	/* give the server a chance to accept all of our clients */
+	bench_sleep_ns(100000000ull);
+
+	bench->start_ns = bench_now_ns();
+	if (pthread_create(&reader, NULL, reader_thread, bench) ||
+	    pthread_create(&keys, NULL, keys_thread, bench) ||
+	    (bench->n_typists &&
+	     pthread_create(&typist, NULL, typist_thread, bench)) ||
+	    pthread_create(&writer, NULL, writer_thread, bench)) {
+		err(EXIT_FAILURE, "pthread_create");
+	}
+
+	pthread_join(writer, NULL);
+	pthread_join(reader, NULL);
+	bench->stop = true;
+	if (bench->n_typists) {
+		pthread_join(typist, NULL);
+	}
+	pthread_join(keys, NULL);
+
+	report(bench);
+
+out:
+	bench_server_stop(&bench->server);
+
+	for (i = 0; i < bench->n_readers; i++) {
+		if (bench->readers[i].fd >= 0) {
+			close(bench->readers[i].fd);
+		}
+	}
+	for (i = 0; i < bench->n_typists; i++) {
+		if (bench->typists[i].fd >= 0) {
+			close(bench->typists[i].fd);
+		}
+	}
+	bench_samples_fini(&bench->key_latency);
+	free(bench->readers);
+	free(bench->replay.data);
+	free(bench->replay.chunks);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
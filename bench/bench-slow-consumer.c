@@ -0,0 +1,549 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure the impact of slow, stalled and disconnecting socket clients on
+ * console ingest and on the other clients.
+ *
+ * We feed timestamped, sequence-numbered frames into the server's tty (a
+ * PTY) at a fixed rate, and report:
+ *
+ *  - ingest: how long writes to the tty were held up, and how far behind
+ *    schedule the writer fell, i.e. how long the server wasn't reading the
+ *    UART;
+ *  - for each class of client: frame latency, frames lost and whether the
+ *    server dropped the client.
+ *
+ * Client classes:
+ *
+ *  - normal: reads everything as soon as it can
+ *  - slow: reads at a limited rate (--slow-rate)
+ *  - stalled: stops reading for --stall-ms, then resumes
+ *  - disconnecting: stops reading for --stall-ms, then closes its socket
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench-util.c"
+
+#define FRAME_MAGIC 0x434d424fu /* "OBMC" */
+
+struct frame {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t ts_ns;
+};
+
+enum client_class {
+	CLIENT_NORMAL = 0,
+	CLIENT_SLOW,
+	CLIENT_STALLED,
+	CLIENT_DISCONNECTING,
+	N_CLIENT_CLASSES,
+};
+
+static const char *client_class_names[] = {
+	[CLIENT_NORMAL] = "normal",
+	[CLIENT_SLOW] = "slow",
+	[CLIENT_STALLED] = "stalled",
+	[CLIENT_DISCONNECTING] = "disconnecting",
+};
+
+struct client {
+	enum client_class class;
+	int fd;
+	bool closed;
+	bool dropped;
+
+	/* partial frame carried between reads */
+	uint8_t buf[sizeof(struct frame)];
+	size_t buf_len;
+
+	uint64_t bytes;
+	uint32_t next_seq;
+	uint64_t frames;
+	uint64_t lost;
+
+	/* rate limiting for slow clients */
+	uint64_t next_read_ns;
+};
+
+struct class_stats {
+	struct bench_samples latency;
+	uint64_t frames;
+	uint64_t lost;
+	unsigned int dropped;
+};
+
+struct bench {
+	struct bench_server server;
+	uint64_t duration_ns;
+	uint64_t rate;
+	uint64_t slow_rate;
+	uint64_t stall_ns;
+	unsigned int n_clients[N_CLIENT_CLASSES];
+
+	struct client *clients;
+	unsigned int n_total;
+
+	/* writer results */
+	uint64_t start_ns;
+	uint32_t sent;
+	struct bench_samples write_latency;
+	uint64_t max_lag_ns;
+	/* set by the writer thread, with __atomic_store_n() */
+	bool done;
+
+	struct class_stats stats[N_CLIENT_CLASSES];
+};
+
+static void *writer_thread(void *arg)
+{
+	struct bench *bench = arg;
+	uint64_t interval_ns;
+	uint64_t now;
+	uint64_t due;
+	struct frame frame;
+	ssize_t rc;
+	size_t pos;
+
+	interval_ns = 1000000000ull * sizeof(frame) / bench->rate;
+
+	for (;;) {
+		due = bench->start_ns + (uint64_t)bench->sent * interval_ns;
+		now = bench_now_ns();
+
+		if (now - bench->start_ns >= bench->duration_ns) {
+			break;
+		}
+
+		if (due > now) {
+			bench_sleep_ns(due - now);
+			now = bench_now_ns();
+		} else if (now - due > bench->max_lag_ns) {
+			bench->max_lag_ns = now - due;
+		}
+
+		frame.magic = FRAME_MAGIC;
+		frame.seq = bench->sent;
+		frame.ts_ns = now;
+
+		for (pos = 0; pos < sizeof(frame); pos += rc) {
+			rc = write(bench->server.master, (uint8_t *)&frame + pos,
+				   sizeof(frame) - pos);
+			if (rc < 0 && errno == EINTR) {
+				rc = 0;
+				continue;
+			}
+			if (rc <= 0) {
+				warn("Write to tty failed");
+				goto out;
+			}
+		}
+
+		bench_samples_add(&bench->write_latency, bench_now_ns() - now);
+		bench->sent++;
+	}
+
+out:
+	__atomic_store_n(&bench->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void client_process(struct bench *bench, struct client *client,
+			   const uint8_t *data, size_t len, uint64_t now)
+{
+	struct class_stats *stats = &bench->stats[client->class];
+	struct frame frame;
+	size_t n;
+
+	client->bytes += len;
+
+	while (len) {
+		n = sizeof(frame) - client->buf_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(client->buf + client->buf_len, data, n);
+		client->buf_len += n;
+		data += n;
+		len -= n;
+
+		if (client->buf_len < sizeof(frame)) {
+			break;
+		}
+
+		memcpy(&frame, client->buf, sizeof(frame));
+		if (frame.magic != FRAME_MAGIC) {
+			/* resynchronise on the next byte */
+			memmove(client->buf, client->buf + 1,
+				--client->buf_len);
+			continue;
+		}
+		client->buf_len = 0;
+
+		if (frame.seq > client->next_seq) {
+			client->lost += frame.seq - client->next_seq;
+		}
+		client->next_seq = frame.seq + 1;
+		client->frames++;
+
+		bench_samples_add(&stats->latency, now - frame.ts_ns);
+	}
+}
+
+static bool client_stalled(struct bench *bench, struct client *client,
+			   uint64_t now)
+{
+	if (client->class != CLIENT_STALLED &&
+	    client->class != CLIENT_DISCONNECTING) {
+		return false;
+	}
+
+	if (now - bench->start_ns < bench->stall_ns) {
+		return true;
+	}
+
+	if (client->class == CLIENT_DISCONNECTING && !client->closed) {
+		close(client->fd);
+		client->closed = true;
+	}
+
+	return client->class == CLIENT_DISCONNECTING;
+}
+
+static void client_read(struct bench *bench, struct client *client,
+			uint64_t now)
+{
+	uint8_t buf[4096];
+	size_t len = sizeof(buf);
+	ssize_t rc;
+
+	if (client->class == CLIENT_SLOW) {
+		if (now < client->next_read_ns) {
+			return;
+		}
+		/* read in 64-byte chunks, paced to the configured rate */
+		len = 64;
+		client->next_read_ns =
+			now + 1000000000ull * len / bench->slow_rate;
+	}
+
+	rc = recv(client->fd, buf, len, MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+
+	if (rc <= 0) {
+		client->dropped = true;
+		client->closed = true;
+		close(client->fd);
+		return;
+	}
+
+	client_process(bench, client, buf, rc, now);
+}
+
+static void run_readers(struct bench *bench)
+{
+	struct pollfd *pollfds;
+	struct client *client;
+	bool draining = false;
+	uint64_t drain_end = 0;
+	uint64_t now;
+	unsigned int i;
+
+	pollfds = calloc(bench->n_total, sizeof(*pollfds));
+	if (!pollfds) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (;;) {
+		now = bench_now_ns();
+
+		/* let clients catch up for a little while after the writer
+		 * has finished */
+		if (!draining &&
+		    __atomic_load_n(&bench->done, __ATOMIC_ACQUIRE)) {
+			draining = true;
+			drain_end = now + 1000000000ull;
+		}
+		if (draining && now > drain_end) {
+			break;
+		}
+
+		for (i = 0; i < bench->n_total; i++) {
+			client = &bench->clients[i];
+			pollfds[i].fd = -1;
+			pollfds[i].events = POLLIN;
+
+			if (client->closed || client_stalled(bench, client, now)) {
+				continue;
+			}
+
+			if (client->class == CLIENT_SLOW &&
+			    now < client->next_read_ns) {
+				continue;
+			}
+
+			pollfds[i].fd = client->fd;
+		}
+
+		if (poll(pollfds, bench->n_total, 1) < 0 && errno != EINTR) {
+			err(EXIT_FAILURE, "poll");
+		}
+
+		now = bench_now_ns();
+		for (i = 0; i < bench->n_total; i++) {
+			if (pollfds[i].fd >= 0 && pollfds[i].revents) {
+				client_read(bench, &bench->clients[i], now);
+			}
+		}
+	}
+
+	free(pollfds);
+}
+
+static void report(struct bench *bench)
+{
+	struct class_stats *stats;
+	struct client *client;
+	char name[64];
+	unsigned int i;
+	uint64_t elapsed;
+
+	elapsed = bench_now_ns() - bench->start_ns;
+
+	for (i = 0; i < bench->n_total; i++) {
+		client = &bench->clients[i];
+		stats = &bench->stats[client->class];
+		stats->frames += client->frames;
+		/* frames never received at all count as lost too */
+		stats->lost += client->lost + (bench->sent - client->next_seq);
+		stats->dropped += client->dropped;
+	}
+
+	printf("ingest: frames=%u rate=%.0fB/s target=%" PRIu64
+	       "B/s max-lag=%.3fms\n",
+	       bench->sent,
+	       (double)bench->sent * sizeof(struct frame) * 1e9 /
+		       (double)elapsed,
+	       bench->rate, (double)bench->max_lag_ns / 1e6);
+	bench_report_latency("ingest-write", &bench->write_latency);
+
+	for (i = 0; i < N_CLIENT_CLASSES; i++) {
+		if (!bench->n_clients[i]) {
+			continue;
+		}
+		stats = &bench->stats[i];
+		printf("%s: clients=%u frames=%" PRIu64 " lost=%" PRIu64
+		       " dropped=%u\n",
+		       client_class_names[i], bench->n_clients[i],
+		       stats->frames, stats->lost, stats->dropped);
+		snprintf(name, sizeof(name), "%s-latency",
+			 client_class_names[i]);
+		bench_report_latency(name, &stats->latency);
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] <SERVER>\n"
+		"\n"
+		"Options:\n"
+		"  --duration <MS>\tRun for MS milliseconds (default 3000)\n"
+		"  --rate <BPS>\t\tWrite BPS bytes/s to the tty (default 11520)\n"
+		"  --normal <N>\t\tConnect N normal clients (default 2)\n"
+		"  --slow <N>\t\tConnect N slow clients (default 1)\n"
+		"  --slow-rate <BPS>\tSlow clients read BPS bytes/s (default 2048)\n"
+		"  --stalled <N>\t\tConnect N stalled clients (default 1)\n"
+		"  --disconnecting <N>\tConnect N disconnecting clients (default 1)\n"
+		"  --stall-ms <MS>\tStall clients for MS milliseconds (default 1000)\n"
+		"  --ringbuffer-size <SIZE>\tServer ringbuffer size\n"
+		"  --verbose\t\tShow server output\n",
+		progname);
+}
+
+static const struct option options[] = {
+	{ "duration", required_argument, 0, 'd' },
+	{ "rate", required_argument, 0, 'r' },
+	{ "normal", required_argument, 0, 'n' },
+	{ "slow", required_argument, 0, 's' },
+	{ "slow-rate", required_argument, 0, 'S' },
+	{ "stalled", required_argument, 0, 't' },
+	{ "disconnecting", required_argument, 0, 'x' },
+	{ "stall-ms", required_argument, 0, 'T' },
+	{ "ringbuffer-size", required_argument, 0, 'b' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	char extra_config[64] = "";
+	struct bench _bench = { 0 };
+	struct bench *bench = &_bench;
+	struct client *client;
+	bool verbose = false;
+	pthread_t writer;
+	unsigned int i;
+	unsigned int j;
+	int probe;
+	int rc;
+
+	bench->duration_ns = 3000ull * 1000000ull;
+	bench->rate = 11520;
+	bench->slow_rate = 2048;
+	bench->stall_ns = 1000ull * 1000000ull;
+	bench->n_clients[CLIENT_NORMAL] = 2;
+	bench->n_clients[CLIENT_SLOW] = 1;
+	bench->n_clients[CLIENT_STALLED] = 1;
+	bench->n_clients[CLIENT_DISCONNECTING] = 1;
+
+	for (;;) {
+		int c;
+		int idx;
+
+		c = getopt_long(argc, argv, "", options, &idx);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		case 'd':
+			bench->duration_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+			break;
+		case 'r':
+			bench->rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			bench->n_clients[CLIENT_NORMAL] = atoi(optarg);
+			break;
+		case 's':
+			bench->n_clients[CLIENT_SLOW] = atoi(optarg);
+			break;
+		case 'S':
+			bench->slow_rate = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			bench->n_clients[CLIENT_STALLED] = atoi(optarg);
+			break;
+		case 'x':
+			bench->n_clients[CLIENT_DISCONNECTING] = atoi(optarg);
+			break;
+		case 'T':
+			bench->stall_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+			break;
+		case 'b':
+			snprintf(extra_config, sizeof(extra_config),
+				 "ringbuffer-size = %s", optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || !bench->rate || !bench->slow_rate) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < N_CLIENT_CLASSES; i++) {
+		bench->n_total += bench->n_clients[i];
+	}
+
+	bench->clients = calloc(bench->n_total, sizeof(*bench->clients));
+	if (!bench->clients) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	rc = bench_server_spawn(&bench->server, argv[optind], extra_config,
+				verbose);
+	if (rc) {
+		goto out;
+	}
+
+	probe = bench_server_wait(&bench->server, 5000000000ull);
+	if (probe < 0) {
+		rc = -1;
+		goto out;
+	}
+	close(probe);
+
+	client = bench->clients;
+	for (i = 0; i < N_CLIENT_CLASSES; i++) {
+		for (j = 0; j < bench->n_clients[i]; j++, client++) {
+			client->class = i;
+			client->fd = bench_client_connect(
+				bench->server.console_id);
+			if (client->fd < 0) {
+				warn("Can't connect client");
+				rc = -1;
+				goto out;
+			}
+		}
+	}
+
+	/* give the server a chance to accept all of our clients */
+	bench_sleep_ns(100000000ull);
+
+	bench->start_ns = bench_now_ns();
+	rc = pthread_create(&writer, NULL, writer_thread, bench);
+	if (rc) {
+		errno = rc;
+		warn("pthread_create");
+		goto out;
+	}
+
+	run_readers(bench);
+	pthread_join(writer, NULL);
+
+	report(bench);
+
+out:
+	bench_server_stop(&bench->server);
+
+	for (i = 0; i < bench->n_total; i++) {
+		if (bench->clients[i].fd > 0 && !bench->clients[i].closed) {
+			close(bench->clients[i].fd);
+		}
+	}
+	for (i = 0; i < N_CLIENT_CLASSES; i++) {
+		bench_samples_fini(&bench->stats[i].latency);
+	}
+	bench_samples_fini(&bench->write_latency);
+	free(bench->clients);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
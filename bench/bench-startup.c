@@ -0,0 +1,186 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure server startup time: how long after exec the server accepts
+ * socket clients, and how long until console output that the host wrote
+ * during startup reaches the log.
+ *
+ * The host output is written to the PTY as soon as the server is spawned,
+ * so it sits in the PTY until the server starts ingesting the tty.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench-util.c"
+
+static const char marker[] = "obmc-console-bench-startup\n";
+
+/* Check whether the marker has reached the server's log */
+static bool log_has_marker(const char *path)
+{
+	char buf[256];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return false;
+	}
+	buf[len] = '\0';
+
+	return strstr(buf, marker) != NULL;
+}
+
+static int run_one(const char *server_path, bool verbose,
+		   struct bench_samples *socket_ready,
+		   struct bench_samples *log_ready)
+{
+	struct bench_server server;
+	uint64_t t_socket = 0;
+	uint64_t t_log = 0;
+	uint64_t deadline;
+	uint64_t start;
+	int rc = -1;
+	int fd;
+
+	start = bench_now_ns();
+	if (bench_server_spawn(&server, server_path, NULL, verbose)) {
+		goto out;
+	}
+
+	if (write(server.master, marker, strlen(marker)) < 0) {
+		warn("Can't write to pty");
+		goto out;
+	}
+
+	deadline = start + 5000000000ull;
+	while (!t_socket || !t_log) {
+		if (!t_socket) {
+			fd = bench_client_connect(server.console_id);
+			if (fd >= 0) {
+				t_socket = bench_now_ns();
+				close(fd);
+			}
+		}
+
+		if (!t_log && log_has_marker(server.log_path)) {
+			t_log = bench_now_ns();
+		}
+
+		if (bench_now_ns() > deadline) {
+			warnx("Timed out waiting for server startup");
+			goto out;
+		}
+
+		bench_sleep_ns(50000);
+	}
+
+	bench_samples_add(socket_ready, t_socket - start);
+	bench_samples_add(log_ready, t_log - start);
+	rc = 0;
+
+out:
+	bench_server_stop(&server);
+	return rc;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] <SERVER>\n"
+		"\n"
+		"Options:\n"
+		"  --iterations <N>\tStart the server N times (default 20)\n"
+		"  --verbose\t\tShow server output\n",
+		progname);
+}
+
+static const struct option options[] = {
+	{ "iterations", required_argument, 0, 'n' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	struct bench_samples socket_ready = { 0 };
+	struct bench_samples log_ready = { 0 };
+	unsigned int iterations = 20;
+	bool verbose = false;
+	unsigned int i;
+	int rc = 0;
+
+	for (;;) {
+		int c;
+		int idx;
+
+		c = getopt_long(argc, argv, "", options, &idx);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || !iterations) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		rc = run_one(argv[optind], verbose, &socket_ready, &log_ready);
+		if (rc) {
+			break;
+		}
+	}
+
+	if (!rc) {
+		bench_report_latency("socket-ready", &socket_ready);
+		bench_report_latency("log-ready", &log_ready);
+	}
+
+	bench_samples_fini(&socket_ready);
+	bench_samples_fini(&log_ready);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
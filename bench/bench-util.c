@@ -0,0 +1,326 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Common infrastructure for the benchmarks: run an obmc-console-server
+ * instance against a PTY that we drive, and connect clients to it.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "console-server.h"
+
+struct bench_server {
+	char dir[64];
+	char config_path[96];
+	char log_path[96];
+	char console_id[32];
+	const char *pts;
+	int master;
+	pid_t pid;
+};
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void bench_sleep_ns(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = (time_t)(ns / 1000000000ull),
+		.tv_nsec = (long)(ns % 1000000000ull),
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR) {
+		;
+	}
+}
+
+/* Open a raw PTY master, returning the slave path in *pts */
+int bench_pty_open(const char **pts)
+{
+	struct termios termios;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		warn("posix_openpt");
+		return -1;
+	}
+
+	if (grantpt(fd) || unlockpt(fd)) {
+		warn("Can't unlock pty");
+		close(fd);
+		return -1;
+	}
+
+	if (!tcgetattr(fd, &termios)) {
+		cfmakeraw(&termios);
+		tcsetattr(fd, TCSANOW, &termios);
+	}
+
+	*pts = ptsname(fd);
+	if (!*pts) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Write a configuration file for the server. The caller provides any extra
+ * configuration lines in extra_config, which may be NULL.
+ */
+static int bench_server_write_config(struct bench_server *server,
+				     const char *extra_config)
+{
+	FILE *fp;
+
+	fp = fopen(server->config_path, "w");
+	if (!fp) {
+		warn("Can't create %s", server->config_path);
+		return -1;
+	}
+
+	fprintf(fp, "console-id = %s\n", server->console_id);
+	fprintf(fp, "logfile = %s\n", server->log_path);
+	if (extra_config) {
+		fprintf(fp, "%s\n", extra_config);
+	}
+
+	return fclose(fp);
+}
+
+/* Fork and exec the server; doesn't wait for it to be ready */
+int bench_server_spawn(struct bench_server *server, const char *server_path,
+		       const char *extra_config, bool verbose)
+{
+	int devnull;
+
+	memset(server, 0, sizeof(*server));
+	server->master = -1;
+	server->pid = -1;
+
+	snprintf(server->dir, sizeof(server->dir),
+		 "/tmp/obmc-console-bench.XXXXXX");
+	if (!mkdtemp(server->dir)) {
+		warn("mkdtemp");
+		return -1;
+	}
+
+	snprintf(server->config_path, sizeof(server->config_path),
+		 "%s/server.conf", server->dir);
+	snprintf(server->log_path, sizeof(server->log_path), "%s/console.log",
+		 server->dir);
+	snprintf(server->console_id, sizeof(server->console_id), "bench%d",
+		 getpid());
+
+	if (bench_server_write_config(server, extra_config)) {
+		return -1;
+	}
+
+	server->master = bench_pty_open(&server->pts);
+	if (server->master < 0) {
+		return -1;
+	}
+
+	server->pid = fork();
+	if (server->pid < 0) {
+		warn("fork");
+		return -1;
+	}
+
+	if (!server->pid) {
+		if (!verbose) {
+			devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		execl(server_path, server_path, "--config", server->config_path,
+		      server->pts, NULL);
+		err(EXIT_FAILURE, "Can't execute %s", server_path);
+	}
+
+	return 0;
+}
+
+/* Connect a client to the server's socket, returning the fd or -1 */
+int bench_client_connect(const char *console_id)
+{
+	struct sockaddr_un addr;
+	ssize_t len;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = console_socket_path(addr.sun_path, console_id);
+	if (len < 0) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr,
+		    sizeof(addr) - sizeof(addr.sun_path) + len)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Wait for the server to accept connections; returns a connected client */
+int bench_server_wait(struct bench_server *server, uint64_t timeout_ns)
+{
+	uint64_t deadline = bench_now_ns() + timeout_ns;
+	int status;
+	int fd;
+
+	for (;;) {
+		fd = bench_client_connect(server->console_id);
+		if (fd >= 0) {
+			return fd;
+		}
+
+		if (waitpid(server->pid, &status, WNOHANG) == server->pid) {
+			warnx("Server exited during startup");
+			server->pid = -1;
+			return -1;
+		}
+
+		if (bench_now_ns() > deadline) {
+			warnx("Timed out waiting for server");
+			return -1;
+		}
+
+		bench_sleep_ns(100000);
+	}
+}
+
+void bench_server_stop(struct bench_server *server)
+{
+	uint64_t deadline;
+
+	if (server->pid > 0) {
+		kill(server->pid, SIGINT);
+		deadline = bench_now_ns() + 2000000000ull;
+		while (waitpid(server->pid, NULL, WNOHANG) != server->pid) {
+			if (bench_now_ns() > deadline) {
+				kill(server->pid, SIGKILL);
+				waitpid(server->pid, NULL, 0);
+				break;
+			}
+			bench_sleep_ns(1000000);
+		}
+		server->pid = -1;
+	}
+
+	if (server->master >= 0) {
+		close(server->master);
+		server->master = -1;
+	}
+
+	if (server->dir[0]) {
+		unlink(server->config_path);
+		unlink(server->log_path);
+		/* the log handler's rotate file */
+		strncat(server->log_path, ".1",
+			sizeof(server->log_path) - strlen(server->log_path) -
+				1);
+		unlink(server->log_path);
+		rmdir(server->dir);
+	}
+}
+
+/* Latency samples, for reporting percentiles */
+struct bench_samples {
+	uint64_t *v;
+	size_t n;
+	size_t alloc;
+};
+
+void bench_samples_add(struct bench_samples *s, uint64_t v)
+{
+	if (s->n == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 1024;
+		s->v = reallocarray(s->v, s->alloc, sizeof(*s->v));
+		if (!s->v) {
+			err(EXIT_FAILURE, "Can't allocate samples");
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+static int bench_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pct in [0, 100]; sorts the samples */
+uint64_t bench_samples_pct(struct bench_samples *s, unsigned int pct)
+{
+	size_t idx;
+
+	if (!s->n) {
+		return 0;
+	}
+
+	qsort(s->v, s->n, sizeof(*s->v), bench_u64_cmp);
+	idx = (s->n - 1) * pct / 100;
+
+	return s->v[idx];
+}
+
+void bench_samples_fini(struct bench_samples *s)
+{
+	free(s->v);
+	memset(s, 0, sizeof(*s));
+}
+
+void bench_report_latency(const char *name, struct bench_samples *s)
+{
+	printf("%s: n=%zu p50=%.3fms p99=%.3fms max=%.3fms\n", name, s->n,
+	       (double)bench_samples_pct(s, 50) / 1e6,
+	       (double)bench_samples_pct(s, 99) / 1e6,
+	       (double)bench_samples_pct(s, 100) / 1e6);
+}
@@ -343,6 +343,33 @@ int config_parse_bytesize(const char *size_str, size_t *size)
 	return 0;
 }
 
+int config_parse_bool(bool *val, const char *str)
+{
+	static const char *const true_strs[] = { "true", "yes", "on", "1" };
+	static const char *const false_strs[] = { "false", "no", "off", "0" };
+	size_t i;
+
+	if (!str) {
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(true_strs); i++) {
+		if (!strcasecmp(str, true_strs[i])) {
+			*val = true;
+			return 0;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(false_strs); i++) {
+		if (!strcasecmp(str, false_strs[i])) {
+			*val = false;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 /* Default console id if not specified on command line or in config */
 #define DEFAULT_CONSOLE_ID "default"
 
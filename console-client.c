@@ -16,6 +16,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -56,12 +57,30 @@ struct str_esc_state {
 	size_t pos;
 };
 
+/*
+ * Pending data for one direction of the connection. Data is appended at
+ * data[start + len] and written out from data[start]; the buffer is
+ * compacted when we need space at the end.
+ */
+#define CLIENT_BUF_SIZE (64 * 1024)
+
+struct client_buf {
+	uint8_t data[CLIENT_BUF_SIZE];
+	size_t start;
+	size_t len;
+};
+
 struct console_client {
 	int console_sd;
 	int fd_in;
 	int fd_out;
+	int fl_in;
+	int fl_out;
 	bool is_tty;
 	struct termios orig_termios;
+	/* stdin to server, and server to stdout */
+	struct client_buf to_server;
+	struct client_buf to_out;
 	enum esc_type esc_type;
 	union {
 		struct ssh_esc_state ssh;
@@ -69,12 +88,85 @@ struct console_client {
 	} esc_state;
 };
 
+static size_t client_buf_space(const struct client_buf *buf)
+{
+	return sizeof(buf->data) - buf->len;
+}
+
+/* Returns a pointer to client_buf_space() bytes at the end of the data */
+static uint8_t *client_buf_tail(struct client_buf *buf)
+{
+	if (buf->start) {
+		memmove(buf->data, buf->data + buf->start, buf->len);
+		buf->start = 0;
+	}
+
+	return buf->data + buf->len;
+}
+
+static int client_buf_append(struct client_buf *buf, const uint8_t *data,
+			     size_t len)
+{
+	if (len > client_buf_space(buf)) {
+		return -1;
+	}
+
+	memcpy(client_buf_tail(buf), data, len);
+	buf->len += len;
+
+	return 0;
+}
+
+/*
+ * Queue input for the server. If the server has stopped reading and our
+ * queue is full, we drop what doesn't fit, as a terminal would, rather than
+ * stop reading: we must still see the escape sequence.
+ */
+static void client_queue_input(struct console_client *client,
+			       const uint8_t *data, size_t len)
+{
+	struct client_buf *buf = &client->to_server;
+
+	if (len > client_buf_space(buf)) {
+		len = client_buf_space(buf);
+	}
+
+	client_buf_append(buf, data, len);
+}
+
+/* Write as much pending data as fd will take without blocking */
+static int client_buf_flush(struct client_buf *buf, int fd)
+{
+	ssize_t rc;
+
+	while (buf->len) {
+		rc = write(fd, buf->data + buf->start, buf->len);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+
+		buf->start += rc;
+		buf->len -= rc;
+	}
+
+	if (!buf->len) {
+		buf->start = 0;
+	}
+
+	return 0;
+}
+
 static enum process_rc process_ssh_tty(struct console_client *client,
 				       const uint8_t *buf, size_t len)
 {
 	struct ssh_esc_state *esc_state = &client->esc_state.ssh;
 	const uint8_t *out_buf = buf;
-	int rc;
 	uint8_t countEsc = 0;
 
 	for (size_t i = 0; i < len; ++i) {
@@ -92,11 +184,8 @@ static enum process_rc process_ssh_tty(struct console_client *client,
 			}
 			esc_state->state = '~';
 			/* We need to print everything to skip the tilde */
-			rc = write_buf_to_fd(client->console_sd, out_buf,
-					     i - (out_buf - buf));
-			if (rc < 0) {
-				return PROCESS_ERR;
-			}
+			client_queue_input(client, out_buf,
+					   i - (out_buf - buf));
 			out_buf = &buf[i + 1];
 			break;
 		case '\r':
@@ -132,14 +221,15 @@ static enum process_rc process_ssh_tty(struct console_client *client,
 				esc_state->state = '\0';
 				break;
 			}
-			/* Print the status character */
-			rc = write_buf_to_fd(
-				client->fd_out,
+			/*
+			 * Print the status character. This is best-effort: if
+			 * our output is backed up that far, we have nothing
+			 * useful to report anyway.
+			 */
+			client_buf_append(
+				&client->to_out,
 				(const uint8_t *)status_char_sequence,
 				strlen(status_char_sequence));
-			if (rc < 0) {
-				return PROCESS_ERR;
-			}
 			write_tunnel_status = true;
 			esc_state->state = '\0';
 			return PROCESS_OK;
@@ -148,9 +238,8 @@ static enum process_rc process_ssh_tty(struct console_client *client,
 		}
 	}
 
-	rc = write_buf_to_fd(client->console_sd, out_buf,
-			     len - (out_buf - buf));
-	return rc < 0 ? PROCESS_ERR : PROCESS_OK;
+	client_queue_input(client, out_buf, len - (out_buf - buf));
+	return PROCESS_OK;
 }
 
 static enum process_rc process_str_tty(struct console_client *client,
@@ -174,12 +263,11 @@ static enum process_rc process_str_tty(struct console_client *client,
 		}
 	}
 
-	if (write_buf_to_fd(client->console_sd, buf, i) < 0) {
-		return PROCESS_ERR;
-	}
+	client_queue_input(client, buf, i);
 	return prc;
 }
 
+/* Read from stdin, look for the escape sequence, and queue the rest */
 static enum process_rc process_tty(struct console_client *client)
 {
 	uint8_t buf[4096];
@@ -187,6 +275,9 @@ static enum process_rc process_tty(struct console_client *client)
 
 	len = read(client->fd_in, buf, sizeof(buf));
 	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return PROCESS_OK;
+		}
 		return PROCESS_ERR;
 	}
 	if (len == 0) {
@@ -203,14 +294,18 @@ static enum process_rc process_tty(struct console_client *client)
 	}
 }
 
+/* Read from the server directly into the stdout queue */
 static int process_console(struct console_client *client)
 {
-	uint8_t buf[4096];
+	struct client_buf *buf = &client->to_out;
 	ssize_t len;
-	int rc;
 
-	len = read(client->console_sd, buf, sizeof(buf));
+	len = read(client->console_sd, client_buf_tail(buf),
+		   client_buf_space(buf));
 	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return PROCESS_OK;
+		}
 		warn("Can't read from server");
 		return PROCESS_ERR;
 	}
@@ -219,8 +314,21 @@ static int process_console(struct console_client *client)
 		return PROCESS_EXIT;
 	}
 
-	rc = write_buf_to_fd(client->fd_out, buf, len);
-	return rc ? PROCESS_ERR : PROCESS_OK;
+	buf->len += len;
+
+	return PROCESS_OK;
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 /*
@@ -236,6 +344,21 @@ static int client_tty_init(struct console_client *client)
 	client->fd_out = STDOUT_FILENO;
 	client->is_tty = isatty(client->fd_in);
 
+	/*
+	 * Neither direction may block the other, so all of our fds are
+	 * non-blocking. stdin and stdout may share a file description with
+	 * our parent, so we restore their flags in client_fini(). They may
+	 * also share one with each other, as they do on a tty, so read both
+	 * before changing either.
+	 */
+	client->fl_in = fcntl(client->fd_in, F_GETFL);
+	client->fl_out = fcntl(client->fd_out, F_GETFL);
+	if (client->fl_in < 0 || client->fl_out < 0 ||
+	    set_nonblocking(client->fd_in) || set_nonblocking(client->fd_out)) {
+		warn("Can't set non-blocking mode on stdio");
+		return -1;
+	}
+
 	if (!client->is_tty) {
 		return 0;
 	}
@@ -290,6 +413,10 @@ static int client_init(struct console_client *client, struct config *config,
 	rc = connect(client->console_sd, (struct sockaddr *)&addr,
 		     sizeof(addr) - sizeof(addr.sun_path) + len);
 	if (!rc) {
+		if (set_nonblocking(client->console_sd)) {
+			warn("Can't set non-blocking mode on socket");
+			goto cleanup;
+		}
 		return 0;
 	}
 
@@ -300,11 +427,50 @@ cleanup:
 	return -1;
 }
 
+/*
+ * On a clean exit, write out whatever is still queued. The user wants out
+ * at an escape, even if the server or stdout is stalled, so we only send
+ * what the server will take without blocking, and drop stdout's queue.
+ */
+static void client_drain(struct console_client *client, enum process_rc prc)
+{
+	struct client_buf *buf;
+	int flags;
+
+	if (prc != PROCESS_EXIT && prc != PROCESS_ESC) {
+		return;
+	}
+
+	buf = &client->to_server;
+	if (prc == PROCESS_ESC) {
+		client_buf_flush(buf, client->console_sd);
+		buf->len = 0;
+	}
+
+	flags = fcntl(client->console_sd, F_GETFL);
+	if (buf->len && flags >= 0 &&
+	    !fcntl(client->console_sd, F_SETFL, flags & ~O_NONBLOCK)) {
+		write_buf_to_fd(client->console_sd, buf->data + buf->start,
+				buf->len);
+		buf->len = 0;
+	}
+
+	buf = &client->to_out;
+	if (prc == PROCESS_EXIT && buf->len &&
+	    !fcntl(client->fd_out, F_SETFL, client->fl_out)) {
+		write_buf_to_fd(client->fd_out, buf->data + buf->start,
+				buf->len);
+		buf->len = 0;
+	}
+}
+
 static void client_fini(struct console_client *client)
 {
 	if (client->is_tty) {
 		tcsetattr(client->fd_in, TCSANOW, &client->orig_termios);
 	}
+	fcntl(client->fd_out, F_SETFL, client->fl_out);
+	fcntl(client->fd_in, F_SETFL, client->fl_in);
 	close(client->console_sd);
 }
 
@@ -312,12 +478,13 @@ int main(int argc, char *argv[])
 {
 	struct console_client _client;
 	struct console_client *client;
-	struct pollfd pollfds[2];
+	struct pollfd pollfds[3];
 	enum process_rc prc = PROCESS_OK;
 	const char *config_path = NULL;
 	struct config *config = NULL;
 	const char *console_id = NULL;
 	const uint8_t *esc = NULL;
+	size_t i;
 	int rc;
 
 	client = &_client;
@@ -393,13 +560,38 @@ int main(int argc, char *argv[])
 	}
 
 	for (;;) {
+		/*
+		 * Always poll stdin, for the escape sequence. Otherwise only
+		 * poll for input that we have space to queue, and for output
+		 * that we have data to write. An fd that we have no interest
+		 * in is disabled, so that a hangup doesn't spin us.
+		 */
 		pollfds[0].fd = client->fd_in;
 		pollfds[0].events = POLLIN;
+
 		pollfds[1].fd = client->console_sd;
-		pollfds[1].events = POLLIN;
+		pollfds[1].events = 0;
+		if (client_buf_space(&client->to_out)) {
+			pollfds[1].events |= POLLIN;
+		}
+		if (client->to_server.len) {
+			pollfds[1].events |= POLLOUT;
+		}
 
-		rc = poll(pollfds, 2, -1);
+		pollfds[2].fd = client->fd_out;
+		pollfds[2].events = client->to_out.len ? POLLOUT : 0;
+
+		for (i = 0; i < ARRAY_SIZE(pollfds); i++) {
+			if (!pollfds[i].events) {
+				pollfds[i].fd = -1;
+			}
+		}
+
+		rc = poll(pollfds, ARRAY_SIZE(pollfds), -1);
 		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
 			warn("Poll failure");
 			break;
 		}
@@ -408,11 +600,26 @@ int main(int argc, char *argv[])
 			prc = process_tty(client);
 		}
 
+		if (prc == PROCESS_OK && (pollfds[1].revents & POLLOUT)) {
+			if (client_buf_flush(&client->to_server,
+					     client->console_sd)) {
+				warn("Can't write to server");
+				prc = PROCESS_ERR;
+			}
+		}
+
 		if (!write_tunnel_status && prc == PROCESS_OK &&
-			pollfds[1].revents) {
+		    (pollfds[1].revents & ~POLLOUT) &&
+		    client_buf_space(&client->to_out)) {
 			prc = process_console(client);
 		}
 
+		if (prc == PROCESS_OK && pollfds[2].revents) {
+			if (client_buf_flush(&client->to_out, client->fd_out)) {
+				prc = PROCESS_ERR;
+			}
+		}
+
 		if (write_tunnel_status) {
 			write_tunnel_status = false;
 		}
@@ -423,6 +630,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	client_drain(client, prc);
+
 out_client_fini:
 	client_fini(client);
 
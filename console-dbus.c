@@ -30,6 +30,19 @@ const size_t dbus_obj_path_len = 1024;
 #define OBJ_NAME    "/xyz/openbmc_project/console/%s"
 #define UART_INTF   "xyz.openbmc_project.Console.UART"
 #define ACCESS_INTF "xyz.openbmc_project.Console.Access"
+#define STATS_INTF  "xyz.openbmc_project.Console.Stats"
+#define ROUTING_INTF "xyz.openbmc_project.Console.UARTRouting"
+#define MEMORY_INTF  "xyz.openbmc_project.Console.Memory"
+#define TRACE_INTF   "xyz.openbmc_project.Console.Trace"
+#define HANDLERS_INTF "xyz.openbmc_project.Console.Handlers"
+#define THROUGHPUT_INTF "xyz.openbmc_project.Console.Throughput"
+
+/*
+ * sd-bus has no flag for a property that changes without a signal: one with
+ * none of the EMITS_CHANGE, EMITS_INVALIDATION or CONST flags is introspected
+ * with EmitsChangedSignal=false, so callers know to poll it.
+ */
+#define PROPERTY_EMITS_NO_SIGNAL 0
 
 static void tty_change_baudrate(struct console *console)
 {
@@ -109,10 +122,180 @@ static int get_baud_handler(sd_bus *bus __attribute__((unused)),
 	return r;
 }
 
-static int method_connect(sd_bus_message *msg, void *userdata,
-			  sd_bus_error *err)
+static int get_memory_property(sd_bus *bus __attribute__((unused)),
+			       const char *path __attribute__((unused)),
+			       const char *interface __attribute__((unused)),
+			       const char *property, sd_bus_message *reply,
+			       void *userdata,
+			       sd_bus_error *error __attribute__((unused)))
 {
 	struct console *console = userdata;
+	uint64_t val;
+
+	if (!strcmp(property, "Used")) {
+		val = console->mem.used;
+	} else if (!strcmp(property, "Limit")) {
+		val = console->mem.limit;
+	} else if (!strcmp(property, "GlobalUsed")) {
+		val = console_mem_global_used(console);
+	} else if (!strcmp(property, "GlobalLimit")) {
+		val = console->mem.global_limit;
+	} else {
+		return -ENOENT;
+	}
+
+	return sd_bus_message_append(reply, "t", val);
+}
+
+static int get_handlers_property(sd_bus *bus __attribute__((unused)),
+				 const char *path __attribute__((unused)),
+				 const char *interface __attribute__((unused)),
+				 const char *property, sd_bus_message *reply,
+				 void *userdata,
+				 sd_bus_error *error __attribute__((unused)))
+{
+	struct console *console = userdata;
+	bool suspended = !strcmp(property, "Suspended");
+	struct handler *handler;
+	int i;
+	int r;
+
+	r = sd_bus_message_open_container(reply, 'a', "s");
+	if (r < 0) {
+		return r;
+	}
+
+	for (i = 0; i < console->n_handlers; i++) {
+		handler = console->handlers[i];
+		if (!handler->active || !handler->suspend) {
+			continue;
+		}
+		if (suspended && !handler->suspended) {
+			continue;
+		}
+
+		r = sd_bus_message_append(reply, "s", handler->name);
+		if (r < 0) {
+			return r;
+		}
+	}
+
+	return sd_bus_message_close_container(reply);
+}
+
+static int set_handler_suspended(sd_bus_message *msg, void *userdata,
+				 sd_bus_error *err, bool suspended)
+{
+	struct console *console = userdata;
+	const char *name;
+	int r;
+
+	r = sd_bus_message_read(msg, "s", &name);
+	if (r < 0) {
+		return r;
+	}
+
+	r = console_handler_set_suspended(console, name, suspended);
+	if (r == -ENOENT) {
+		sd_bus_error_set_const(err, DBUS_ERR, "No such active handler");
+		return sd_bus_reply_method_error(msg, err);
+	} else if (r == -EOPNOTSUPP) {
+		sd_bus_error_set_const(err, DBUS_ERR,
+				       "Handler can't be suspended");
+		return sd_bus_reply_method_error(msg, err);
+	} else if (r) {
+		sd_bus_error_set_const(err, DBUS_ERR,
+				       "Failed to resume handler");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	sd_bus_emit_properties_changed(sd_bus_message_get_bus(msg),
+				       sd_bus_message_get_path(msg),
+				       HANDLERS_INTF, "Suspended", NULL);
+
+	return sd_bus_reply_method_return(msg, NULL);
+}
+
+static int method_suspend_handler(sd_bus_message *msg, void *userdata,
+				  sd_bus_error *err)
+{
+	return set_handler_suspended(msg, userdata, err, true);
+}
+
+static int method_resume_handler(sd_bus_message *msg, void *userdata,
+				 sd_bus_error *err)
+{
+	return set_handler_suspended(msg, userdata, err, false);
+}
+
+static int append_handler_time(sd_bus_message *reply,
+			       const struct handler_time *time)
+{
+	return sd_bus_message_append(reply, "ttt", time->calls, time->wall_ns,
+				     time->cpu_ns);
+}
+
+static int get_handler_stats(sd_bus *bus __attribute__((unused)),
+			     const char *path __attribute__((unused)),
+			     const char *interface __attribute__((unused)),
+			     const char *property __attribute__((unused)),
+			     sd_bus_message *reply, void *userdata,
+			     sd_bus_error *error __attribute__((unused)))
+{
+	struct console *console = userdata;
+	struct handler *handler;
+	int i;
+	int r;
+
+	r = sd_bus_message_open_container(reply, 'a', "(sttttttttt)");
+	if (r < 0) {
+		return r;
+	}
+
+	for (i = 0; i < console->n_handlers; i++) {
+		handler = console->handlers[i];
+		if (!handler->active) {
+			continue;
+		}
+
+		r = sd_bus_message_open_container(reply, 'r', "sttttttttt");
+		if (r < 0) {
+			return r;
+		}
+
+		r = sd_bus_message_append(reply, "s", handler->name);
+		if (r < 0) {
+			return r;
+		}
+
+		r = append_handler_time(reply, &handler->stats.event);
+		if (r < 0) {
+			return r;
+		}
+
+		r = append_handler_time(reply, &handler->stats.timeout);
+		if (r < 0) {
+			return r;
+		}
+
+		r = append_handler_time(reply, &handler->stats.ringbuffer);
+		if (r < 0) {
+			return r;
+		}
+
+		r = sd_bus_message_close_container(reply);
+		if (r < 0) {
+			return r;
+		}
+	}
+
+	return sd_bus_message_close_container(reply);
+}
+
+static int reply_socket_consumer(sd_bus_message *msg, struct console *console,
+				 const struct socket_consumer_options *opts,
+				 sd_bus_error *err)
+{
 	int rc;
 	int socket_fd = -1;
 
@@ -123,12 +306,16 @@ static int method_connect(sd_bus_message *msg, void *userdata,
 	}
 
 	/* Register the consumer. */
-	socket_fd = dbus_create_socket_consumer(console);
+	socket_fd = dbus_create_socket_consumer(console, opts);
 	if (socket_fd < 0) {
 		rc = -socket_fd;
 		warnx("Failed to create socket consumer: %s", strerror(rc));
-		sd_bus_error_set_const(err, DBUS_ERR,
-				       "Failed to create socket consumer");
+		sd_bus_error_set_const(
+			err, DBUS_ERR,
+			socket_fd == -EOPNOTSUPP ? "Unsupported connect option" :
+			socket_fd == -ENOSPC	 ? "Spill allowance reached" :
+			socket_fd == -EUSERS	 ? "Transform limit reached" :
+						   "Failed to create socket consumer");
 		return sd_bus_reply_method_error(msg, err);
 	}
 
@@ -140,6 +327,164 @@ static int method_connect(sd_bus_message *msg, void *userdata,
 	return rc;
 }
 
+static int method_connect(sd_bus_message *msg, void *userdata,
+			  sd_bus_error *err)
+{
+	return reply_socket_consumer(msg, userdata, NULL, err);
+}
+
+static int read_connect_options(sd_bus_message *msg,
+				struct socket_consumer_options *opts)
+{
+	const char *key;
+	int value;
+	int r;
+
+	r = sd_bus_message_enter_container(msg, 'a', "{sv}");
+	if (r < 0) {
+		return r;
+	}
+
+	while ((r = sd_bus_message_enter_container(msg, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(msg, "s", &key);
+		if (r < 0) {
+			return r;
+		}
+
+		if (!strcmp(key, "Spill")) {
+			r = sd_bus_message_read(msg, "v", "b", &value);
+			opts->spill = value;
+		} else if (!strcmp(key, "Transform")) {
+			r = sd_bus_message_read(msg, "v", "s",
+						&opts->transform);
+		} else if (!strcmp(key, "Compression")) {
+			r = sd_bus_message_read(msg, "v", "s",
+						&opts->compression);
+		} else {
+			warnx("Ignoring unknown connect option '%s'", key);
+			r = sd_bus_message_skip(msg, "v");
+		}
+		if (r < 0) {
+			return r;
+		}
+
+		r = sd_bus_message_exit_container(msg);
+		if (r < 0) {
+			return r;
+		}
+	}
+	if (r < 0) {
+		return r;
+	}
+
+	return sd_bus_message_exit_container(msg);
+}
+
+static int method_connect_with_options(sd_bus_message *msg, void *userdata,
+				       sd_bus_error *err)
+{
+	struct socket_consumer_options opts = { 0 };
+	int r;
+
+	r = read_connect_options(msg, &opts);
+	if (r < 0) {
+		sd_bus_error_set_const(err, DBUS_ERR, "Invalid connect options");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	return reply_socket_consumer(msg, userdata, &opts, err);
+}
+
+static int method_set_routing(sd_bus_message *msg, void *userdata,
+			      sd_bus_error *err)
+{
+	struct console *console = userdata;
+	const char *routing;
+	int r;
+
+	r = sd_bus_message_read(msg, "s", &routing);
+	if (r < 0) {
+		return r;
+	}
+
+	r = console_set_uart_routing(console, routing);
+	if (r < 0) {
+		sd_bus_error_set_const(err, DBUS_ERR,
+				       r == -EINVAL ?
+					       "Invalid uart routing config" :
+					       "Failed to apply uart routing");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	return sd_bus_reply_method_return(msg, NULL);
+}
+
+static int method_trace_dump(sd_bus_message *msg, void *userdata,
+			     sd_bus_error *err)
+{
+	struct console *console = userdata;
+	int fd;
+	int rc;
+
+	fd = console_trace_dump(console);
+	if (fd < 0) {
+		warnx("Failed to dump trace: %s", strerror(-fd));
+		sd_bus_error_set_const(err, DBUS_ERR, "Failed to dump trace");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	rc = sd_bus_reply_method_return(msg, "h", fd);
+
+	close(fd);
+
+	return rc;
+}
+
+static int method_get_throughput(sd_bus_message *msg, void *userdata,
+				 sd_bus_error *err)
+{
+	struct console *console = userdata;
+	sd_bus_message *reply;
+	uint32_t interval;
+	struct timeval now;
+	size_t len;
+	void *buf;
+	int r;
+
+	r = sd_bus_message_read(msg, "u", &interval);
+	if (r < 0) {
+		return r;
+	}
+
+	r = get_current_time(&now);
+	if (r) {
+		return -errno;
+	}
+
+	/* include the seconds that have passed since the loop last ran */
+	console_throughput_update(console, &now);
+
+	len = console_throughput_packed_size(console, interval);
+	if (!len) {
+		sd_bus_error_set_const(err, DBUS_ERR, "No such interval");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	r = sd_bus_message_new_method_return(msg, &reply);
+	if (r < 0) {
+		return r;
+	}
+
+	r = sd_bus_message_append_array_space(reply, 'y', len, &buf);
+	if (r >= 0) {
+		console_throughput_pack(console, interval, &now, buf);
+		r = sd_bus_send(NULL, reply, NULL);
+	}
+
+	sd_bus_message_unref(reply);
+	return r;
+}
+
 static const sd_bus_vtable console_uart_vtable[] = {
 	SD_BUS_VTABLE_START(0),
 	SD_BUS_WRITABLE_PROPERTY("Baud", "t", get_baud_handler,
@@ -149,20 +494,129 @@ static const sd_bus_vtable console_uart_vtable[] = {
 	SD_BUS_VTABLE_END,
 };
 
+/*
+ * HandlerStats is an array of (name, event calls, event wall ns, event cpu
+ * ns, timeout calls, timeout wall ns, timeout cpu ns, ringbuffer calls,
+ * ringbuffer wall ns, ringbuffer cpu ns), one entry per active handler.
+ */
+static const sd_bus_vtable console_stats_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("HandlerStats", "a(sttttttttt)", get_handler_stats, 0,
+			0),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * SetRouting takes an aspeed-uart-routing config string, in the same
+ * format as the configuration key, and applies all of it or none of it.
+ * An empty string is rejected as invalid.
+ */
+static const sd_bus_vtable console_routing_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("SetRouting", "s", SD_BUS_NO_RESULT, method_set_routing,
+		      0),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * Memory accounted to this console, and across all consoles, in bytes. A
+ * limit of zero means no limit is configured. The usage changes with every
+ * allocation, so it isn't signalled; poll it.
+ */
+static const sd_bus_vtable console_memory_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Used", "t", get_memory_property, 0,
+			PROPERTY_EMITS_NO_SIGNAL),
+	SD_BUS_PROPERTY("Limit", "t", get_memory_property, 0,
+			SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("GlobalUsed", "t", get_memory_property, 0,
+			PROPERTY_EMITS_NO_SIGNAL),
+	SD_BUS_PROPERTY("GlobalLimit", "t", get_memory_property, 0,
+			SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * Suspendable lists the active handlers that can be suspended, and Suspended
+ * those that are. Suspending turns off logging or the local ttys, so it's
+ * privileged.
+ */
+static const sd_bus_vtable console_handlers_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("Suspend", "s", SD_BUS_NO_RESULT, method_suspend_handler,
+		      0),
+	SD_BUS_METHOD("Resume", "s", SD_BUS_NO_RESULT, method_resume_handler, 0),
+	SD_BUS_PROPERTY("Suspendable", "as", get_handlers_property, 0,
+			SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Suspended", "as", get_handlers_property, 0,
+			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * GetHistory returns the throughput history at an interval of 1 or 60
+ * seconds, packed as described in throughput.c.
+ */
+static const sd_bus_vtable console_throughput_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("GetHistory", "u", "ay", method_get_throughput,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * Dump returns a memfd holding the trace. The trace records which handlers
+ * ran and when, so it's privileged.
+ */
+static const sd_bus_vtable console_trace_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("Dump", SD_BUS_NO_ARGS, "h", method_trace_dump, 0),
+	SD_BUS_VTABLE_END,
+};
+
+/*
+ * Anyone can connect to the console, as they can to its socket. What
+ * ConnectWithOptions may cost us is bounded: spill files by
+ * spill-total-size, and transform chains, including grep filters, by
+ * transform-max-chains.
+ */
 static const sd_bus_vtable console_access_vtable[] = {
 	SD_BUS_VTABLE_START(0),
 	SD_BUS_METHOD("Connect", SD_BUS_NO_ARGS, "h", method_connect,
 		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("ConnectWithOptions", "a{sv}", "h",
+		      method_connect_with_options, SD_BUS_VTABLE_UNPRIVILEGED),
 	SD_BUS_VTABLE_END,
 };
 
+static int request_name_handler(sd_bus_message *msg,
+				void *userdata __attribute__((unused)),
+				sd_bus_error *err __attribute__((unused)))
+{
+	const sd_bus_error *error;
+
+	error = sd_bus_message_get_error(msg);
+	if (error) {
+		warnx("Failed to acquire service name: %s", error->message);
+	}
+
+	return 0;
+}
+
+/*
+ * Nothing here waits on the bus: the connection is set up, and the name is
+ * acquired, as the event loop processes the bus. This lets us start after
+ * the handlers, so console data isn't held up by a busy bus at boot.
+ */
 void dbus_init(struct console *console,
 	       struct config *config __attribute__((unused)))
 {
 	char obj_name[dbus_obj_path_len];
 	char dbus_name[dbus_obj_path_len];
+	struct handler *handler;
 	int dbus_poller = 0;
 	int fd;
+	int i;
 	int r;
 	size_t bytes;
 
@@ -198,6 +652,72 @@ void dbus_init(struct console *console,
 		}
 	}
 
+	if (console->handler_stats) {
+		r = sd_bus_add_object_vtable(console->bus, NULL, obj_name,
+					     STATS_INTF, console_stats_vtable,
+					     console);
+		if (r < 0) {
+			warnx("Failed to register stats interface: %s",
+			      strerror(-r));
+		}
+	}
+
+	r = sd_bus_add_object_vtable(console->bus, NULL, obj_name, MEMORY_INTF,
+				     console_memory_vtable, console);
+	if (r < 0) {
+		warnx("Failed to register memory interface: %s", strerror(-r));
+	}
+
+	r = sd_bus_add_object_vtable(console->bus, NULL, obj_name,
+				     HANDLERS_INTF, console_handlers_vtable,
+				     console);
+	if (r < 0) {
+		warnx("Failed to register handlers interface: %s",
+		      strerror(-r));
+	}
+
+	if (console_throughput_packed_size(console, 1)) {
+		r = sd_bus_add_object_vtable(console->bus, NULL, obj_name,
+					     THROUGHPUT_INTF,
+					     console_throughput_vtable,
+					     console);
+		if (r < 0) {
+			warnx("Failed to register throughput interface: %s",
+			      strerror(-r));
+		}
+	}
+
+	if (console_trace(console)) {
+		r = sd_bus_add_object_vtable(console->bus, NULL, obj_name,
+					     TRACE_INTF, console_trace_vtable,
+					     console);
+		if (r < 0) {
+			warnx("Failed to register trace interface: %s",
+			      strerror(-r));
+		}
+	}
+
+	r = sd_bus_add_object_vtable(console->bus, NULL, obj_name,
+				     ROUTING_INTF, console_routing_vtable,
+				     console);
+	if (r < 0) {
+		warnx("Failed to register uart routing interface: %s",
+		      strerror(-r));
+	}
+
+	for (i = 0; i < console->n_handlers; i++) {
+		handler = console->handlers[i];
+		if (!handler->active || !handler->dbus_init) {
+			continue;
+		}
+
+		r = handler->dbus_init(handler, console->bus, obj_name);
+		if (r < 0) {
+			warnx("Failed to register D-Bus interfaces for handler %s: %s",
+			      handler->name, strerror(-r));
+		}
+	}
+
 	/* Register access interface */
 	r = sd_bus_add_object_vtable(console->bus, NULL, obj_name, ACCESS_INTF,
 				     console_access_vtable, console);
@@ -215,9 +735,10 @@ void dbus_init(struct console *console,
 	}
 
 	/* Finally register the bus name */
-	r = sd_bus_request_name(console->bus, dbus_name,
-				SD_BUS_NAME_ALLOW_REPLACEMENT |
-					SD_BUS_NAME_REPLACE_EXISTING);
+	r = sd_bus_request_name_async(console->bus, NULL, dbus_name,
+				      SD_BUS_NAME_ALLOW_REPLACEMENT |
+					      SD_BUS_NAME_REPLACE_EXISTING,
+				      request_name_handler, NULL);
 	if (r < 0) {
 		warnx("Failed to acquire service name: %s", strerror(-r));
 		return;
@@ -229,7 +750,8 @@ void dbus_init(struct console *console,
 		return;
 	}
 
-	dbus_poller = POLLFD_DBUS;
+	/* The internal pollfds follow those of the handlers' pollers */
+	dbus_poller = console->n_pollers + POLLFD_DBUS;
 
 	console->pollfds[dbus_poller].fd = fd;
 	console->pollfds[dbus_poller].events = POLLIN;
@@ -19,6 +19,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -42,6 +43,23 @@
 
 #define DEV_PTS_PATH "/dev/pts"
 
+/* Backoff between attempts to reopen a lost tty */
+#define TTY_REOPEN_MIN_MS 10
+#define TTY_REOPEN_MAX_MS 5000
+
+/* How long low-latency mode lasts after input from a client */
+#define LOW_LATENCY_WINDOW_MS 250
+
+/*
+ * While idle, the tty only wakes us once this many bytes are pending, and we
+ * read any fewer at an interval.
+ */
+#define TTY_IDLE_VMIN	 128
+#define TTY_IDLE_READ_MS 1000
+
+/* Largest read from the tty in one iteration of the event loop */
+#define TTY_READ_SIZE 4096
+
 /* default size of the shared backlog ringbuffer */
 const size_t default_buffer_size = 128ul * 1024ul;
 
@@ -245,6 +263,12 @@ void tty_init_termios(struct console *console)
 	 */
 	cfmakeraw(&termios);
 
+	/* Wake for larger reads while idle. VTIME stays 0, so poll() and our
+	 * non-blocking reads aren't delayed by the tty layer */
+	if (console->idle) {
+		termios.c_cc[VMIN] = TTY_IDLE_VMIN;
+	}
+
 	rc = tcsetattr(console->tty.fd, TCSANOW, &termios);
 	if (rc) {
 		warn("Can't set terminal options for %s", console->tty.kname);
@@ -397,6 +421,109 @@ static void tty_fini(struct console *console)
 	free(console->tty.dev);
 }
 
+static void tty_schedule_reopen(struct console *console)
+{
+	struct timeval now;
+	struct timeval interval;
+
+	if (get_current_time(&now)) {
+		warn("Failed to read current time");
+		timerclear(&now);
+	}
+
+	interval.tv_sec = console->tty.reopen_interval / 1000;
+	interval.tv_usec = (console->tty.reopen_interval % 1000) * 1000;
+	timeradd(&now, &interval, &console->tty.reopen);
+}
+
+/*
+ * The tty has gone away: a VUART reset or a USB serial adapter
+ * re-enumerating, say. Rather than exit and drop our clients and the
+ * ringbuffer contents, close it and periodically try to reopen it.
+ */
+static void tty_close(struct console *console)
+{
+	struct pollfd *pollfd = &console->pollfds[console->n_pollers];
+
+	close(console->tty.fd);
+	console->tty.fd = -1;
+	pollfd->fd = -1;
+	pollfd->revents = 0;
+
+	console->tty.reopen_interval = TTY_REOPEN_MIN_MS;
+	tty_schedule_reopen(console);
+
+	console_queue_marker(console, "tty %s lost", console->tty.kname);
+}
+
+static int tty_reopen(struct console *console)
+{
+	enum tty_device type = console->tty.type;
+	speed_t baud = console->tty.uart.baud;
+	int rc;
+
+	if (type == TTY_DEVICE_VUART) {
+		free(console->tty.vuart.sysfs_devnode);
+		console->tty.vuart.sysfs_devnode = NULL;
+	}
+	free(console->tty.dev);
+	console->tty.dev = NULL;
+
+	rc = tty_find_device(console);
+
+	/* We only have the configuration for the original type of device */
+	if (rc || console->tty.type != type) {
+		if (!rc) {
+			warnx("tty %s changed type, not reopening",
+			      console->tty.kname);
+		}
+		if (console->tty.type == TTY_DEVICE_VUART) {
+			free(console->tty.vuart.sysfs_devnode);
+		}
+		console->tty.type = type;
+		if (type == TTY_DEVICE_UART) {
+			console->tty.uart.baud = baud;
+		} else if (type == TTY_DEVICE_VUART) {
+			console->tty.vuart.sysfs_devnode = NULL;
+		}
+		return -1;
+	}
+
+	if (type == TTY_DEVICE_VUART) {
+		tty_init_vuart_io(console);
+	}
+
+	return tty_init_io(console);
+}
+
+static void tty_reopen_if_due(struct console *console)
+{
+	struct timeval now;
+
+	if (get_current_time(&now)) {
+		warn("Failed to read current time");
+		return;
+	}
+
+	if (timercmp(&now, &console->tty.reopen, <)) {
+		return;
+	}
+
+	if (tty_reopen(console)) {
+		console->tty.reopen_interval *= 2;
+		if (console->tty.reopen_interval > TTY_REOPEN_MAX_MS) {
+			console->tty.reopen_interval = TTY_REOPEN_MAX_MS;
+		}
+		tty_schedule_reopen(console);
+		return;
+	}
+
+	timerclear(&console->tty.reopen);
+	warnx("Reopened tty %s", console->tty.kname);
+	console_queue_marker(console, "tty %s reconnected",
+			     console->tty.kname);
+}
+
 static int write_to_path(const char *path, const char *data)
 {
 	int rc = 0;
@@ -419,47 +546,47 @@ static int write_to_path(const char *path, const char *data)
 #define ASPEED_UART_ROUTING_PATTERN                                            \
 	"/sys/bus/platform/drivers/aspeed-uart-routing/*.uart-routing"
 
-static void uart_routing_init(struct config *config)
-{
-	const char *muxcfg;
-	const char *p;
-	size_t buflen;
+struct uart_route {
 	char *sink;
 	char *source;
-	char *muxdir;
-	char *path;
-	glob_t globbuf;
+};
 
-	muxcfg = config_get_value(config, "aspeed-uart-routing");
-	if (!muxcfg) {
-		return;
-	}
+static void uart_routes_free(struct uart_route *routes, size_t n_routes)
+{
+	size_t i;
 
-	/* Find the driver's sysfs directory */
-	if (glob(ASPEED_UART_ROUTING_PATTERN, GLOB_ERR | GLOB_NOSORT, NULL,
-		 &globbuf) != 0) {
-		warn("Couldn't find uart-routing driver directory, cannot apply config");
-		return;
+	for (i = 0; i < n_routes; i++) {
+		free(routes[i].sink);
+		free(routes[i].source);
 	}
-	if (globbuf.gl_pathc != 1) {
-		warnx("Found %zd uart-routing driver directories, cannot apply config",
-		      globbuf.gl_pathc);
-		goto out_free_glob;
-	}
-	muxdir = globbuf.gl_pathv[0];
+	free(routes);
+}
 
-	/*
-	 * Rather than faff about tracking a bunch of separate buffer sizes,
-	 * just use one (worst-case) size for all of them -- +2 for a trailing
-	 * NUL and a '/' separator to construct the sysfs file path.
-	 */
-	buflen = strlen(muxdir) + strlen(muxcfg) + 2;
+/*
+ * Parse a routing config of whitespace-separated sink:source pairs. In
+ * non-strict mode we behave as we always have at startup: stop at a syntax
+ * error, and skip any sinks with invalid names. In strict mode, either of
+ * these fails the parse.
+ */
+static int uart_routing_parse(const char *muxcfg, bool strict,
+			      struct uart_route **routesp, size_t *n_routesp)
+{
+	struct uart_route *routes = NULL;
+	struct uart_route *route;
+	size_t n_routes = 0;
+	size_t buflen;
+	char *sink;
+	char *source;
+	const char *p;
+	int rc = -1;
+
+	/* +1 for the trailing NUL */
+	buflen = strlen(muxcfg) + 1;
 
 	sink = malloc(buflen);
 	source = malloc(buflen);
-	path = malloc(buflen);
-	if (!path || !sink || !source) {
-		warnx("Out of memory applying uart routing config");
+	if (!sink || !source) {
+		warnx("Out of memory parsing uart routing config");
 		goto out_free_bufs;
 	}
 
@@ -471,6 +598,9 @@ static void uart_routing_init(struct config *config)
 			   &bytes_scanned) != 2) {
 			warnx("Invalid syntax in aspeed uart config: '%s' not applied",
 			      p);
+			if (strict) {
+				goto out_free_routes;
+			}
 			break;
 		}
 		p += bytes_scanned;
@@ -485,27 +615,379 @@ static void uart_routing_init(struct config *config)
 		    strncmp(sink, "uart", strlen("uart")) != 0) {
 			warnx("Skipping invalid uart routing name '%s' (must be ioN or uartN)",
 			      sink);
+			if (strict) {
+				goto out_free_routes;
+			}
 			continue;
 		}
 
-		snprintf(path, buflen, "%s/%s", muxdir, sink);
-		if (write_to_path(path, source)) {
-			warn("Failed to apply uart-routing config '%s:%s'",
-			     sink, source);
+		route = reallocarray(routes, n_routes + 1, sizeof(*routes));
+		if (!route) {
+			warnx("Out of memory parsing uart routing config");
+			goto out_free_routes;
+		}
+		routes = route;
+		route = &routes[n_routes++];
+		route->sink = strdup(sink);
+		route->source = strdup(source);
+		if (!route->sink || !route->source) {
+			warnx("Out of memory parsing uart routing config");
+			goto out_free_routes;
 		}
 	}
 
+	*routesp = routes;
+	*n_routesp = n_routes;
+	routes = NULL;
+	n_routes = 0;
+	rc = 0;
+
+out_free_routes:
+	uart_routes_free(routes, n_routes);
 out_free_bufs:
-	free(path);
 	free(source);
 	free(sink);
-out_free_glob:
+	return rc;
+}
+
+/* Find the driver's sysfs directory */
+static char *uart_routing_dir(void)
+{
+	glob_t globbuf;
+	char *muxdir = NULL;
+
+	if (glob(ASPEED_UART_ROUTING_PATTERN, GLOB_ERR | GLOB_NOSORT, NULL,
+		 &globbuf) != 0) {
+		warn("Couldn't find uart-routing driver directory, cannot apply config");
+		return NULL;
+	}
+
+	if (globbuf.gl_pathc != 1) {
+		warnx("Found %zd uart-routing driver directories, cannot apply config",
+		      globbuf.gl_pathc);
+	} else {
+		muxdir = strdup(globbuf.gl_pathv[0]);
+	}
+
 	globfree(&globbuf);
+
+	return muxdir;
+}
+
+static int uart_routing_write(const char *muxdir, const char *sink,
+			      const char *source)
+{
+	char *path;
+	int rc;
+
+	if (asprintf(&path, "%s/%s", muxdir, sink) < 0) {
+		return -1;
+	}
+
+	rc = write_to_path(path, source);
+	free(path);
+
+	return rc;
+}
+
+/*
+ * Read the current source for a sink. The driver lists the available
+ * sources, with the selected one in brackets.
+ */
+static char *uart_routing_read(const char *muxdir, const char *sink)
+{
+	char buf[256];
+	char *path;
+	char *start;
+	char *end;
+	size_t len;
+	FILE *f;
+
+	if (asprintf(&path, "%s/%s", muxdir, sink) < 0) {
+		return NULL;
+	}
+
+	f = fopen(path, "r");
+	free(path);
+	if (!f) {
+		return NULL;
+	}
+
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	start = strchr(buf, '[');
+	end = start ? strchr(start, ']') : NULL;
+	if (!end) {
+		return NULL;
+	}
+
+	return strndup(start + 1, end - start - 1);
+}
+
+static void uart_routing_init(struct config *config)
+{
+	struct uart_route *routes;
+	const char *muxcfg;
+	size_t n_routes;
+	char *muxdir;
+	size_t i;
+
+	muxcfg = config_get_value(config, "aspeed-uart-routing");
+	if (!muxcfg) {
+		return;
+	}
+
+	muxdir = uart_routing_dir();
+	if (!muxdir) {
+		return;
+	}
+
+	if (uart_routing_parse(muxcfg, false, &routes, &n_routes)) {
+		goto out_free_dir;
+	}
+
+	for (i = 0; i < n_routes; i++) {
+		if (uart_routing_write(muxdir, routes[i].sink,
+				       routes[i].source)) {
+			warn("Failed to apply uart-routing config '%s:%s'",
+			     routes[i].sink, routes[i].source);
+		}
+	}
+
+	uart_routes_free(routes, n_routes);
+out_free_dir:
+	free(muxdir);
+}
+
+/*
+ * Apply a new routing config at runtime. Unlike at startup, the whole
+ * config must be valid, and if any route fails to apply we restore those
+ * that we've already changed. Once switched, we discard anything the tty
+ * received from the old source, and mark the switch in the ringbuffer.
+ */
+int console_set_uart_routing(struct console *console, const char *muxcfg)
+{
+	struct uart_route *routes;
+	size_t n_routes;
+	char **prev;
+	char *muxdir;
+	size_t i;
+	int rc;
+
+	muxdir = uart_routing_dir();
+	if (!muxdir) {
+		return -ENODEV;
+	}
+
+	rc = uart_routing_parse(muxcfg, true, &routes, &n_routes);
+	if (rc) {
+		rc = -EINVAL;
+		goto out_free_dir;
+	}
+
+	/* an empty config changes nothing, so there's nothing to mark */
+	if (!n_routes) {
+		rc = -EINVAL;
+		goto out_free_routes;
+	}
+
+	prev = calloc(n_routes, sizeof(*prev));
+	if (!prev) {
+		rc = -ENOMEM;
+		goto out_free_routes;
+	}
+
+	for (i = 0; i < n_routes; i++) {
+		prev[i] = uart_routing_read(muxdir, routes[i].sink);
+		if (!prev[i]) {
+			warnx("Can't read current uart routing for '%s'",
+			      routes[i].sink);
+			rc = -EIO;
+			goto out_free_prev;
+		}
+	}
+
+	for (i = 0; i < n_routes; i++) {
+		if (uart_routing_write(muxdir, routes[i].sink,
+				       routes[i].source)) {
+			warn("Failed to apply uart-routing config '%s:%s'",
+			     routes[i].sink, routes[i].source);
+			rc = -EIO;
+			break;
+		}
+	}
+
+	if (rc) {
+		while (i--) {
+			if (uart_routing_write(muxdir, routes[i].sink,
+					       prev[i])) {
+				warn("Failed to restore uart-routing config '%s:%s'",
+				     routes[i].sink, prev[i]);
+			}
+		}
+		goto out_free_prev;
+	}
+
+	/* the tty may be closed, waiting to be reopened */
+	if (console->tty.fd >= 0) {
+		tcflush(console->tty.fd, TCIFLUSH);
+	}
+	console_queue_marker(console, "uart routing changed to '%s'", muxcfg);
+
+out_free_prev:
+	for (i = 0; prev && i < n_routes; i++) {
+		free(prev[i]);
+	}
+	free(prev);
+out_free_routes:
+	uart_routes_free(routes, n_routes);
+out_free_dir:
+	free(muxdir);
+	return rc;
+}
+
+/*
+ * Insert an annotation into the console data, so that consumers can see
+ * where the server changed something about the console.
+ */
+int console_queue_marker(struct console *console, const char *fmt, ...)
+{
+	char msg[192];
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	len = snprintf(buf, sizeof(buf), "\r\n[obmc-console: %s]\r\n", msg);
+
+	return ringbuffer_queue(console->rb, (uint8_t *)buf, len);
+}
+
+/*
+ * Output from the host that follows client input is most likely an echo,
+ * so for a while after input we poll without sleeping and send output
+ * without coalescing, trading CPU time for interactive latency.
+ */
+static void console_low_latency_arm(struct console *console)
+{
+	struct timeval window = { 0, LOW_LATENCY_WINDOW_MS * 1000 };
+	struct timeval now;
+
+	if (get_current_time(&now)) {
+		return;
+	}
+
+	timeradd(&now, &window, &console->low_latency_until);
+}
+
+bool console_low_latency(struct console *console)
+{
+	struct timeval now;
+
+	if (!timerisset(&console->low_latency_until)) {
+		return false;
+	}
+
+	if (get_current_time(&now) ||
+	    !timercmp(&now, &console->low_latency_until, <)) {
+		timerclear(&console->low_latency_until);
+		return false;
+	}
+
+	return true;
+}
+
+static void console_schedule_idle_read(struct console *console)
+{
+	struct timeval interval = { TTY_IDLE_READ_MS / 1000,
+				    (TTY_IDLE_READ_MS % 1000) * 1000 };
+	struct timeval now;
+
+	if (get_current_time(&now)) {
+		warn("Failed to read current time");
+		timerclear(&now);
+	}
+
+	timeradd(&now, &interval, &console->idle_read);
+}
+
+static void console_idle_update(struct console *console)
+{
+	bool idle = console->idle_mode && !console->n_interactive;
+
+	if (idle == console->idle) {
+		return;
+	}
+
+	console->idle = idle;
+	if (idle) {
+		console_schedule_idle_read(console);
+	} else {
+		timerclear(&console->idle_read);
+	}
+
+	/* Leaving idle, poll() reports any data held back by VMIN at once */
+	if (console->tty.fd >= 0) {
+		tty_init_termios(console);
+	}
+}
+
+/* While idle, read any data that VMIN has held back at an interval */
+static bool console_idle_read_due(struct console *console)
+{
+	struct timeval now;
+
+	if (!timerisset(&console->idle_read) || get_current_time(&now) ||
+	    timercmp(&now, &console->idle_read, <)) {
+		return false;
+	}
+
+	console_schedule_idle_read(console);
+
+	return console->tty.fd >= 0;
+}
+
+void console_interactive_get(struct console *console)
+{
+	console->n_interactive++;
+	console_idle_update(console);
+}
+
+void console_interactive_put(struct console *console)
+{
+	assert(console->n_interactive > 0);
+	console->n_interactive--;
+	console_idle_update(console);
+}
+
+bool console_idle(struct console *console)
+{
+	return console->idle;
 }
 
 int console_data_out(struct console *console, const uint8_t *data, size_t len)
 {
-	return write_buf_to_fd(console->tty.fd, data, len);
+	/* Input is dropped while the tty is being reopened */
+	if (console->tty.fd < 0) {
+		return -1;
+	}
+
+	if (console->low_latency) {
+		console_low_latency_arm(console);
+	}
+
+	if (write_buf_to_fd(console->tty.fd, data, len)) {
+		return -1;
+	}
+
+	console->throughput.bytes_out += len;
+
+	return 0;
 }
 
 /* Prepare a socket name */
@@ -548,6 +1030,7 @@ static void handlers_init(struct console *console, struct config *config)
 
 	for (i = 0; i < console->n_handlers; i++) {
 		handler = console->handlers[i];
+		handler->trace = console_trace(console);
 
 		rc = 0;
 		if (handler->init) {
@@ -561,6 +1044,49 @@ static void handlers_init(struct console *console, struct config *config)
 	}
 }
 
+int console_handler_set_suspended(struct console *console, const char *name,
+				  bool suspended)
+{
+	struct handler *handler = NULL;
+	int rc;
+	int i;
+
+	for (i = 0; i < console->n_handlers; i++) {
+		if (console->handlers[i]->active &&
+		    !strcmp(console->handlers[i]->name, name)) {
+			handler = console->handlers[i];
+			break;
+		}
+	}
+
+	if (!handler) {
+		return -ENOENT;
+	}
+
+	if (!handler->suspend || !handler->resume) {
+		return -EOPNOTSUPP;
+	}
+
+	if (handler->suspended == suspended) {
+		return 0;
+	}
+
+	if (suspended) {
+		handler->suspend(handler);
+	} else {
+		rc = handler->resume(handler);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	handler->suspended = suspended;
+	printf("  %s [%s]\n", handler->name,
+	       suspended ? "suspended" : "resumed");
+
+	return 0;
+}
+
 static void handlers_fini(struct console *console)
 {
 	struct handler *handler;
@@ -574,7 +1100,7 @@ static void handlers_fini(struct console *console)
 	}
 }
 
-static int get_current_time(struct timeval *tv)
+static int monotonic_now(struct timeval *tv)
 {
 	struct timespec t;
 	int rc;
@@ -595,11 +1121,79 @@ static int get_current_time(struct timeval *tv)
 	return 0;
 }
 
+static const struct console_clock monotonic_clock = {
+	.now = monotonic_now,
+	.wait = poll,
+};
+
+static const struct console_clock *console_clock = &monotonic_clock;
+
+void console_set_clock(const struct console_clock *clock)
+{
+	console_clock = clock ? clock : &monotonic_clock;
+}
+
+int get_current_time(struct timeval *tv)
+{
+	return console_clock->now(tv);
+}
+
+static struct ringbuffer_consumer *
+console_ringbuffer_consumer_init(struct console *console,
+				 struct handler *handler, const char *transform,
+				 ringbuffer_poll_fn_t poll_fn,
+				 ringbuffer_push_fn_t push_fn, void *data)
+{
+	struct ringbuffer_consumer *rbc;
+	struct ringbuffer *rb;
+
+	rb = console->rb;
+	if (transform && *transform) {
+		rb = console_transform_ringbuffer(console, transform);
+		if (!rb) {
+			return NULL;
+		}
+	}
+
+	if (push_fn) {
+		rbc = ringbuffer_consumer_register_push(rb, push_fn, data);
+	} else {
+		rbc = ringbuffer_consumer_register(rb, poll_fn, data);
+	}
+	if (rbc && handler && console->handler_stats) {
+		rbc->stats = &handler->stats.ringbuffer;
+	}
+	if (rbc && handler) {
+		rbc->trace = handler->trace;
+		rbc->trace_name = handler->name;
+	}
+
+	return rbc;
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_transform(
+	struct console *console, struct handler *handler, const char *transform,
+	ringbuffer_poll_fn_t poll_fn, void *data)
+{
+	return console_ringbuffer_consumer_init(console, handler, transform,
+						poll_fn, NULL, data);
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *console, struct handler *handler, const char *transform,
+	ringbuffer_push_fn_t push_fn, void *data)
+{
+	return console_ringbuffer_consumer_init(console, handler, transform,
+						NULL, push_fn, data);
+}
+
 struct ringbuffer_consumer *
 console_ringbuffer_consumer_register(struct console *console,
+				     struct handler *handler,
 				     ringbuffer_poll_fn_t poll_fn, void *data)
 {
-	return ringbuffer_consumer_register(console->rb, poll_fn, data);
+	return console_ringbuffer_consumer_register_transform(
+		console, handler, NULL, poll_fn, data);
 }
 
 struct poller *console_poller_register(struct console *console,
@@ -737,13 +1331,24 @@ static long get_poll_timeout(struct console *console, struct timeval *cur_time)
 		}
 	}
 
+	if (timerisset(&console->tty.reopen) &&
+	    (!earliest || timercmp(&console->tty.reopen, earliest, <))) {
+		earliest = &console->tty.reopen;
+	}
+
+	if (timerisset(&console->idle_read) &&
+	    (!earliest || timercmp(&console->idle_read, earliest, <))) {
+		earliest = &console->idle_read;
+	}
+
 	if (earliest) {
 		if (timercmp(earliest, cur_time, >)) {
 			/* recalculate the timeout period, time period has
-			 * not elapsed */
+			 * not elapsed. Round up, as waking early would have
+			 * us spin on a zero timeout until it's due */
 			timersub(earliest, cur_time, &interval);
 			return ((interval.tv_sec * 1000) +
-				(interval.tv_usec / 1000));
+				((interval.tv_usec + 999) / 1000));
 		} /* return from poll immediately */
 		return 0;
 
@@ -751,6 +1356,60 @@ static long get_poll_timeout(struct console *console, struct timeval *cur_time)
 	return -1;
 }
 
+static enum poller_ret poller_call_event(struct console *console,
+					  struct poller *poller, int revents)
+{
+	struct handler_time_sample sample;
+	enum poller_ret prc;
+	uint64_t start;
+
+	if (!console->handler_stats && !poller->handler->trace) {
+		return poller->event_fn(poller->handler, revents, poller->data);
+	}
+
+	start = trace_start(poller->handler->trace);
+	if (console->handler_stats) {
+		handler_time_start(&sample);
+	}
+
+	prc = poller->event_fn(poller->handler, revents, poller->data);
+
+	if (console->handler_stats) {
+		handler_time_stop(&poller->handler->stats.event, &sample);
+	}
+	trace_end(poller->handler->trace, TRACE_EVENT, poller->handler->name,
+		  start);
+
+	return prc;
+}
+
+static enum poller_ret poller_call_timeout(struct console *console,
+					    struct poller *poller)
+{
+	struct handler_time_sample sample;
+	enum poller_ret prc;
+	uint64_t start;
+
+	if (!console->handler_stats && !poller->handler->trace) {
+		return poller->timeout_fn(poller->handler, poller->data);
+	}
+
+	start = trace_start(poller->handler->trace);
+	if (console->handler_stats) {
+		handler_time_start(&sample);
+	}
+
+	prc = poller->timeout_fn(poller->handler, poller->data);
+
+	if (console->handler_stats) {
+		handler_time_stop(&poller->handler->stats.timeout, &sample);
+	}
+	trace_end(poller->handler->trace, TRACE_TIMEOUT, poller->handler->name,
+		  start);
+
+	return prc;
+}
+
 static int call_pollers(struct console *console, struct timeval *cur_time)
 {
 	struct poller *poller;
@@ -772,8 +1431,8 @@ static int call_pollers(struct console *console, struct timeval *cur_time)
 
 		/* process pending events... */
 		if (pollfd->revents) {
-			prc = poller->event_fn(poller->handler, pollfd->revents,
-					       poller->data);
+			prc = poller_call_event(console, poller,
+						pollfd->revents);
 			if (prc == POLLER_EXIT) {
 				rc = -1;
 			} else if (prc == POLLER_REMOVE) {
@@ -789,7 +1448,7 @@ static int call_pollers(struct console *console, struct timeval *cur_time)
 			desired has expired.  Process the buffered data for
 			transmission. */
 			timerclear(&poller->timeout);
-			prc = poller->timeout_fn(poller->handler, poller->data);
+			prc = poller_call_timeout(console, poller);
 			if (prc == POLLER_EXIT) {
 				rc = -1;
 			} else if (prc == POLLER_REMOVE) {
@@ -828,71 +1487,129 @@ static void sighandler(int signal)
 	}
 }
 
-int run_console(struct console *console)
+/*
+ * Run one iteration of the event loop: wait for events or the earliest
+ * timeout, then process the tty, D-Bus and the pollers. Returns non-zero if
+ * the loop should exit.
+ */
+static int run_console_once(struct console *console)
 {
-	sighandler_t sighandler_save = signal(SIGINT, sighandler);
+	struct trace *trace = console_trace(console);
+	uint8_t buf[TTY_READ_SIZE];
 	struct timeval tv;
+	uint64_t start;
 	long timeout;
 	ssize_t rc;
 
-	rc = 0;
+	rc = get_current_time(&tv);
+	if (rc) {
+		warn("Failed to read current time");
+		return -1;
+	}
 
-	for (;;) {
-		uint8_t buf[4096];
+	timeout = get_poll_timeout(console, &tv);
+	if (console_low_latency(console)) {
+		timeout = 0;
+	}
 
-		if (console->rb->size < sizeof(buf)) {
-			fprintf(stderr,
-				"Ringbuffer size should be greater than %zuB\n",
-				sizeof(buf));
-			rc = -1;
-			break;
+	/*
+	 * The bus may have queued output while connecting and
+	 * acquiring our name, so let it tell us what to wait for.
+	 */
+	if (console->bus) {
+		rc = sd_bus_get_events(console->bus);
+		if (rc > 0) {
+			console->pollfds[console->n_pollers + POLLFD_DBUS]
+				.events = (short)rc;
 		}
+	}
 
-		if (sigint) {
-			fprintf(stderr, "Received interrupt, exiting\n");
-			break;
-		}
+	start = trace_start(trace);
+	rc = console_clock->wait(console->pollfds,
+				 console->n_pollers + MAX_INTERNAL_POLLFD,
+				 (int)timeout);
+	trace_end(trace, TRACE_POLL, "poll", start);
 
-		rc = get_current_time(&tv);
-		if (rc) {
-			warn("Failed to read current time");
-			break;
+	if (rc < 0) {
+		if (errno == EINTR) {
+			return 0;
 		}
+		warn("poll error");
+		return -1;
+	}
 
-		timeout = get_poll_timeout(console, &tv);
+	/*
+	 * We may have slept until a timeout, so check again what's due,
+	 * rather than take another trip through poll() to find out.
+	 */
+	if (get_current_time(&tv)) {
+		warn("Failed to read current time");
+		return -1;
+	}
 
-		rc = poll(console->pollfds,
-			  console->n_pollers + MAX_INTERNAL_POLLFD,
-			  (int)timeout);
+	console_throughput_update(console, &tv);
 
-		if (rc < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
-			warn("poll error");
-			break;
-		}
-
-		/* process internal fd first */
-		if (console->pollfds[console->n_pollers].revents) {
-			rc = read(console->tty.fd, buf, sizeof(buf));
-			if (rc <= 0) {
-				warn("Error reading from tty device");
-				rc = -1;
-				break;
-			}
+	/* process internal fd first */
+	if (console->pollfds[console->n_pollers].revents ||
+	    console_idle_read_due(console)) {
+		start = trace_start(trace);
+		rc = read(console->tty.fd, buf, sizeof(buf));
+		if (rc > 0) {
+			console->throughput.bytes_in += rc;
 			rc = ringbuffer_queue(console->rb, buf, rc);
+			trace_end(trace, TRACE_TTY_READ, "tty", start);
 			if (rc) {
-				break;
+				return -1;
 			}
+		} else if (rc == 0) {
+			warnx("Hangup on tty device");
+			tty_close(console);
+		} else if (errno != EAGAIN && errno != EINTR) {
+			warn("Error reading from tty device");
+			tty_close(console);
 		}
+	}
+
+	if (timerisset(&console->tty.reopen)) {
+		tty_reopen_if_due(console);
+	}
+
+	if (console->pollfds[console->n_pollers + 1].revents) {
+		start = trace_start(trace);
+		sd_bus_process(console->bus, NULL);
+		trace_end(trace, TRACE_EVENT, "dbus", start);
+	}
 
-		if (console->pollfds[console->n_pollers + 1].revents) {
-			sd_bus_process(console->bus, NULL);
+	/* ... and then the pollers */
+	rc = call_pollers(console, &tv);
+
+	console_transform_reap(console);
+
+	return rc;
+}
+
+int run_console(struct console *console)
+{
+	sighandler_t sighandler_save = signal(SIGINT, sighandler);
+	int rc;
+
+	rc = 0;
+
+	for (;;) {
+		if (console->rb->size < TTY_READ_SIZE) {
+			fprintf(stderr,
+				"Ringbuffer size should be greater than %zuB\n",
+				(size_t)TTY_READ_SIZE);
+			rc = -1;
+			break;
+		}
+
+		if (sigint) {
+			fprintf(stderr, "Received interrupt, exiting\n");
+			break;
 		}
 
-		/* ... and then the pollers */
-		rc = call_pollers(console, &tv);
+		rc = run_console_once(console);
 		if (rc) {
 			break;
 		}
@@ -915,6 +1632,9 @@ int main(int argc, char **argv)
 	const char *config_filename = NULL;
 	const char *config_tty_kname = NULL;
 	const char *buffer_size_str = NULL;
+	const char *handler_stats_str;
+	const char *low_latency_str;
+	const char *idle_mode_str;
 	const char *console_id = NULL;
 	struct console *console;
 	struct config *config;
@@ -963,28 +1683,76 @@ int main(int argc, char **argv)
 	}
 	console->rb = ringbuffer_init(buffer_size);
 
-	if (set_socket_info(console, config, console_id)) {
+	if (console_mem_init(console, config)) {
 		rc = -1;
 		goto out_config_fini;
 	}
 
+	/* the console's own ringbuffer is subject to the limits too */
+	if (console_mem_charge(console, console->rb->size)) {
+		warnx("ringbuffer-size exceeds the configured memory limits");
+		rc = -1;
+		goto out_mem_fini;
+	}
+
+	handler_stats_str = config_get_value(config, "handler-stats");
+	if (handler_stats_str &&
+	    config_parse_bool(&console->handler_stats, handler_stats_str)) {
+		warnx("Invalid handler-stats value: '%s'", handler_stats_str);
+	}
+
+	low_latency_str = config_get_value(config, "low-latency");
+	if (low_latency_str &&
+	    config_parse_bool(&console->low_latency, low_latency_str)) {
+		warnx("Invalid low-latency value: '%s'", low_latency_str);
+	}
+
+	idle_mode_str = config_get_value(config, "idle-mode");
+	if (idle_mode_str &&
+	    config_parse_bool(&console->idle_mode, idle_mode_str)) {
+		warnx("Invalid idle-mode value: '%s'", idle_mode_str);
+	}
+
+	console_trace_init(console, config);
+	console_throughput_init(console, config);
+	console_transform_init(console, config);
+
+	if (set_socket_info(console, config, console_id)) {
+		rc = -1;
+		goto out_mem_fini;
+	}
+
 	uart_routing_init(config);
 
 	rc = tty_init(console, config, config_tty_kname);
 	if (rc) {
-		goto out_config_fini;
+		goto out_mem_fini;
 	}
 
-	dbus_init(console, config);
-
+	/*
+	 * Bring up the handlers before D-Bus, so that we're logging and
+	 * serving the console while the bus connection is established.
+	 */
 	handlers_init(console, config);
 
+	/* with no interactive consumers yet, we may start out idle */
+	console_idle_update(console);
+
+	dbus_init(console, config);
+
 	rc = run_console(console);
 
 	handlers_fini(console);
+	console_transform_reap(console);
 
 	tty_fini(console);
 
+	console_throughput_fini(console);
+	console_trace_fini(console);
+
+out_mem_fini:
+	console_mem_fini(console);
+
 out_config_fini:
 	config_fini(config);
 
@@ -23,11 +23,172 @@
 #include <time.h>
 #include <systemd/sd-bus.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 struct console;
 struct config;
 
+/* Handler accounting.
+ *
+ * When enabled with the `handler-stats` configuration key, we track the number
+ * of calls and the cumulative wall and thread CPU time spent in each
+ * handler's poller event and timeout callbacks and its ringbuffer poll
+ * callbacks.
+ */
+struct handler_time {
+	uint64_t calls;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+};
+
+struct handler_stats {
+	struct handler_time event;
+	struct handler_time timeout;
+	struct handler_time ringbuffer;
+};
+
+struct handler_time_sample {
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+static inline void handler_time_start(struct handler_time_sample *sample)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, &sample->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &sample->cpu);
+}
+
+static inline uint64_t timespec_delta_ns(const struct timespec *start,
+					 const struct timespec *end)
+{
+	return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ull +
+	       (uint64_t)(end->tv_nsec - start->tv_nsec);
+}
+
+static inline void handler_time_stop(struct handler_time *time,
+				     const struct handler_time_sample *sample)
+{
+	struct handler_time_sample now;
+
+	handler_time_start(&now);
+	time->calls++;
+	time->wall_ns += timespec_delta_ns(&sample->wall, &now.wall);
+	time->cpu_ns += timespec_delta_ns(&sample->cpu, &now.cpu);
+}
+
+/* Event loop tracing.
+ *
+ * When enabled with the `trace-buffer-size` configuration key, we record
+ * timestamped spans of the event loop's work (poll() waits, tty reads,
+ * handler callbacks, forced drains and log writes) in a ring of the most
+ * recent events, which the Trace D-Bus interface dumps in Chrome trace JSON.
+ */
+enum trace_type {
+	TRACE_POLL,
+	TRACE_TTY_READ,
+	TRACE_EVENT,
+	TRACE_TIMEOUT,
+	TRACE_RINGBUFFER,
+	TRACE_FORCE,
+	TRACE_LOG_WRITE,
+};
+
+struct trace_event {
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	const char *name;
+	enum trace_type type;
+};
+
+struct trace {
+	struct trace_event *events;
+	size_t size;
+	size_t head;
+	size_t count;
+};
+
+/* Returns the span's start time, or 0 if we're not tracing */
+static inline uint64_t trace_start(struct trace *trace)
+{
+	struct timespec t;
+
+	if (!trace) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+}
+
+static inline void trace_end(struct trace *trace, enum trace_type type,
+			     const char *name, uint64_t start_ns)
+{
+	struct trace_event *event;
+
+	if (!trace) {
+		return;
+	}
+
+	event = &trace->events[trace->head];
+	event->start_ns = start_ns;
+	event->dur_ns = trace_start(trace) - start_ns;
+	event->name = name;
+	event->type = type;
+
+	trace->head = (trace->head + 1) % trace->size;
+	if (trace->count < trace->size) {
+		trace->count++;
+	}
+}
+
+/* Throughput history.
+ *
+ * Unless disabled with the `throughput-history` configuration key, we keep
+ * the recent history of the console's traffic at two resolutions: per second
+ * for the last hour, and per minute for the last day. Both rings are
+ * allocated up front, and the event loop closes off each second as it
+ * passes, so keeping the history doesn't allocate.
+ */
+struct throughput_sample {
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint16_t clients;
+	uint16_t forced;
+	uint16_t dropped;
+};
+
+struct throughput_ring {
+	struct throughput_sample *samples;
+	size_t size;
+	size_t head;
+	size_t count;
+	/* seconds per sample */
+	unsigned int interval;
+};
+
+struct throughput {
+	/* bytes read from, and written to, the host tty */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	/* the totals as of the start of the current second */
+	uint64_t mark_in;
+	uint64_t mark_out;
+	uint64_t mark_forced;
+	uint64_t mark_dropped;
+	/* the current second, and its peak client count */
+	time_t second;
+	uint16_t clients;
+
+	/* the minute so far */
+	struct throughput_sample minute;
+	unsigned int minute_secs;
+
+	struct throughput_ring seconds;
+	struct throughput_ring minutes;
+};
+
 /* Handler API.
  *
  * Console data handlers: these implement the functions that process
@@ -39,10 +200,20 @@ struct config;
  *
  * Handlers will almost always want to register a ringbuffer consumer, which
  * provides data coming from the tty. Use cosole_register_ringbuffer_consumer()
- * for this. To send data to the tty, use console_data_out().
+ * for this, or console_ringbuffer_consumer_register_push() to be handed the
+ * pending data directly. To send data to the tty, use console_data_out().
  *
  * If a handler needs to monitor a separate file descriptor for events, use the
  * poller API, through console_poller_register().
+ *
+ * Handlers may add their own D-Bus interfaces to the console object through
+ * the optional ->dbus_init() callback, which is called once the bus is set
+ * up.
+ *
+ * Handlers that can be paused at runtime, say to spare the flash during a
+ * flood of output, implement ->suspend() and ->resume(). Suspending releases
+ * the handler's ringbuffer consumers and pollers, but keeps the state needed
+ * to pick up again; ->fini() may be called while suspended.
  */
 struct handler {
 	const char *name;
@@ -50,7 +221,17 @@ struct handler {
 		    struct config *config);
 	void (*fini)(struct handler *handler);
 	int (*baudrate)(struct handler *handler, speed_t baudrate);
+	/* Optional: add the handler's own interfaces to the console object */
+	int (*dbus_init)(struct handler *handler, sd_bus *bus,
+			 const char *obj_path);
+	/* Optional: stop and restart processing console data */
+	void (*suspend)(struct handler *handler);
+	int (*resume)(struct handler *handler);
 	bool active;
+	bool suspended;
+	struct handler_stats stats;
+	/* the console's trace, if we're tracing */
+	struct trace *trace;
 };
 
 /* NOLINTBEGIN(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp) */
@@ -65,6 +246,68 @@ struct handler {
 
 int console_data_out(struct console *console, const uint8_t *data, size_t len);
 
+/*
+ * Suspend or resume an active handler by name. Returns 0 if the handler is
+ * now in the requested state, -ENOENT if there's no such active handler, or
+ * -EOPNOTSUPP if it can't be suspended.
+ */
+int console_handler_set_suspended(struct console *console, const char *name,
+				  bool suspended);
+
+/*
+ * With the `low-latency` configuration key, true for a short window after
+ * input from a client, while handlers should send output without delay.
+ */
+bool console_low_latency(struct console *console);
+
+/*
+ * Handlers hold an interactive reference while they have a consumer that
+ * wants output promptly, such as a connected client. With the `idle-mode`
+ * configuration key, while there are none, the console is idle: we wake
+ * less often for tty data, and handlers may defer their output.
+ */
+void console_interactive_get(struct console *console);
+void console_interactive_put(struct console *console);
+bool console_idle(struct console *console);
+
+/* Insert a "[obmc-console: ...]" annotation line into the console data */
+int console_queue_marker(struct console *console, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Memory accounting: charge allocations made on behalf of the console or its
+ * clients, failing with -ENOMEM if that would exceed the configured limits.
+ */
+int console_mem_init(struct console *console, struct config *config);
+void console_mem_fini(struct console *console);
+int console_mem_charge(struct console *console, size_t size);
+void console_mem_uncharge(struct console *console, size_t size);
+size_t console_mem_global_used(struct console *console);
+
+/* Event loop tracing, see trace.c */
+void console_trace_init(struct console *console, struct config *config);
+void console_trace_fini(struct console *console);
+struct trace *console_trace(struct console *console);
+/* Returns a memfd holding the trace in Chrome JSON, or a negative errno */
+int console_trace_dump(struct console *console);
+
+/* Throughput history, see throughput.c */
+void console_throughput_init(struct console *console, struct config *config);
+void console_throughput_fini(struct console *console);
+void console_throughput_update(struct console *console,
+			       const struct timeval *now);
+/*
+ * The size of the packed history at the given interval in seconds, or 0 if
+ * we don't keep one; and pack it into buf, which must have that much room.
+ */
+size_t console_throughput_packed_size(struct console *console,
+				      unsigned int interval);
+void console_throughput_pack(struct console *console, unsigned int interval,
+			     const struct timeval *now, uint8_t *buf);
+
+/* Apply a new aspeed-uart-routing config; returns a negative errno on error */
+int console_set_uart_routing(struct console *console, const char *muxcfg);
+
 enum poller_ret {
 	POLLER_OK = 0,
 	POLLER_REMOVE,
@@ -92,6 +335,19 @@ enum escape_state {
 	escape_leader,
 };
 
+/* Memory accounting, see memory.c */
+struct mem_shared;
+struct mem_slot;
+
+struct console_mem {
+	size_t used;
+	/* zero for no limit */
+	size_t limit;
+	size_t global_limit;
+	struct mem_shared *shared;
+	struct mem_slot *slot;
+};
+
 /* Console server structure */
 struct console {
 	struct {
@@ -109,6 +365,9 @@ struct console {
 				speed_t baud;
 			} uart;
 		};
+		/* When to next try to reopen a lost tty, and the backoff */
+		struct timeval reopen;
+		long reopen_interval;
 	} tty;
 	const char *console_id;
 
@@ -128,6 +387,31 @@ struct console {
 	struct sd_bus *bus;
 
 	enum escape_state state;
+
+	bool handler_stats;
+
+	/* Low-latency mode, and when its window after client input ends */
+	bool low_latency;
+	struct timeval low_latency_until;
+
+	/*
+	 * Idle mode, entered while no handler has an interactive consumer,
+	 * and when we next read the tty while idle.
+	 */
+	bool idle_mode;
+	bool idle;
+	int n_interactive;
+	struct timeval idle_read;
+
+	struct transform **transforms;
+	int n_transforms;
+	int max_transforms;
+
+	struct console_mem mem;
+
+	struct trace trace;
+
+	struct throughput throughput;
 };
 
 /* poller API */
@@ -161,6 +445,22 @@ void console_poller_set_events(struct console *console, struct poller *poller,
 void console_poller_set_timeout(struct console *console, struct poller *poller,
 				const struct timeval *tv);
 
+/*
+ * The clock that poller timeouts are measured against, and how the event
+ * loop waits on it. By default this is CLOCK_MONOTONIC and poll(); tests
+ * install a virtual clock, where waiting out a timeout advances time rather
+ * than sleeping.
+ */
+struct console_clock {
+	int (*now)(struct timeval *tv);
+	int (*wait)(struct pollfd *fds, nfds_t nfds, int timeout);
+};
+
+/* Install a clock, or restore the default with NULL */
+void console_set_clock(const struct console_clock *clock);
+
+int get_current_time(struct timeval *tv);
+
 /* ringbuffer API */
 
 enum ringbuffer_poll_ret {
@@ -171,7 +471,24 @@ enum ringbuffer_poll_ret {
 typedef enum ringbuffer_poll_ret (*ringbuffer_poll_fn_t)(void *data,
 							 size_t force_len);
 
+/*
+ * Push-style consumers are handed all of their pending data as an iovec, and
+ * return the number of bytes they consumed, which the ringbuffer commits. As
+ * with ringbuffer_poll_fn_t, a non-zero force_len requires the consumer to
+ * consume at least that many bytes, blocking if necessary. force_len never
+ * exceeds the length of the iovec.
+ *
+ * A push function registered with the ringbuffer returns a negative value
+ * to have the consumer removed, having released its own state.
+ */
+typedef ssize_t (*ringbuffer_push_fn_t)(void *data, const struct iovec *iov,
+					int iovcnt, size_t force_len);
+
+/* spilled data, the ring up to its end, and the ring from its start */
+#define RINGBUFFER_IOV_MAX 3
+
 struct ringbuffer_consumer;
+struct ringbuffer_spill;
 
 struct ringbuffer {
 	uint8_t *buf;
@@ -179,13 +496,23 @@ struct ringbuffer {
 	size_t tail;
 	struct ringbuffer_consumer **consumers;
 	int n_consumers;
+	/* forced drains, and consumers dropped for failing one */
+	uint64_t n_forced;
+	uint64_t n_dropped;
 };
 
 struct ringbuffer_consumer {
 	struct ringbuffer *rb;
 	ringbuffer_poll_fn_t poll_fn;
+	ringbuffer_push_fn_t push_fn;
 	void *poll_data;
 	size_t pos;
+	struct ringbuffer_spill *spill;
+	/* if set, account ->poll_fn calls here */
+	struct handler_time *stats;
+	/* if set, trace ->poll_fn calls here, under the handler's name */
+	struct trace *trace;
+	const char *trace_name;
 };
 
 struct ringbuffer *ringbuffer_init(size_t size);
@@ -195,8 +522,19 @@ struct ringbuffer_consumer *
 ringbuffer_consumer_register(struct ringbuffer *rb,
 			     ringbuffer_poll_fn_t poll_fn, void *data);
 
+struct ringbuffer_consumer *
+ringbuffer_consumer_register_push(struct ringbuffer *rb,
+				  ringbuffer_push_fn_t push_fn, void *data);
+
 void ringbuffer_consumer_unregister(struct ringbuffer_consumer *rbc);
 
+/* Allow the consumer to fall behind by up to max_size bytes without forcing
+ * a blocking drain, by spilling its oldest pending data to fd. The ringbuffer
+ * takes ownership of fd, which is closed when the consumer is unregistered.
+ */
+int ringbuffer_consumer_enable_spill(struct ringbuffer_consumer *rbc, int fd,
+				     size_t max_size);
+
 int ringbuffer_queue(struct ringbuffer *rb, uint8_t *data, size_t len);
 
 size_t ringbuffer_dequeue_peek(struct ringbuffer_consumer *rbc, size_t offset,
@@ -206,11 +544,49 @@ int ringbuffer_dequeue_commit(struct ringbuffer_consumer *rbc, size_t len);
 
 size_t ringbuffer_len(struct ringbuffer_consumer *rbc);
 
+/* Offer the consumer's pending data to fn, committing what it consumes.
+ * Returns the number of bytes consumed, or -1 if fn failed. fn is called at
+ * least once, with an empty iovec if nothing is pending. */
+ssize_t ringbuffer_dequeue_iov(struct ringbuffer_consumer *rbc,
+			       size_t force_len, ringbuffer_push_fn_t fn,
+			       void *data);
+
+/* Copy len bytes of iov, starting offset bytes in, to dst, which has room
+ * for RINGBUFFER_IOV_MAX entries. Returns the number of entries used. */
+int ringbuffer_iov_slice(struct iovec *dst, const struct iovec *iov,
+			 int iovcnt, size_t offset, size_t len);
+
+size_t ringbuffer_iov_len(const struct iovec *iov, int iovcnt);
+
 /* console wrapper around ringbuffer consumer registration */
 struct ringbuffer_consumer *
 console_ringbuffer_consumer_register(struct console *console,
+				     struct handler *handler,
 				     ringbuffer_poll_fn_t poll_fn, void *data);
 
+/* As above, but consume the output of a transform chain; a NULL or empty
+ * transform spec consumes the untransformed data. */
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_transform(
+	struct console *console, struct handler *handler, const char *transform,
+	ringbuffer_poll_fn_t poll_fn, void *data);
+
+/* As above, for a push-style consumer */
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *console, struct handler *handler, const char *transform,
+	ringbuffer_push_fn_t push_fn, void *data);
+
+/* transform API */
+struct transform;
+
+/* Find or create the transform chain described by spec, e.g.
+ * "strip-ansi,crlf", returning the ringbuffer holding its output. Returns
+ * NULL, with errno set to EUSERS, if that would exceed the chain limit. */
+struct ringbuffer *console_transform_ringbuffer(struct console *console,
+						const char *spec);
+void console_transform_init(struct console *console, struct config *config);
+/* Tear down the chains that have no consumers left */
+void console_transform_reap(struct console *console);
+
 /* Console server API */
 void tty_init_termios(struct console *console);
 
@@ -226,6 +602,7 @@ int config_parse_baud(speed_t *speed, const char *baud_string);
 uint32_t parse_baud_to_int(speed_t speed);
 speed_t parse_int_to_baud(uint32_t baud);
 int config_parse_bytesize(const char *size_str, size_t *size);
+int config_parse_bool(bool *val, const char *str);
 
 /* socket paths */
 ssize_t console_socket_path(socket_path_t path, const char *id);
@@ -240,7 +617,16 @@ void dbus_init(struct console *console,
 	       struct config *config __attribute__((unused)));
 
 /* socket-handler API */
-int dbus_create_socket_consumer(struct console *console);
+struct socket_consumer_options {
+	bool spill;
+	/* transform spec, see console_transform_ringbuffer() */
+	const char *transform;
+	/* "zstd" or "none"; zstd is only available if built with it */
+	const char *compression;
+};
+
+int dbus_create_socket_consumer(struct console *console,
+				const struct socket_consumer_options *opts);
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
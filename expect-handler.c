@@ -0,0 +1,578 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "console-server.h"
+
+/*
+ * Expect-style automation: D-Bus methods to send input to the console, and
+ * to wait for a pattern in its output, so that scripts driving a host's
+ * console don't need to attach a client and poll.
+ *
+ * We keep a window of recent console output. Offsets are into the stream
+ * of output since server start: Mark() returns the current offset, and
+ * WaitFor() searches the output from a mark for a literal pattern,
+ * replying with the output from the mark to the end of the match. A
+ * WaitFor() that can't be satisfied from the window yet is answered
+ * asynchronously, as output arrives or when its timeout expires.
+ *
+ * Keeping the window costs memory and a copy of all output, so the
+ * interface is only provided with `expect = true` in the configuration.
+ */
+
+#define EXPECT_INTF	    "xyz.openbmc_project.Console.Expect"
+#define EXPECT_DBUS_ERR	    "org.openbmc.error"
+#define EXPECT_TIMEOUT_ERR  "org.freedesktop.DBus.Error.Timeout"
+#define EXPECT_DEFAULT_SIZE (64 * 1024)
+
+struct expect_waiter {
+	sd_bus_message *msg;
+	char *pattern;
+	size_t pattern_len;
+	uint64_t mark;
+	/* offset at which to resume searching */
+	uint64_t scanned;
+	struct timeval deadline;
+};
+
+struct expect_handler {
+	struct handler handler;
+	struct console *console;
+	struct ringbuffer_consumer *rbc;
+	struct poller *poller;
+
+	/*
+	 * The window holds at least the last size bytes of output, at
+	 * buf[start, start + len), starting at stream offset base. We
+	 * allocate twice the window, so we only need to move the data down
+	 * once the end of the buffer is reached.
+	 */
+	uint8_t *buf;
+	size_t size;
+	size_t start;
+	size_t len;
+	uint64_t base;
+
+	struct expect_waiter **waiters;
+	int n_waiters;
+};
+
+static struct expect_handler *to_expect_handler(struct handler *handler)
+{
+	return container_of(handler, struct expect_handler, handler);
+}
+
+static uint64_t expect_end(struct expect_handler *eh)
+{
+	return eh->base + eh->len;
+}
+
+static void expect_append(struct expect_handler *eh, const uint8_t *data,
+			  size_t len)
+{
+	size_t drop;
+
+	/* only the last size bytes can stay in the window */
+	if (len >= eh->size) {
+		eh->base += eh->len + len - eh->size;
+		eh->start = 0;
+		eh->len = 0;
+		data += len - eh->size;
+		len = eh->size;
+	} else if (eh->start + eh->len + len > 2 * eh->size) {
+		drop = eh->len + len > eh->size ? eh->len + len - eh->size : 0;
+		memmove(eh->buf, eh->buf + eh->start + drop, eh->len - drop);
+		eh->start = 0;
+		eh->len -= drop;
+		eh->base += drop;
+	}
+
+	memcpy(eh->buf + eh->start + eh->len, data, len);
+	eh->len += len;
+}
+
+/* Search the window for the waiter's pattern, returning the end offset of
+ * the match, or 0 if there's no match yet */
+static uint64_t expect_search(struct expect_handler *eh,
+			      struct expect_waiter *waiter)
+{
+	uint64_t from;
+	uint8_t *p;
+
+	from = waiter->scanned > eh->base ? waiter->scanned : eh->base;
+	if (expect_end(eh) - from < waiter->pattern_len) {
+		return 0;
+	}
+
+	p = memmem(eh->buf + eh->start + (from - eh->base),
+		   expect_end(eh) - from, waiter->pattern, waiter->pattern_len);
+	if (!p) {
+		/* a match may yet start in the last pattern_len - 1 bytes */
+		waiter->scanned = expect_end(eh) - waiter->pattern_len + 1;
+		return 0;
+	}
+
+	return eh->base + (p - (eh->buf + eh->start)) + waiter->pattern_len;
+}
+
+static int expect_reply_capture(struct expect_handler *eh, sd_bus_message *msg,
+				uint64_t mark, uint64_t end)
+{
+	sd_bus_message *reply;
+	int r;
+
+	r = sd_bus_message_new_method_return(msg, &reply);
+	if (r < 0) {
+		return r;
+	}
+
+	r = sd_bus_message_append_array(reply, 'y',
+					eh->buf + eh->start + (mark - eh->base),
+					end - mark);
+	if (r >= 0) {
+		r = sd_bus_send(NULL, reply, NULL);
+	}
+
+	sd_bus_message_unref(reply);
+	return r;
+}
+
+static void expect_waiter_free(struct expect_waiter *waiter)
+{
+	sd_bus_message_unref(waiter->msg);
+	free(waiter->pattern);
+	free(waiter);
+}
+
+static void expect_waiter_remove(struct expect_handler *eh, int idx)
+{
+	expect_waiter_free(eh->waiters[idx]);
+	console_interactive_put(eh->console);
+
+	eh->n_waiters--;
+	/*
+	 * We're managing an array of pointers to aggregates, so don't warn about sizeof() on a
+	 * pointer type.
+	 */
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */
+	memmove(&eh->waiters[idx], &eh->waiters[idx + 1],
+		sizeof(*eh->waiters) * (eh->n_waiters - idx));
+	eh->waiters = reallocarray(eh->waiters, eh->n_waiters,
+				   sizeof(*eh->waiters));
+	/* NOLINTEND(bugprone-sizeof-expression) */
+}
+
+static void expect_reply_error(struct expect_waiter *waiter, const char *name,
+			       const char *message)
+{
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	sd_bus_error_set_const(&err, name, message);
+	sd_bus_reply_method_error(waiter->msg, &err);
+}
+
+/* Arm the timer for the earliest waiter deadline */
+static void expect_update_timeout(struct expect_handler *eh)
+{
+	struct timeval *earliest = NULL;
+	struct timeval now;
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < eh->n_waiters; i++) {
+		if (!earliest ||
+		    timercmp(&eh->waiters[i]->deadline, earliest, <)) {
+			earliest = &eh->waiters[i]->deadline;
+		}
+	}
+
+	if (!earliest) {
+		timerclear(&eh->poller->timeout);
+		return;
+	}
+
+	if (get_current_time(&now)) {
+		return;
+	}
+
+	if (timercmp(earliest, &now, <)) {
+		timerclear(&tv);
+	} else {
+		timersub(earliest, &now, &tv);
+	}
+
+	console_poller_set_timeout(eh->console, eh->poller, &tv);
+}
+
+/* Answer any waiters that have matched, or whose mark we've lost */
+static void expect_check_waiters(struct expect_handler *eh)
+{
+	struct expect_waiter *waiter;
+	uint64_t end;
+	int i;
+
+	for (i = 0; i < eh->n_waiters; i++) {
+		waiter = eh->waiters[i];
+
+		if (waiter->mark < eh->base) {
+			expect_reply_error(waiter, EXPECT_DBUS_ERR,
+					   "Output since mark was discarded");
+		} else {
+			end = expect_search(eh, waiter);
+			if (!end) {
+				continue;
+			}
+			expect_reply_capture(eh, waiter->msg, waiter->mark, end);
+		}
+
+		expect_waiter_remove(eh, i);
+		i--;
+	}
+
+	expect_update_timeout(eh);
+}
+
+static ssize_t expect_ringbuffer_push(void *arg, const struct iovec *iov,
+				      int iovcnt,
+				      size_t force_len __attribute__((unused)))
+{
+	struct expect_handler *eh = arg;
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		expect_append(eh, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+
+	if (eh->n_waiters) {
+		expect_check_waiters(eh);
+	}
+
+	return (ssize_t)total;
+}
+
+static enum poller_ret expect_timeout(struct handler *handler,
+				      void *data __attribute__((unused)))
+{
+	struct expect_handler *eh = to_expect_handler(handler);
+	struct expect_waiter *waiter;
+	struct timeval now;
+	int i;
+
+	if (get_current_time(&now)) {
+		return POLLER_OK;
+	}
+
+	for (i = 0; i < eh->n_waiters; i++) {
+		waiter = eh->waiters[i];
+		if (timercmp(&waiter->deadline, &now, >)) {
+			continue;
+		}
+
+		expect_reply_error(waiter, EXPECT_TIMEOUT_ERR,
+				   "Timed out waiting for pattern");
+		expect_waiter_remove(eh, i);
+		i--;
+	}
+
+	expect_update_timeout(eh);
+
+	return POLLER_OK;
+}
+
+static int method_send(sd_bus_message *msg, void *userdata, sd_bus_error *err)
+{
+	struct expect_handler *eh = userdata;
+	const void *data;
+	size_t len;
+	int r;
+
+	r = sd_bus_message_read_array(msg, 'y', &data, &len);
+	if (r < 0) {
+		return r;
+	}
+
+	if (console_data_out(eh->console, data, len)) {
+		sd_bus_error_set_const(err, EXPECT_DBUS_ERR,
+				       "Failed to write to console");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	return sd_bus_reply_method_return(msg, NULL);
+}
+
+static int method_mark(sd_bus_message *msg, void *userdata,
+		       sd_bus_error *err __attribute__((unused)))
+{
+	struct expect_handler *eh = userdata;
+
+	return sd_bus_reply_method_return(msg, "t", expect_end(eh));
+}
+
+static int expect_check_mark(struct expect_handler *eh, uint64_t mark,
+			     sd_bus_error *err)
+{
+	if (mark > expect_end(eh)) {
+		sd_bus_error_set_const(err, EXPECT_DBUS_ERR, "Invalid mark");
+		return -EINVAL;
+	}
+
+	if (mark < eh->base) {
+		sd_bus_error_set_const(err, EXPECT_DBUS_ERR,
+				       "Output since mark was discarded");
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+static int method_capture(sd_bus_message *msg, void *userdata,
+			  sd_bus_error *err)
+{
+	struct expect_handler *eh = userdata;
+	uint64_t mark;
+	int r;
+
+	r = sd_bus_message_read(msg, "t", &mark);
+	if (r < 0) {
+		return r;
+	}
+
+	if (expect_check_mark(eh, mark, err)) {
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	return expect_reply_capture(eh, msg, mark, expect_end(eh));
+}
+
+static int method_wait_for(sd_bus_message *msg, void *userdata,
+			   sd_bus_error *err)
+{
+	struct expect_handler *eh = userdata;
+	struct expect_waiter **waiters;
+	struct expect_waiter *waiter;
+	const char *pattern;
+	struct timeval now;
+	struct timeval tv;
+	uint32_t timeout;
+	uint64_t mark;
+	uint64_t end;
+	int r;
+
+	r = sd_bus_message_read(msg, "tsu", &mark, &pattern, &timeout);
+	if (r < 0) {
+		return r;
+	}
+
+	if (!*pattern) {
+		sd_bus_error_set_const(err, EXPECT_DBUS_ERR, "Empty pattern");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	if (expect_check_mark(eh, mark, err)) {
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	waiter = calloc(1, sizeof(*waiter));
+	if (!waiter) {
+		return -ENOMEM;
+	}
+
+	waiter->pattern = strdup(pattern);
+	if (!waiter->pattern) {
+		free(waiter);
+		return -ENOMEM;
+	}
+	waiter->pattern_len = strlen(pattern);
+	waiter->mark = mark;
+	waiter->scanned = mark;
+
+	end = expect_search(eh, waiter);
+	if (end) {
+		free(waiter->pattern);
+		free(waiter);
+		return expect_reply_capture(eh, msg, mark, end);
+	}
+
+	if (get_current_time(&now)) {
+		free(waiter->pattern);
+		free(waiter);
+		return -EIO;
+	}
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	timeradd(&now, &tv, &waiter->deadline);
+
+	/*
+	 * We're managing an array of pointers to aggregates, so don't warn about sizeof() on a
+	 * pointer type.
+	 */
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */
+	waiters = reallocarray(eh->waiters, eh->n_waiters + 1,
+			       sizeof(*eh->waiters));
+	/* NOLINTEND(bugprone-sizeof-expression) */
+	if (!waiters) {
+		free(waiter->pattern);
+		free(waiter);
+		return -ENOMEM;
+	}
+	eh->waiters = waiters;
+	eh->waiters[eh->n_waiters++] = waiter;
+
+	/* a waiter wants the output promptly, so keep us out of idle */
+	console_interactive_get(eh->console);
+
+	/* we'll reply once the pattern appears, or at the timeout */
+	waiter->msg = sd_bus_message_ref(msg);
+	expect_update_timeout(eh);
+
+	return 1;
+}
+
+/*
+ * Mark returns the current output offset. Capture returns the output since
+ * a mark. WaitFor(mark, pattern, timeout_ms) waits for the literal pattern
+ * to appear in the output since mark, and returns the output from mark to
+ * the end of the match. Callers should set a method call timeout longer
+ * than timeout_ms.
+ */
+static const sd_bus_vtable expect_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("Send", "ay", SD_BUS_NO_RESULT, method_send, 0),
+	SD_BUS_METHOD("Mark", SD_BUS_NO_ARGS, "t", method_mark, 0),
+	SD_BUS_METHOD("Capture", "t", "ay", method_capture, 0),
+	SD_BUS_METHOD("WaitFor", "tsu", "ay", method_wait_for, 0),
+	SD_BUS_VTABLE_END,
+};
+
+static int expect_dbus_init(struct handler *handler, sd_bus *bus,
+			    const char *obj_path)
+{
+	struct expect_handler *eh = to_expect_handler(handler);
+
+	return sd_bus_add_object_vtable(bus, NULL, obj_path, EXPECT_INTF,
+					expect_vtable, eh);
+}
+
+static int expect_init(struct handler *handler, struct console *console,
+		       struct config *config)
+{
+	struct expect_handler *eh = to_expect_handler(handler);
+	const char *val;
+	bool enabled;
+
+	val = config_get_value(config, "expect");
+	if (!val) {
+		return -1;
+	}
+
+	if (config_parse_bool(&enabled, val)) {
+		warnx("Invalid expect value: '%s'", val);
+		return -1;
+	}
+
+	if (!enabled) {
+		return -1;
+	}
+
+	eh->console = console;
+	eh->size = EXPECT_DEFAULT_SIZE;
+	eh->start = 0;
+	eh->len = 0;
+	eh->base = 0;
+	eh->waiters = NULL;
+	eh->n_waiters = 0;
+
+	val = config_get_value(config, "expect-buffer-size");
+	if (val) {
+		if (config_parse_bytesize(val, &eh->size)) {
+			warnx("Invalid expect-buffer-size: '%s'", val);
+			return -1;
+		}
+		/* a zero size disables the expect interface */
+		if (!eh->size) {
+			return -1;
+		}
+	}
+
+	if (console_mem_charge(console, 2 * eh->size)) {
+		warnx("Memory limit reached, can't allocate expect buffer");
+		return -1;
+	}
+
+	eh->buf = malloc(2 * eh->size);
+	if (!eh->buf) {
+		warn("Can't allocate expect buffer");
+		goto err_uncharge;
+	}
+
+	eh->poller = console_poller_register(console, handler, NULL,
+					     expect_timeout, -1, 0, NULL);
+	if (!eh->poller) {
+		goto err_free;
+	}
+
+	eh->rbc = console_ringbuffer_consumer_register_push(
+		console, handler, NULL, expect_ringbuffer_push, eh);
+	if (!eh->rbc) {
+		goto err_unregister;
+	}
+
+	return 0;
+
+err_unregister:
+	console_poller_unregister(console, eh->poller);
+err_free:
+	free(eh->buf);
+err_uncharge:
+	console_mem_uncharge(console, 2 * eh->size);
+	return -1;
+}
+
+static void expect_fini(struct handler *handler)
+{
+	struct expect_handler *eh = to_expect_handler(handler);
+
+	while (eh->n_waiters) {
+		expect_waiter_remove(eh, 0);
+	}
+
+	ringbuffer_consumer_unregister(eh->rbc);
+	console_poller_unregister(eh->console, eh->poller);
+	console_mem_uncharge(eh->console, 2 * eh->size);
+	free(eh->buf);
+}
+
+static struct expect_handler expect_handler = {
+	.handler = {
+		.name		= "expect",
+		.init		= expect_init,
+		.fini		= expect_fini,
+		.dbus_init	= expect_dbus_init,
+	},
+};
+
+console_handler_register(&expect_handler.handler);
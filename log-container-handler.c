@@ -0,0 +1,678 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "console-server.h"
+
+/*
+ * A log shared by all the consoles on the BMC.
+ *
+ * With concurrent servers, each console's log handler keeps its own log and
+ * rotate file, and writes to them in small pieces as output arrives. With
+ * `log-container` set, the servers instead share one log, where each record
+ * is tagged with its console id and a timestamp, and a single writer appends
+ * the records to the file in batches.
+ *
+ * The writer is whichever server binds the container's abstract socket
+ * first. The others connect to it and send their output as datagrams, a
+ * record each. If the writer exits, the next server to send to it finds it
+ * gone, and holds the election again. Anyone can send to an abstract
+ * socket, so the writer only takes records from servers running as its own
+ * user.
+ *
+ * Each record is a struct log_record header, then the console id, then the
+ * data. The header is little-endian.
+ */
+
+#define LOG_RECORD_MAGIC    0x4c43424fu /* "OBCL" */
+#define LOG_RECORD_DATA_MAX 4096
+#define LOG_RECORD_ID_MAX   255
+
+struct log_record {
+	uint32_t magic;
+	uint16_t id_len;
+	uint16_t data_len;
+	/* CLOCK_REALTIME, in microseconds */
+	uint64_t time_us;
+};
+
+#define LOG_RECORD_MAX                                                         \
+	(sizeof(struct log_record) + LOG_RECORD_ID_MAX + LOG_RECORD_DATA_MAX)
+
+static const char *container_socket_prefix = "obmc-console-log-container:";
+static const size_t default_container_size = 256ul * 1024ul;
+static const size_t container_batch_size = 16ul * 1024ul;
+static const struct timeval container_flush_interval = { 1, 0 };
+
+struct log_container {
+	struct handler handler;
+	struct console *console;
+	struct ringbuffer_consumer *rbc;
+	struct poller *poller;
+	char *transform;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int sd;
+	bool writer;
+	bool blocked;
+	/* the writer has gone away, so we need to hold another election */
+	bool lost;
+
+	/* the writer's state */
+	char *filename;
+	char *rotate_filename;
+	int fd;
+	size_t size;
+	size_t maxsize;
+	uint8_t *batch;
+	size_t batch_len;
+};
+
+static struct log_container *to_log_container(struct handler *handler)
+{
+	return container_of(handler, struct log_container, handler);
+}
+
+static void lc_record_init(struct log_record *rec, size_t id_len,
+			   size_t data_len)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	rec->magic = htole32(LOG_RECORD_MAGIC);
+	rec->id_len = htole16((uint16_t)id_len);
+	rec->data_len = htole16((uint16_t)data_len);
+	rec->time_us = htole64((uint64_t)t.tv_sec * 1000000ull +
+			       (uint64_t)t.tv_nsec / 1000);
+}
+
+static int lc_open(struct log_container *lc, int flags)
+{
+	struct stat st;
+
+	flags |= O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;
+	lc->fd = open(lc->filename, flags, 0644);
+	if (lc->fd < 0) {
+		warn("Can't open log container %s", lc->filename);
+		return -1;
+	}
+
+	lc->size = fstat(lc->fd, &st) ? 0 : (size_t)st.st_size;
+
+	return 0;
+}
+
+static void lc_rotate(struct log_container *lc)
+{
+	if (lc->fd < 0) {
+		return;
+	}
+
+	close(lc->fd);
+	if (rename(lc->filename, lc->rotate_filename)) {
+		warn("Failed to rename %s to %s", lc->filename,
+		     lc->rotate_filename);
+	}
+	lc_open(lc, O_TRUNC);
+}
+
+static void lc_flush(struct log_container *lc)
+{
+	uint64_t start;
+
+	if (!lc->batch_len) {
+		return;
+	}
+
+	if (lc->size && lc->size + lc->batch_len > lc->maxsize) {
+		lc_rotate(lc);
+	}
+
+	if (lc->fd < 0) {
+		lc->batch_len = 0;
+		return;
+	}
+
+	start = trace_start(lc->handler.trace);
+	if (write_buf_to_fd(lc->fd, lc->batch, lc->batch_len)) {
+		warn("Failed to write to log container %s", lc->filename);
+	} else {
+		lc->size += lc->batch_len;
+	}
+	trace_end(lc->handler.trace, TRACE_LOG_WRITE, lc->handler.name, start);
+
+	lc->batch_len = 0;
+}
+
+/* Add a record to the batch, which we write out when full, or once it's a
+ * flush interval old */
+static void lc_append(struct log_container *lc, const struct iovec *iov,
+		      int iovcnt)
+{
+	size_t len = ringbuffer_iov_len(iov, iovcnt);
+	int i;
+
+	if (lc->batch_len + len > container_batch_size) {
+		lc_flush(lc);
+	}
+
+	if (!lc->batch_len && !timerisset(&lc->poller->timeout)) {
+		console_poller_set_timeout(lc->console, lc->poller,
+					   &container_flush_interval);
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(lc->batch + lc->batch_len, iov[i].iov_base,
+		       iov[i].iov_len);
+		lc->batch_len += iov[i].iov_len;
+	}
+}
+
+/* Whether a record came from a server running as our user */
+static bool lc_sender_trusted(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct ucred cred;
+
+	if (msg->msg_flags & MSG_CTRUNC) {
+		return false;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_CREDENTIALS) {
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+			return cred.uid == geteuid();
+		}
+	}
+
+	return false;
+}
+
+/* Take the records that the other servers have sent us */
+static void lc_receive(struct log_container *lc)
+{
+	uint8_t cbuf[CMSG_SPACE(sizeof(struct ucred))];
+	uint8_t buf[LOG_RECORD_MAX];
+	struct log_record rec;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	for (;;) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		len = recvmsg(lc->sd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (!lc_sender_trusted(&msg)) {
+			warnx("Dropping a log container record from another user");
+			continue;
+		}
+
+		if ((size_t)len < sizeof(rec)) {
+			warnx("Dropping a malformed log container record");
+			continue;
+		}
+
+		memcpy(&rec, buf, sizeof(rec));
+		if (le32toh(rec.magic) != LOG_RECORD_MAGIC ||
+		    (size_t)len != sizeof(rec) + le16toh(rec.id_len) +
+					   le16toh(rec.data_len)) {
+			warnx("Dropping a malformed log container record");
+			continue;
+		}
+
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		lc_append(lc, &iov, 1);
+	}
+}
+
+static void lc_set_blocked(struct log_container *lc, bool blocked)
+{
+	if (blocked == lc->blocked) {
+		return;
+	}
+
+	lc->blocked = blocked;
+	console_poller_set_events(lc->console, lc->poller,
+				  blocked ? POLLOUT : 0);
+}
+
+/*
+ * Record console data, returning the number of bytes consumed. The writer
+ * batches its own records; the others send theirs to the writer. If it's
+ * stalled, we drop forced data rather than block the server on it.
+ */
+static ssize_t lc_drain_queue(void *arg, const struct iovec *iov, int iovcnt,
+			      size_t force_len)
+{
+	struct log_container *lc = arg;
+	const char *id = lc->console->console_id;
+	size_t id_len = strlen(id);
+	struct log_record rec;
+	struct iovec rec_iov[3];
+	size_t total = 0;
+	size_t len;
+	size_t off;
+	ssize_t rc;
+	int i;
+
+	if (lc->blocked || lc->lost) {
+		return (ssize_t)force_len;
+	}
+
+	rec_iov[0].iov_base = &rec;
+	rec_iov[0].iov_len = sizeof(rec);
+	rec_iov[1].iov_base = (void *)id;
+	rec_iov[1].iov_len = id_len;
+
+	for (i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].iov_len; off += len) {
+			len = iov[i].iov_len - off;
+			if (len > LOG_RECORD_DATA_MAX) {
+				len = LOG_RECORD_DATA_MAX;
+			}
+
+			lc_record_init(&rec, id_len, len);
+			rec_iov[2].iov_base = (uint8_t *)iov[i].iov_base + off;
+			rec_iov[2].iov_len = len;
+
+			if (lc->writer) {
+				lc_append(lc, rec_iov, 3);
+				total += len;
+				continue;
+			}
+
+			rc = writev(lc->sd, rec_iov, 3);
+			if (rc >= 0) {
+				total += len;
+				continue;
+			}
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				lc_set_blocked(lc, true);
+			} else {
+				lc->lost = true;
+			}
+			return (ssize_t)(total > force_len ? total : force_len);
+		}
+	}
+
+	return (ssize_t)total;
+}
+
+static enum poller_ret lc_poll(struct handler *handler, int events,
+			       void *data);
+static enum poller_ret lc_timeout(struct handler *handler, void *data);
+
+/*
+ * Become the writer if nobody else is, or connect to whoever is. We may race
+ * with a writer that's exiting, so go around until one or the other works.
+ */
+static int lc_elect(struct log_container *lc)
+{
+	int tries;
+	int one = 1;
+	int sd;
+
+	lc->writer = false;
+	lc->blocked = false;
+	lc->lost = false;
+
+	for (tries = 0; tries < 3; tries++) {
+		sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    0);
+		if (sd < 0) {
+			warn("Can't create log container socket");
+			return -1;
+		}
+
+		/* before we bind, so every record has its sender's creds */
+		if (setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &one,
+			       sizeof(one))) {
+			warn("Can't set log container socket options");
+			close(sd);
+			return -1;
+		}
+
+		if (!bind(sd, (struct sockaddr *)&lc->addr, lc->addrlen)) {
+			lc->writer = true;
+			break;
+		}
+
+		if (errno == EADDRINUSE &&
+		    !connect(sd, (struct sockaddr *)&lc->addr, lc->addrlen)) {
+			break;
+		}
+
+		close(sd);
+		sd = -1;
+	}
+
+	if (sd < 0) {
+		warn("Can't join log container %s", lc->filename);
+		return -1;
+	}
+
+	if (lc->writer && lc->fd < 0 && lc_open(lc, 0)) {
+		close(sd);
+		return -1;
+	}
+
+	lc->sd = sd;
+	lc->poller = console_poller_register(lc->console, &lc->handler,
+					     lc_poll, lc_timeout, sd,
+					     lc->writer ? POLLIN : 0, lc);
+	if (!lc->poller) {
+		close(sd);
+		lc->sd = -1;
+		return -1;
+	}
+
+	if (lc->writer) {
+		printf("Writing log container %s\n", lc->filename);
+	}
+
+	return 0;
+}
+
+/* The writer has gone: hold the election again, and catch up */
+static void lc_reelect(struct log_container *lc)
+{
+	close(lc->sd);
+	lc->sd = -1;
+	lc->poller = NULL;
+
+	if (lc_elect(lc) || !lc->rbc) {
+		return;
+	}
+
+	if (ringbuffer_dequeue_iov(lc->rbc, 0, lc_drain_queue, lc) < 0) {
+		warnx("Failed to flush the log container");
+	}
+}
+
+static ssize_t lc_ringbuffer_push(void *arg, const struct iovec *iov,
+				  int iovcnt, size_t force_len)
+{
+	struct log_container *lc = arg;
+	struct iovec rest[RINGBUFFER_IOV_MAX];
+	size_t len;
+	ssize_t rc;
+	int n;
+
+	rc = lc_drain_queue(lc, iov, iovcnt, force_len);
+	if (!lc->lost) {
+		return rc;
+	}
+
+	/* we're not within a poller, so can swap ours directly */
+	console_poller_unregister(lc->console, lc->poller);
+	close(lc->sd);
+	lc->sd = -1;
+	lc->poller = NULL;
+	if (lc_elect(lc)) {
+		return rc;
+	}
+
+	len = ringbuffer_iov_len(iov, iovcnt);
+	if ((size_t)rc < len) {
+		n = ringbuffer_iov_slice(rest, iov, iovcnt, rc, len - rc);
+		rc += lc_drain_queue(lc, rest, n, 0);
+	}
+
+	return rc;
+}
+
+static enum poller_ret lc_poll(struct handler *handler, int events,
+			       void __attribute__((unused)) * data)
+{
+	struct log_container *lc = to_log_container(handler);
+
+	if (lc->writer) {
+		if (events & POLLIN) {
+			lc_receive(lc);
+		}
+		return POLLER_OK;
+	}
+
+	if (events & (POLLOUT | POLLERR | POLLHUP)) {
+		lc_set_blocked(lc, false);
+		if (lc->rbc &&
+		    ringbuffer_dequeue_iov(lc->rbc, 0, lc_drain_queue, lc) <
+			    0) {
+			warnx("Failed to flush the log container");
+		}
+	}
+
+	if (lc->lost) {
+		/* our poller is removed once we return */
+		lc_reelect(lc);
+		return POLLER_REMOVE;
+	}
+
+	return POLLER_OK;
+}
+
+static enum poller_ret lc_timeout(struct handler *handler,
+				  void __attribute__((unused)) * data)
+{
+	lc_flush(to_log_container(handler));
+
+	return POLLER_OK;
+}
+
+static int lc_init(struct handler *handler, struct console *console,
+		   struct config *config)
+{
+	struct log_container *lc = to_log_container(handler);
+	const char *filename;
+	const char *size_str;
+	const char *val;
+	size_t len;
+	int rc;
+
+	filename = config_get_value(config, "log-container");
+	if (!filename) {
+		return -1;
+	}
+
+	if (strlen(console->console_id) > LOG_RECORD_ID_MAX) {
+		warnx("Console id is too long for the log container");
+		return -1;
+	}
+
+	lc->console = console;
+	lc->sd = -1;
+	lc->fd = -1;
+	lc->batch_len = 0;
+	lc->transform = NULL;
+
+	lc->maxsize = default_container_size;
+	size_str = config_get_value(config, "log-container-size");
+	if (size_str && config_parse_bytesize(size_str, &lc->maxsize)) {
+		lc->maxsize = default_container_size;
+		warnx("Invalid log-container-size. Default to %zukB",
+		      lc->maxsize >> 10);
+	}
+
+	/* the socket is named for the container, so others can coexist */
+	memset(&lc->addr, 0, sizeof(lc->addr));
+	lc->addr.sun_family = AF_UNIX;
+	len = strlen(container_socket_prefix) + strlen(filename);
+	if (len + 1 > sizeof(lc->addr.sun_path)) {
+		warnx("Log container path %s is too long", filename);
+		return -1;
+	}
+	memcpy(lc->addr.sun_path + 1, container_socket_prefix,
+	       strlen(container_socket_prefix));
+	memcpy(lc->addr.sun_path + 1 + strlen(container_socket_prefix),
+	       filename, strlen(filename));
+	lc->addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+	lc->filename = strdup(filename);
+	rc = asprintf(&lc->rotate_filename, "%s.1", filename);
+	if (!lc->filename || rc < 0) {
+		goto err_free;
+	}
+
+	val = config_get_value(config, "log-transform");
+	if (val) {
+		lc->transform = strdup(val);
+	}
+
+	if (console_mem_charge(console, container_batch_size)) {
+		warnx("Memory limit reached, log container disabled");
+		goto err_free;
+	}
+
+	lc->batch = malloc(container_batch_size);
+	if (!lc->batch) {
+		goto err_uncharge;
+	}
+
+	if (lc_elect(lc)) {
+		goto err_free_batch;
+	}
+
+	lc->rbc = console_ringbuffer_consumer_register_push(
+		console, handler, lc->transform, lc_ringbuffer_push, lc);
+	if (!lc->rbc) {
+		warnx("Invalid log-transform");
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	console_poller_unregister(console, lc->poller);
+	close(lc->sd);
+	if (lc->fd >= 0) {
+		close(lc->fd);
+	}
+err_free_batch:
+	free(lc->batch);
+err_uncharge:
+	console_mem_uncharge(console, container_batch_size);
+err_free:
+	free(lc->filename);
+	free(lc->rotate_filename);
+	free(lc->transform);
+	return -1;
+}
+
+static void lc_fini(struct handler *handler)
+{
+	struct log_container *lc = to_log_container(handler);
+
+	if (lc->sd >= 0 && lc->writer) {
+		/* take what's been sent to us, before we stop listening */
+		lc_receive(lc);
+	}
+
+	if (lc->rbc) {
+		ringbuffer_dequeue_iov(lc->rbc, 0, lc_drain_queue, lc);
+		ringbuffer_consumer_unregister(lc->rbc);
+	}
+
+	if (lc->poller) {
+		console_poller_unregister(lc->console, lc->poller);
+	}
+	if (lc->sd >= 0) {
+		close(lc->sd);
+	}
+
+	lc_flush(lc);
+	if (lc->fd >= 0) {
+		close(lc->fd);
+	}
+
+	free(lc->batch);
+	console_mem_uncharge(lc->console, container_batch_size);
+	free(lc->filename);
+	free(lc->rotate_filename);
+	free(lc->transform);
+}
+
+/*
+ * Stop recording our own console. We keep our place in the container
+ * though: if we're the writer, the other servers still depend on us.
+ */
+static void lc_suspend(struct handler *handler)
+{
+	struct log_container *lc = to_log_container(handler);
+
+	ringbuffer_dequeue_iov(lc->rbc, 0, lc_drain_queue, lc);
+	ringbuffer_consumer_unregister(lc->rbc);
+	lc->rbc = NULL;
+
+	if (lc->lost) {
+		console_poller_unregister(lc->console, lc->poller);
+		lc_reelect(lc);
+	}
+}
+
+static int lc_resume(struct handler *handler)
+{
+	struct log_container *lc = to_log_container(handler);
+
+	lc->rbc = console_ringbuffer_consumer_register_push(
+		lc->console, handler, lc->transform, lc_ringbuffer_push, lc);
+
+	return lc->rbc ? 0 : -1;
+}
+
+static struct log_container log_container = {
+	.handler = {
+		.name		= "log-container",
+		.init		= lc_init,
+		.fini		= lc_fini,
+		.suspend	= lc_suspend,
+		.resume		= lc_resume,
+	},
+};
+
+console_handler_register(&log_container.handler);
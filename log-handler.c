@@ -16,11 +16,13 @@
 
 #include <endian.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
@@ -29,26 +31,218 @@
 
 #include "console-server.h"
 
+/*
+ * Boot index: when boot-marker patterns are configured, we record the log
+ * offset at which each boot starts, so that the output of a particular boot
+ * can be retrieved without scanning the logs.
+ *
+ * Offsets are into the stream of logged data, counting from server start.
+ * The current log file holds data from current_base, and the rotated log
+ * file from rotate_base up to current_base.
+ *
+ * The index is kept in memory, and mirrored to <logfile>.idx for external
+ * tools, as a struct log_index_header followed by the struct log_boot
+ * entries, all little-endian.
+ */
+#define LOG_INDEX_MAGIC	  0x58444c4fu /* "OLDX" */
+#define LOG_INDEX_VERSION 1
+
+struct log_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t rotate_base;
+	uint64_t current_base;
+};
+
+struct log_boot {
+	uint64_t offset;
+	/* CLOCK_REALTIME seconds at which we saw the marker */
+	uint64_t time;
+};
+
+/* A marker pattern, matched incrementally with Knuth-Morris-Pratt */
+struct log_marker {
+	char *pattern;
+	size_t len;
+	size_t *fail;
+	size_t state;
+};
+
+#define LOG_INTF     "xyz.openbmc_project.Console.Log"
+#define LOG_DBUS_ERR "org.openbmc.error"
+
 struct log_handler {
 	struct handler handler;
 	struct console *console;
 	struct ringbuffer_consumer *rbc;
+	struct poller *poller;
 	int fd;
 	size_t size;
 	size_t maxsize;
 	size_t pagesize;
 	char *log_filename;
 	char *rotate_filename;
+	char *transform;
+
+	/* boot index */
+	struct log_marker *markers;
+	int n_markers;
+	struct log_boot *boots;
+	size_t n_boots;
+	uint64_t offset;
+	uint64_t rotate_base;
+	uint64_t current_base;
+	char *index_filename;
+	int index_fd;
 };
 
 static const char *default_filename = LOCALSTATEDIR "/log/obmc-console.log";
 static const size_t default_logsize = 16ul * 1024ul;
 
+/*
+ * While the console is idle, we batch log writes up to this size, and for at
+ * most the flush interval.
+ */
+static const size_t log_idle_batch_size = 16ul * 1024ul;
+static const struct timeval log_idle_flush_interval = { 10, 0 };
+
 static struct log_handler *to_log_handler(struct handler *handler)
 {
 	return container_of(handler, struct log_handler, handler);
 }
 
+static int log_index_write_header(struct log_handler *lh)
+{
+	struct log_index_header hdr;
+	ssize_t rc;
+
+	hdr.magic = htole32(LOG_INDEX_MAGIC);
+	hdr.version = htole32(LOG_INDEX_VERSION);
+	hdr.rotate_base = htole64(lh->rotate_base);
+	hdr.current_base = htole64(lh->current_base);
+
+	rc = pwrite(lh->index_fd, &hdr, sizeof(hdr), 0);
+	return rc == sizeof(hdr) ? 0 : -1;
+}
+
+static int log_index_write_boot(struct log_handler *lh, size_t idx)
+{
+	struct log_boot boot;
+	off_t pos;
+	ssize_t rc;
+
+	boot.offset = htole64(lh->boots[idx].offset);
+	boot.time = htole64(lh->boots[idx].time);
+	pos = sizeof(struct log_index_header) + idx * sizeof(boot);
+
+	rc = pwrite(lh->index_fd, &boot, sizeof(boot), pos);
+	return rc == sizeof(boot) ? 0 : -1;
+}
+
+/* Rewrite the whole index file, after we've dropped old entries */
+static void log_index_sync(struct log_handler *lh)
+{
+	size_t i;
+	int rc;
+
+	if (lh->index_fd < 0) {
+		return;
+	}
+
+	rc = ftruncate(lh->index_fd, sizeof(struct log_index_header));
+	if (!rc) {
+		rc = log_index_write_header(lh);
+	}
+
+	for (i = 0; !rc && i < lh->n_boots; i++) {
+		rc = log_index_write_boot(lh, i);
+	}
+
+	if (rc) {
+		warn("Failed to write boot index %s", lh->index_filename);
+	}
+}
+
+static void log_index_add_boot(struct log_handler *lh, uint64_t offset)
+{
+	struct log_boot *boots;
+	struct timespec ts;
+
+	boots = reallocarray(lh->boots, lh->n_boots + 1, sizeof(*lh->boots));
+	if (!boots) {
+		warnx("Out of memory for boot index");
+		return;
+	}
+	lh->boots = boots;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	lh->boots[lh->n_boots].offset = offset;
+	lh->boots[lh->n_boots].time = ts.tv_sec;
+	lh->n_boots++;
+
+	if (lh->index_fd >= 0 && log_index_write_boot(lh, lh->n_boots - 1)) {
+		warn("Failed to write boot index %s", lh->index_filename);
+	}
+}
+
+/*
+ * The log has rotated: drop any boots that started before the (new) rotate
+ * file, except for the one that continues into it, which we clamp to the
+ * start of the rotate file.
+ */
+static void log_index_rotate(struct log_handler *lh)
+{
+	size_t first = 0;
+
+	lh->rotate_base = lh->current_base;
+	lh->current_base = lh->offset;
+
+	while (first + 1 < lh->n_boots &&
+	       lh->boots[first + 1].offset <= lh->rotate_base) {
+		first++;
+	}
+
+	if (first < lh->n_boots && lh->boots[first].offset < lh->rotate_base) {
+		lh->boots[first].offset = lh->rotate_base;
+	}
+
+	lh->n_boots -= first;
+	memmove(lh->boots, lh->boots + first,
+		lh->n_boots * sizeof(*lh->boots));
+
+	log_index_sync(lh);
+}
+
+/* Look for boot markers in data that is about to be logged */
+static void log_index_scan(struct log_handler *lh, const uint8_t *buf,
+			   size_t len)
+{
+	struct log_marker *marker;
+	size_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < lh->n_markers; j++) {
+			marker = &lh->markers[j];
+
+			while (marker->state &&
+			       marker->pattern[marker->state] != (char)buf[i]) {
+				marker->state = marker->fail[marker->state - 1];
+			}
+
+			if (marker->pattern[marker->state] == (char)buf[i]) {
+				marker->state++;
+			}
+
+			if (marker->state == marker->len) {
+				log_index_add_boot(lh, lh->offset + i + 1 -
+							       marker->len);
+				marker->state = marker->fail[marker->state - 1];
+			}
+		}
+	}
+}
+
 static int log_trim(struct log_handler *lh)
 {
 	int rc;
@@ -70,11 +264,16 @@ static int log_trim(struct log_handler *lh)
 
 	lh->size = 0;
 
+	if (lh->n_markers) {
+		log_index_rotate(lh);
+	}
+
 	return 0;
 }
 
 static int log_data(struct log_handler *lh, uint8_t *buf, size_t len)
 {
+	uint64_t start;
 	int rc;
 
 	if (len > lh->maxsize) {
@@ -89,41 +288,321 @@ static int log_data(struct log_handler *lh, uint8_t *buf, size_t len)
 		}
 	}
 
+	log_index_scan(lh, buf, len);
+
+	start = trace_start(lh->handler.trace);
 	rc = write_buf_to_fd(lh->fd, buf, len);
+	trace_end(lh->handler.trace, TRACE_LOG_WRITE, lh->handler.name, start);
 	if (rc) {
 		return rc;
 	}
 
 	lh->size += len;
+	lh->offset += len;
 
 	return 0;
 }
 
-static enum ringbuffer_poll_ret log_ringbuffer_poll(void *arg, size_t force_len
-						    __attribute__((unused)))
+static ssize_t log_drain_queue(void *arg, const struct iovec *iov, int iovcnt,
+			       size_t force_len __attribute__((unused)))
 {
 	struct log_handler *lh = arg;
-	uint8_t *buf;
-	size_t len;
+	size_t total = 0;
 	int rc;
+	int i;
 
-	/* we log synchronously, so just dequeue everything we can, and
-	 * commit straight away. */
-	for (;;) {
-		len = ringbuffer_dequeue_peek(lh->rbc, 0, &buf);
-		if (!len) {
-			break;
+	/* we log synchronously, so just take everything we're offered */
+	for (i = 0; i < iovcnt; i++) {
+		rc = log_data(lh, iov[i].iov_base, iov[i].iov_len);
+		if (rc) {
+			return -1;
 		}
+		total += iov[i].iov_len;
+	}
 
-		rc = log_data(lh, buf, len);
-		if (rc) {
-			return RINGBUFFER_POLL_REMOVE;
+	return (ssize_t)total;
+}
+
+static ssize_t log_ringbuffer_push(void *arg, const struct iovec *iov,
+				   int iovcnt, size_t force_len)
+{
+	struct log_handler *lh = arg;
+	ssize_t rc;
+
+	if (!force_len && console_idle(lh->console) &&
+	    ringbuffer_len(lh->rbc) < log_idle_batch_size) {
+		/* leave the data in the ringbuffer until the batch fills, or
+		 * the flush interval passes, whichever is first */
+		if (!timerisset(&lh->poller->timeout)) {
+			console_poller_set_timeout(lh->console, lh->poller,
+						   &log_idle_flush_interval);
 		}
+		return 0;
+	}
 
-		ringbuffer_dequeue_commit(lh->rbc, len);
+	rc = log_drain_queue(lh, iov, iovcnt, force_len);
+	if (rc < 0) {
+		/* the ringbuffer frees the consumer, so nothing is left to
+		 * flush */
+		lh->rbc = NULL;
+		timerclear(&lh->poller->timeout);
 	}
 
-	return RINGBUFFER_POLL_OK;
+	return rc;
+}
+
+static void log_flush(struct log_handler *lh)
+{
+	/* suspended */
+	if (!lh->rbc) {
+		return;
+	}
+
+	if (ringbuffer_dequeue_iov(lh->rbc, 0, log_drain_queue, lh) < 0) {
+		warnx("Failed to flush the log");
+	}
+}
+
+static enum poller_ret
+log_timeout(struct handler *handler __attribute__((unused)), void *data)
+{
+	log_flush(data);
+
+	return POLLER_OK;
+}
+
+/* Copy a range of a log file into fd */
+static int log_copy_range(int fd, int src, off_t start, off_t end)
+{
+	uint8_t buf[4096];
+	size_t want;
+	ssize_t len;
+
+	while (start < end) {
+		want = end - start < (off_t)sizeof(buf) ? (size_t)(end - start) :
+							  sizeof(buf);
+		len = pread(src, buf, want, start);
+		if (len <= 0) {
+			return -1;
+		}
+
+		if (write_buf_to_fd(fd, buf, len)) {
+			return -1;
+		}
+
+		start += len;
+	}
+
+	return 0;
+}
+
+/*
+ * Return a memfd holding the logged output of the nth most recent boot (0
+ * being the current boot); or a negative errno.
+ */
+static int log_handler_boot_log(struct handler *handler, unsigned int n)
+{
+	struct log_handler *lh = to_log_handler(handler);
+	uint64_t start;
+	uint64_t end;
+	size_t idx;
+	int src;
+	int fd;
+
+	/* the boot may still be batched in the ringbuffer */
+	log_flush(lh);
+
+	if (n >= lh->n_boots) {
+		return -ENOENT;
+	}
+
+	idx = lh->n_boots - 1 - n;
+	start = lh->boots[idx].offset;
+	end = idx + 1 < lh->n_boots ? lh->boots[idx + 1].offset : lh->offset;
+
+	fd = memfd_create("obmc-console-boot", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	if (start < lh->current_base) {
+		src = open(lh->rotate_filename, O_RDONLY | O_CLOEXEC);
+		if (src < 0) {
+			goto err_close;
+		}
+
+		if (log_copy_range(fd, src, start - lh->rotate_base,
+				   (end < lh->current_base ? end :
+							     lh->current_base) -
+					   lh->rotate_base)) {
+			close(src);
+			goto err_close;
+		}
+		close(src);
+		start = lh->current_base;
+	}
+
+	if (start < end && log_copy_range(fd, lh->fd, start - lh->current_base,
+					  end - lh->current_base)) {
+		goto err_close;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+
+	return fd;
+
+err_close:
+	close(fd);
+	return -EIO;
+}
+
+static int method_get_boot_log(sd_bus_message *msg, void *userdata,
+			       sd_bus_error *err)
+{
+	struct log_handler *lh = userdata;
+	uint32_t n;
+	int fd;
+	int r;
+
+	r = sd_bus_message_read(msg, "u", &n);
+	if (r < 0) {
+		return r;
+	}
+
+	fd = log_handler_boot_log(&lh->handler, n);
+	if (fd < 0) {
+		sd_bus_error_set_const(err, LOG_DBUS_ERR,
+				       fd == -ENOENT ? "No such boot" :
+						       "Boot log unavailable");
+		return sd_bus_reply_method_error(msg, err);
+	}
+
+	r = sd_bus_reply_method_return(msg, "h", fd);
+	close(fd);
+
+	return r;
+}
+
+/*
+ * GetBootLog returns a file descriptor for the logged output of a boot: 0
+ * is the current boot, 1 the one before, and so on.
+ */
+static const sd_bus_vtable log_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("GetBootLog", "u", "h", method_get_boot_log,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END,
+};
+
+static int log_dbus_init(struct handler *handler, sd_bus *bus,
+			 const char *obj_path)
+{
+	struct log_handler *lh = to_log_handler(handler);
+
+	if (!lh->n_markers) {
+		return 0;
+	}
+
+	return sd_bus_add_object_vtable(bus, NULL, obj_path, LOG_INTF,
+					log_vtable, lh);
+}
+
+/* Parse the '|'-separated list of boot marker patterns */
+static int log_markers_init(struct log_handler *lh, const char *patterns)
+{
+	struct log_marker *marker;
+	char *str;
+	char *tok;
+	char *p;
+	size_t i;
+	size_t k;
+
+	str = strdup(patterns);
+	if (!str) {
+		return -1;
+	}
+
+	for (tok = strtok_r(str, "|", &p); tok; tok = strtok_r(NULL, "|", &p)) {
+		marker = reallocarray(lh->markers, lh->n_markers + 1,
+				      sizeof(*lh->markers));
+		if (!marker) {
+			goto err;
+		}
+		lh->markers = marker;
+		marker = &lh->markers[lh->n_markers];
+
+		marker->len = strlen(tok);
+		marker->state = 0;
+		marker->pattern = strdup(tok);
+		marker->fail = calloc(marker->len, sizeof(*marker->fail));
+		if (!marker->pattern || !marker->fail) {
+			free(marker->pattern);
+			free(marker->fail);
+			goto err;
+		}
+		lh->n_markers++;
+
+		/* fail[i]: length of the longest proper border of pattern[0..i] */
+		for (i = 1, k = 0; i < marker->len; i++) {
+			while (k && tok[i] != tok[k]) {
+				k = marker->fail[k - 1];
+			}
+			if (tok[i] == tok[k]) {
+				k++;
+			}
+			marker->fail[i] = k;
+		}
+	}
+
+	free(str);
+	return 0;
+
+err:
+	free(str);
+	return -1;
+}
+
+static void log_markers_fini(struct log_handler *lh)
+{
+	int i;
+
+	for (i = 0; i < lh->n_markers; i++) {
+		free(lh->markers[i].pattern);
+		free(lh->markers[i].fail);
+	}
+	free(lh->markers);
+	lh->markers = NULL;
+	lh->n_markers = 0;
+}
+
+static int log_index_init(struct log_handler *lh, const char *patterns)
+{
+	int rc;
+
+	if (log_markers_init(lh, patterns)) {
+		warnx("Failed to parse boot-marker");
+		return -1;
+	}
+
+	rc = asprintf(&lh->index_filename, "%s.idx", lh->log_filename);
+	if (rc < 0) {
+		lh->index_filename = NULL;
+		return -1;
+	}
+
+	lh->index_fd = open(lh->index_filename,
+			    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (lh->index_fd < 0) {
+		/* we can still serve the index from memory */
+		warn("Can't open boot index file %s", lh->index_filename);
+		return 0;
+	}
+
+	if (log_index_write_header(lh)) {
+		warn("Failed to write boot index %s", lh->index_filename);
+	}
+
+	return 0;
 }
 
 static int log_init(struct handler *handler, struct console *console,
@@ -132,14 +611,24 @@ static int log_init(struct handler *handler, struct console *console,
 	struct log_handler *lh = to_log_handler(handler);
 	const char *filename;
 	const char *logsize_str;
+	const char *markers;
+	const char *val;
 	size_t logsize = default_logsize;
 	int rc;
 
+	/* the console logs to the shared container instead */
+	if (config_get_value(config, "log-container")) {
+		return -1;
+	}
+
 	lh->console = console;
 	lh->pagesize = 4096;
 	lh->size = 0;
 	lh->log_filename = NULL;
 	lh->rotate_filename = NULL;
+	lh->index_filename = NULL;
+	lh->transform = NULL;
+	lh->index_fd = -1;
 
 	logsize_str = config_get_value(config, "logsize");
 	rc = config_parse_bytesize(logsize_str, &logsize);
@@ -169,8 +658,34 @@ static int log_init(struct handler *handler, struct console *console,
 		return -1;
 	}
 
-	lh->rbc = console_ringbuffer_consumer_register(console,
-						       log_ringbuffer_poll, lh);
+	markers = config_get_value(config, "boot-marker");
+	if (markers && log_index_init(lh, markers)) {
+		close(lh->fd);
+		return -1;
+	}
+
+	val = config_get_value(config, "log-transform");
+	if (val) {
+		lh->transform = strdup(val);
+	}
+
+	lh->rbc = console_ringbuffer_consumer_register_push(
+		console, handler, lh->transform, log_ringbuffer_push, lh);
+	if (!lh->rbc) {
+		warnx("Invalid log-transform");
+		free(lh->transform);
+		close(lh->fd);
+		return -1;
+	}
+
+	lh->poller = console_poller_register(console, handler, NULL,
+					     log_timeout, -1, 0, lh);
+	if (!lh->poller) {
+		ringbuffer_consumer_unregister(lh->rbc);
+		free(lh->transform);
+		close(lh->fd);
+		return -1;
+	}
 
 	return 0;
 }
@@ -178,10 +693,60 @@ static int log_init(struct handler *handler, struct console *console,
 static void log_fini(struct handler *handler)
 {
 	struct log_handler *lh = to_log_handler(handler);
-	ringbuffer_consumer_unregister(lh->rbc);
+	log_flush(lh);
+	console_poller_unregister(lh->console, lh->poller);
+	if (lh->rbc) {
+		ringbuffer_consumer_unregister(lh->rbc);
+	}
 	close(lh->fd);
+	if (lh->index_fd >= 0) {
+		close(lh->index_fd);
+	}
+	log_markers_fini(lh);
+	free(lh->boots);
+	free(lh->index_filename);
 	free(lh->log_filename);
 	free(lh->rotate_filename);
+	free(lh->transform);
+}
+
+/*
+ * Write out what we've batched, and stop consuming. Output while we're
+ * suspended isn't logged, and doesn't count towards the boot index.
+ */
+static void log_suspend(struct handler *handler)
+{
+	struct log_handler *lh = to_log_handler(handler);
+
+	/* a failed write may already have cost us the consumer */
+	if (!lh->rbc) {
+		return;
+	}
+
+	log_flush(lh);
+	ringbuffer_consumer_unregister(lh->rbc);
+	lh->rbc = NULL;
+}
+
+static int log_resume(struct handler *handler)
+{
+	struct log_handler *lh = to_log_handler(handler);
+	int i;
+
+	if (lh->rbc) {
+		return 0;
+	}
+
+	/* nothing is batched, and a marker can't span the gap */
+	timerclear(&lh->poller->timeout);
+	for (i = 0; i < lh->n_markers; i++) {
+		lh->markers[i].state = 0;
+	}
+
+	lh->rbc = console_ringbuffer_consumer_register_push(
+		lh->console, handler, lh->transform, log_ringbuffer_push, lh);
+
+	return lh->rbc ? 0 : -1;
 }
 
 static struct log_handler log_handler = {
@@ -189,6 +754,9 @@ static struct log_handler log_handler = {
 		.name		= "log",
 		.init		= log_init,
 		.fini		= log_fini,
+		.dbus_init	= log_dbus_init,
+		.suspend	= log_suspend,
+		.resume		= log_resume,
 	},
 };
 
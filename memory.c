@@ -0,0 +1,229 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "console-server.h"
+
+/*
+ * Memory accounting.
+ *
+ * We account for the larger allocations made on behalf of the console and
+ * its clients: ringbuffers, per-client state and the kernel's socket
+ * buffers for those clients. Allocations are charged against an optional
+ * per-console limit (memory-limit), and an optional limit across all of the
+ * console servers on the system (global-memory-limit).
+ *
+ * Each console server runs as a separate process, so for the global limit
+ * each server publishes its usage in a slot of a shared memory segment,
+ * and sums the slots when charging. The check and the update are not one
+ * atomic operation, so concurrent charges in two servers may together
+ * exceed the global limit by at most one allocation each.
+ */
+
+#ifndef MEM_SHM_NAME
+#define MEM_SHM_NAME "/obmc-console-memory"
+#endif
+#define MEM_MAX_SLOTS 64
+
+/* size_t rather than uint64_t, so 32-bit BMCs don't need libatomic */
+struct mem_slot {
+	pid_t pid;
+	size_t used;
+};
+
+struct mem_shared {
+	struct mem_slot slots[MEM_MAX_SLOTS];
+};
+
+static bool mem_slot_is_stale(pid_t pid)
+{
+	return pid && kill(pid, 0) && errno == ESRCH;
+}
+
+static struct mem_slot *mem_slot_claim(struct mem_shared *shared)
+{
+	struct mem_slot *slot;
+	pid_t self = getpid();
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < MEM_MAX_SLOTS; i++) {
+		slot = &shared->slots[i];
+		pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+
+		if (pid && !mem_slot_is_stale(pid)) {
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&slot->pid, &pid, self, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+static int mem_shared_init(struct console_mem *mem)
+{
+	struct mem_shared *shared;
+	struct stat statbuf;
+	int fd;
+
+	fd = shm_open(MEM_SHM_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		warn("Can't open shared memory accounting");
+		return -1;
+	}
+
+	/* ftruncate() zero-fills, so the first server in sees empty slots */
+	if (fstat(fd, &statbuf) ||
+	    ((size_t)statbuf.st_size < sizeof(*shared) &&
+	     ftruncate(fd, sizeof(*shared)))) {
+		warn("Can't size shared memory accounting");
+		close(fd);
+		return -1;
+	}
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		warn("Can't map shared memory accounting");
+		return -1;
+	}
+
+	mem->slot = mem_slot_claim(shared);
+	if (!mem->slot) {
+		warnx("No free shared memory accounting slots");
+		munmap(shared, sizeof(*shared));
+		return -1;
+	}
+
+	mem->shared = shared;
+
+	return 0;
+}
+
+int console_mem_init(struct console *console, struct config *config)
+{
+	struct console_mem *mem = &console->mem;
+	const char *val;
+
+	val = config_get_value(config, "memory-limit");
+	if (val && config_parse_bytesize(val, &mem->limit)) {
+		warnx("Invalid memory-limit: '%s'", val);
+		return -1;
+	}
+
+	val = config_get_value(config, "global-memory-limit");
+	if (val && config_parse_bytesize(val, &mem->global_limit)) {
+		warnx("Invalid global-memory-limit: '%s'", val);
+		return -1;
+	}
+
+	if (mem->global_limit && mem_shared_init(mem)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void console_mem_fini(struct console *console)
+{
+	struct console_mem *mem = &console->mem;
+
+	if (!mem->shared) {
+		return;
+	}
+
+	__atomic_store_n(&mem->slot->used, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->slot->pid, 0, __ATOMIC_RELEASE);
+	munmap(mem->shared, sizeof(*mem->shared));
+	mem->shared = NULL;
+	mem->slot = NULL;
+}
+
+size_t console_mem_global_used(struct console *console)
+{
+	struct console_mem *mem = &console->mem;
+	struct mem_slot *slot;
+	size_t used = 0;
+	pid_t pid;
+	int i;
+
+	if (!mem->shared) {
+		return mem->used;
+	}
+
+	for (i = 0; i < MEM_MAX_SLOTS; i++) {
+		slot = &mem->shared->slots[i];
+		pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+		if (!pid || mem_slot_is_stale(pid)) {
+			continue;
+		}
+		used += __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+	}
+
+	return used;
+}
+
+int console_mem_charge(struct console *console, size_t size)
+{
+	struct console_mem *mem = &console->mem;
+
+	if (mem->limit && mem->used + size > mem->limit) {
+		return -ENOMEM;
+	}
+
+	if (mem->global_limit &&
+	    console_mem_global_used(console) + size > mem->global_limit) {
+		return -ENOMEM;
+	}
+
+	mem->used += size;
+	if (mem->slot) {
+		__atomic_store_n(&mem->slot->used, mem->used, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console, size_t size)
+{
+	struct console_mem *mem = &console->mem;
+
+	assert(size <= mem->used);
+	mem->used -= size;
+	if (mem->slot) {
+		__atomic_store_n(&mem->slot->used, mem->used, __ATOMIC_RELEASE);
+	}
+}
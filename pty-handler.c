@@ -0,0 +1,384 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include "console-server.h"
+
+/*
+ * Expose the console as a local PTY, for tools that need a tty (expect,
+ * minicom, screen), without a socat and obmc-console-client in between.
+ *
+ * We hold the PTY master, and symlink the slave at a stable path. We don't
+ * hold the slave open ourselves: once the last user closes it, the master
+ * reports POLLHUP, and we stop polling it and consuming console output
+ * until inotify tells us the slave has been opened again. So while nobody
+ * is attached, the PTY costs us nothing.
+ */
+
+static const char *default_link_fmt = LOCALSTATEDIR "/run/obmc-console-pty.%s";
+
+struct pty_handler {
+	struct handler handler;
+	struct console *console;
+	struct ringbuffer_consumer *rbc;
+	struct poller *poller;
+	struct poller *inotify_poller;
+	int fd;
+	int inotify_fd;
+	char *slave_path;
+	char *link_path;
+	bool blocked;
+};
+
+static struct pty_handler *to_pty_handler(struct handler *handler)
+{
+	return container_of(handler, struct pty_handler, handler);
+}
+
+static void pty_set_blocked(struct pty_handler *ph, bool blocked)
+{
+	int events;
+
+	if (blocked == ph->blocked) {
+		return;
+	}
+
+	ph->blocked = blocked;
+	events = POLLIN;
+
+	if (ph->blocked) {
+		events |= POLLOUT;
+	}
+
+	console_poller_set_events(ph->console, ph->poller, events);
+}
+
+/*
+ * Write pending data to the PTY, returning the number of bytes consumed.
+ *
+ * Unlike the local tty, whoever is reading the slave may stop at any time
+ * (a suspended screen session, say), so we never block the server on them.
+ * If the ringbuffer forces data out while they're stalled, we drop it.
+ */
+static ssize_t pty_drain_queue(void *arg, const struct iovec *iov, int iovcnt,
+			       size_t force_len)
+{
+	struct pty_handler *ph = arg;
+	ssize_t wlen;
+
+	if (ph->blocked) {
+		return (ssize_t)force_len;
+	}
+
+	for (;;) {
+		wlen = writev(ph->fd, iov, iovcnt);
+		if (wlen >= 0) {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			pty_set_blocked(ph, true);
+			return (ssize_t)force_len;
+		}
+		/* the slave was closed under us, we'll see the POLLHUP */
+		if (errno == EIO) {
+			return (ssize_t)ringbuffer_iov_len(iov, iovcnt);
+		}
+		warn("Failed writing to pty %s", ph->slave_path);
+		return -1;
+	}
+
+	if ((size_t)wlen < force_len) {
+		pty_set_blocked(ph, true);
+		return (ssize_t)force_len;
+	}
+
+	return wlen;
+}
+
+static void pty_detach(struct pty_handler *ph)
+{
+	if (ph->rbc) {
+		ringbuffer_consumer_unregister(ph->rbc);
+		ph->rbc = NULL;
+	}
+	ph->poller = NULL;
+	ph->blocked = false;
+	console_interactive_put(ph->console);
+}
+
+static ssize_t pty_ringbuffer_push(void *arg, const struct iovec *iov,
+				   int iovcnt, size_t force_len)
+{
+	struct pty_handler *ph = arg;
+	ssize_t rc;
+
+	rc = pty_drain_queue(ph, iov, iovcnt, force_len);
+	if (rc < 0) {
+		/* the ringbuffer unregisters the consumer for us */
+		console_poller_unregister(ph->console, ph->poller);
+		ph->rbc = NULL;
+		pty_detach(ph);
+	}
+
+	return rc;
+}
+
+static enum poller_ret pty_poll(struct handler *handler, int events,
+				void __attribute__((unused)) * data)
+{
+	struct pty_handler *ph = to_pty_handler(handler);
+	uint8_t buf[4096];
+	ssize_t len;
+
+	if (events & POLLIN) {
+		len = read(ph->fd, buf, sizeof(buf));
+		if (len > 0) {
+			console_data_out(ph->console, buf, len);
+		}
+	}
+
+	/* the last user of the slave has closed it */
+	if (events & POLLHUP) {
+		pty_detach(ph);
+		return POLLER_REMOVE;
+	}
+
+	if (events & POLLOUT) {
+		pty_set_blocked(ph, false);
+		if (ringbuffer_dequeue_iov(ph->rbc, 0, pty_drain_queue, ph) <
+		    0) {
+			pty_detach(ph);
+			return POLLER_REMOVE;
+		}
+	}
+
+	return POLLER_OK;
+}
+
+static void pty_attach(struct pty_handler *ph)
+{
+	ph->poller = console_poller_register(ph->console, &ph->handler,
+					     pty_poll, NULL, ph->fd, POLLIN,
+					     NULL);
+	if (!ph->poller) {
+		return;
+	}
+
+	/* the new user sees output from now on, like a socket client */
+	ph->rbc = console_ringbuffer_consumer_register_push(
+		ph->console, &ph->handler, NULL, pty_ringbuffer_push, ph);
+	if (!ph->rbc) {
+		console_poller_unregister(ph->console, ph->poller);
+		ph->poller = NULL;
+		return;
+	}
+
+	console_interactive_get(ph->console);
+}
+
+static enum poller_ret pty_inotify_poll(struct handler *handler, int events,
+					void __attribute__((unused)) * data)
+{
+	struct pty_handler *ph = to_pty_handler(handler);
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	bool opened = false;
+	ssize_t len;
+
+	if (!(events & POLLIN)) {
+		return POLLER_OK;
+	}
+
+	/* we only watch for IN_OPEN, so any event is an open */
+	for (;;) {
+		len = read(ph->inotify_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+		opened = true;
+	}
+
+	if (opened && !ph->poller) {
+		pty_attach(ph);
+	}
+
+	return POLLER_OK;
+}
+
+static int pty_open_master(struct pty_handler *ph)
+{
+	struct termios termios;
+	char path[PATH_MAX];
+
+	ph->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (ph->fd < 0) {
+		warn("Can't open a pty");
+		return -1;
+	}
+
+	if (grantpt(ph->fd) || unlockpt(ph->fd) ||
+	    ptsname_r(ph->fd, path, sizeof(path))) {
+		warn("Can't set up pty");
+		goto err_close;
+	}
+
+	/* termios set through the master applies to the slave */
+	if (!tcgetattr(ph->fd, &termios)) {
+		cfmakeraw(&termios);
+		if (tcsetattr(ph->fd, TCSANOW, &termios)) {
+			warn("Can't set terminal options for %s", path);
+		}
+	}
+
+	ph->slave_path = strdup(path);
+	if (!ph->slave_path) {
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(ph->fd);
+	return -1;
+}
+
+static int pty_init(struct handler *handler, struct console *console,
+		    struct config *config)
+{
+	struct pty_handler *ph = to_pty_handler(handler);
+	const char *val;
+	bool enabled;
+	int rc;
+
+	val = config_get_value(config, "local-pty");
+	if (!val) {
+		return -1;
+	}
+
+	if (config_parse_bool(&enabled, val)) {
+		warnx("Invalid local-pty value: '%s'", val);
+		return -1;
+	}
+
+	if (!enabled) {
+		return -1;
+	}
+
+	ph->console = console;
+	ph->rbc = NULL;
+	ph->poller = NULL;
+	ph->blocked = false;
+
+	val = config_get_value(config, "local-pty-link");
+	if (val) {
+		ph->link_path = strdup(val);
+		rc = ph->link_path ? 0 : -1;
+	} else {
+		rc = asprintf(&ph->link_path, default_link_fmt,
+			      console->console_id);
+	}
+	if (rc < 0) {
+		return -1;
+	}
+
+	if (pty_open_master(ph)) {
+		goto err_free_link;
+	}
+
+	ph->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ph->inotify_fd < 0) {
+		warn("Can't initialise inotify");
+		goto err_close_master;
+	}
+
+	if (inotify_add_watch(ph->inotify_fd, ph->slave_path, IN_OPEN) < 0) {
+		warn("Can't watch %s", ph->slave_path);
+		goto err_close_inotify;
+	}
+
+	if ((unlink(ph->link_path) && errno != ENOENT) ||
+	    symlink(ph->slave_path, ph->link_path)) {
+		warn("Can't link %s to %s", ph->link_path, ph->slave_path);
+		goto err_close_inotify;
+	}
+
+	ph->inotify_poller = console_poller_register(console, handler,
+						     pty_inotify_poll, NULL,
+						     ph->inotify_fd, POLLIN,
+						     NULL);
+	if (!ph->inotify_poller) {
+		goto err_unlink;
+	}
+
+	printf("Console available at %s (%s)\n", ph->link_path,
+	       ph->slave_path);
+
+	return 0;
+
+err_unlink:
+	unlink(ph->link_path);
+err_close_inotify:
+	close(ph->inotify_fd);
+err_close_master:
+	close(ph->fd);
+	free(ph->slave_path);
+err_free_link:
+	free(ph->link_path);
+	return -1;
+}
+
+static void pty_fini(struct handler *handler)
+{
+	struct pty_handler *ph = to_pty_handler(handler);
+
+	if (ph->poller) {
+		console_poller_unregister(ph->console, ph->poller);
+		pty_detach(ph);
+	}
+
+	console_poller_unregister(ph->console, ph->inotify_poller);
+	unlink(ph->link_path);
+	close(ph->inotify_fd);
+	close(ph->fd);
+	free(ph->slave_path);
+	free(ph->link_path);
+}
+
+static struct pty_handler pty_handler = {
+	.handler = {
+		.name		= "pty",
+		.init		= pty_init,
+		.fini		= pty_fini,
+	},
+};
+
+console_handler_register(&pty_handler.handler);
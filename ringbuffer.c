@@ -18,9 +18,25 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "console-server.h"
 
+/* Data spilled to disk on behalf of a lagging consumer. The file holds the
+ * oldest pending data for the consumer, ahead of anything still in the
+ * ringbuffer; bytes [pos, len) of the file are yet to be consumed. */
+struct ringbuffer_spill {
+	int fd;
+	size_t max_size;
+	size_t len;
+	size_t pos;
+
+	/* window of the file most recently read for ringbuffer_dequeue_peek() */
+	size_t cache_pos;
+	size_t cache_len;
+	uint8_t cache[4096];
+};
+
 static inline size_t min(size_t a, size_t b)
 {
 	return a < b ? a : b;
@@ -60,8 +76,13 @@ ringbuffer_consumer_register(struct ringbuffer *rb, ringbuffer_poll_fn_t fn,
 	rbc = malloc(sizeof(*rbc));
 	rbc->rb = rb;
 	rbc->poll_fn = fn;
+	rbc->push_fn = NULL;
 	rbc->poll_data = data;
 	rbc->pos = rb->tail;
+	rbc->spill = NULL;
+	rbc->stats = NULL;
+	rbc->trace = NULL;
+	rbc->trace_name = NULL;
 
 	n = rb->n_consumers++;
 	/*
@@ -77,6 +98,20 @@ ringbuffer_consumer_register(struct ringbuffer *rb, ringbuffer_poll_fn_t fn,
 	return rbc;
 }
 
+struct ringbuffer_consumer *
+ringbuffer_consumer_register_push(struct ringbuffer *rb,
+				  ringbuffer_push_fn_t push_fn, void *data)
+{
+	struct ringbuffer_consumer *rbc;
+
+	rbc = ringbuffer_consumer_register(rb, NULL, data);
+	if (rbc) {
+		rbc->push_fn = push_fn;
+	}
+
+	return rbc;
+}
+
 void ringbuffer_consumer_unregister(struct ringbuffer_consumer *rbc)
 {
 	struct ringbuffer *rb = rbc->rb;
@@ -104,10 +139,47 @@ void ringbuffer_consumer_unregister(struct ringbuffer_consumer *rbc)
 				     sizeof(*rb->consumers));
 	/* NOLINTEND(bugprone-sizeof-expression) */
 
+	if (rbc->spill) {
+		close(rbc->spill->fd);
+		free(rbc->spill);
+	}
+
 	free(rbc);
 }
 
-size_t ringbuffer_len(struct ringbuffer_consumer *rbc)
+int ringbuffer_consumer_enable_spill(struct ringbuffer_consumer *rbc, int fd,
+				     size_t max_size)
+{
+	struct ringbuffer_spill *spill;
+
+	if (rbc->spill) {
+		return -1;
+	}
+
+	spill = malloc(sizeof(*spill));
+	if (!spill) {
+		return -1;
+	}
+
+	spill->fd = fd;
+	spill->max_size = max_size;
+	spill->len = 0;
+	spill->pos = 0;
+	spill->cache_pos = 0;
+	spill->cache_len = 0;
+
+	rbc->spill = spill;
+
+	return 0;
+}
+
+static size_t ringbuffer_spill_len(struct ringbuffer_consumer *rbc)
+{
+	return rbc->spill ? rbc->spill->len - rbc->spill->pos : 0;
+}
+
+/* length of the consumer's pending data that is still in the ringbuffer */
+static size_t ringbuffer_ring_len(struct ringbuffer_consumer *rbc)
 {
 	if (rbc->pos <= rbc->rb->tail) {
 		return rbc->rb->tail - rbc->pos;
@@ -115,9 +187,150 @@ size_t ringbuffer_len(struct ringbuffer_consumer *rbc)
 	return rbc->rb->tail + rbc->rb->size - rbc->pos;
 }
 
+size_t ringbuffer_len(struct ringbuffer_consumer *rbc)
+{
+	return ringbuffer_spill_len(rbc) + ringbuffer_ring_len(rbc);
+}
+
 static size_t ringbuffer_space(struct ringbuffer_consumer *rbc)
 {
-	return rbc->rb->size - ringbuffer_len(rbc) - 1;
+	return rbc->rb->size - ringbuffer_ring_len(rbc) - 1;
+}
+
+static int ringbuffer_spill_write(struct ringbuffer_spill *spill,
+				  const uint8_t *buf, size_t len)
+{
+	ssize_t rc;
+	size_t pos;
+
+	for (pos = 0; pos < len; pos += rc) {
+		rc = pwrite(spill->fd, buf + pos, len - pos,
+			    (off_t)(spill->len + pos));
+		if (rc <= 0) {
+			return -1;
+		}
+	}
+
+	spill->len += len;
+
+	return 0;
+}
+
+/* Move the oldest len bytes of the consumer's pending data out of the
+ * ringbuffer and onto the end of its spill file */
+static int ringbuffer_spill_out(struct ringbuffer_consumer *rbc, size_t len)
+{
+	struct ringbuffer_spill *spill = rbc->spill;
+	struct ringbuffer *rb = rbc->rb;
+	size_t spill_len;
+	size_t wlen;
+	int rc;
+
+	if (spill->len + len > spill->max_size) {
+		return -1;
+	}
+
+	spill_len = spill->len;
+	wlen = min(len, rb->size - rbc->pos);
+	rc = ringbuffer_spill_write(spill, rb->buf + rbc->pos, wlen);
+	if (!rc && len > wlen) {
+		rc = ringbuffer_spill_write(spill, rb->buf, len - wlen);
+	}
+
+	if (rc) {
+		/* all or nothing: the data stays in the ringbuffer, and the
+		 * file may hold a partial write beyond spill->len, which we'll
+		 * overwrite on the next attempt */
+		spill->len = spill_len;
+		return -1;
+	}
+
+	rbc->pos = (rbc->pos + len) % rb->size;
+
+	return 0;
+}
+
+static size_t ringbuffer_spill_peek(struct ringbuffer_consumer *rbc,
+				    size_t offset, uint8_t **data)
+{
+	struct ringbuffer_spill *spill = rbc->spill;
+	size_t pos = spill->pos + offset;
+	ssize_t rc;
+
+	if (pos < spill->cache_pos ||
+	    pos >= spill->cache_pos + spill->cache_len) {
+		rc = pread(spill->fd, spill->cache,
+			   min(sizeof(spill->cache), spill->len - pos),
+			   (off_t)pos);
+		if (rc <= 0) {
+			spill->cache_len = 0;
+			return 0;
+		}
+		spill->cache_pos = pos;
+		spill->cache_len = rc;
+	}
+
+	*data = spill->cache + (pos - spill->cache_pos);
+	return spill->cache_pos + spill->cache_len - pos;
+}
+
+static void ringbuffer_spill_commit(struct ringbuffer_spill *spill, size_t len)
+{
+	spill->pos += len;
+	if (spill->pos < spill->len) {
+		return;
+	}
+
+	/* Caught up; release the disk space and start again */
+	if (ftruncate(spill->fd, 0)) {
+		/* Not fatal, we just keep overwriting the existing blocks */
+	}
+	spill->pos = 0;
+	spill->len = 0;
+	spill->cache_pos = 0;
+	spill->cache_len = 0;
+}
+
+static enum ringbuffer_poll_ret
+ringbuffer_consumer_call(struct ringbuffer_consumer *rbc, size_t force_len)
+{
+	ssize_t rc;
+
+	if (!rbc->push_fn) {
+		return rbc->poll_fn(rbc->poll_data, force_len);
+	}
+
+	rc = ringbuffer_dequeue_iov(rbc, force_len, rbc->push_fn,
+				    rbc->poll_data);
+
+	return rc < 0 ? RINGBUFFER_POLL_REMOVE : RINGBUFFER_POLL_OK;
+}
+
+static enum ringbuffer_poll_ret
+ringbuffer_consumer_poll(struct ringbuffer_consumer *rbc, size_t force_len)
+{
+	struct handler_time_sample sample;
+	enum ringbuffer_poll_ret prc;
+	uint64_t start;
+
+	if (!rbc->stats && !rbc->trace) {
+		return ringbuffer_consumer_call(rbc, force_len);
+	}
+
+	start = trace_start(rbc->trace);
+	if (rbc->stats) {
+		handler_time_start(&sample);
+	}
+
+	prc = ringbuffer_consumer_call(rbc, force_len);
+
+	if (rbc->stats) {
+		handler_time_stop(rbc->stats, &sample);
+	}
+	trace_end(rbc->trace, force_len ? TRACE_FORCE : TRACE_RINGBUFFER,
+		  rbc->trace_name, start);
+
+	return prc;
 }
 
 static int ringbuffer_consumer_ensure_space(struct ringbuffer_consumer *rbc,
@@ -132,11 +345,30 @@ static int ringbuffer_consumer_ensure_space(struct ringbuffer_consumer *rbc,
 
 	force_len = len - ringbuffer_space(rbc);
 
-	prc = rbc->poll_fn(rbc->poll_data, force_len);
+	/* Spilling consumers don't hold up the queue while there's room in
+	 * the spill file, instead they catch up from disk */
+	if (rbc->spill) {
+		if (!ringbuffer_spill_out(rbc, force_len)) {
+			return 0;
+		}
+
+		/* The spill file is full. The consumer's commits drain the
+		 * spilled data first, so to free space in the ringbuffer we
+		 * have to force all of that too */
+		force_len += ringbuffer_spill_len(rbc);
+	}
+
+	rbc->rb->n_forced++;
+	prc = ringbuffer_consumer_poll(rbc, force_len);
 	if (prc != RINGBUFFER_POLL_OK) {
 		return -1;
 	}
 
+	/* a consumer that won't take what it was forced to has stalled */
+	if (ringbuffer_space(rbc) < len) {
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -157,7 +389,8 @@ int ringbuffer_queue(struct ringbuffer *rb, uint8_t *data, size_t len)
 
 	/* Ensure there is at least len bytes of space available.
 	 *
-	 * If a client doesn't have sufficient space, perform a blocking write
+	 * If a client doesn't have sufficient space, spill its oldest data to
+	 * disk if it has asked for that, otherwise perform a blocking write
 	 * (by calling ->poll_fn with force_len) to create it.
 	 */
 	for (i = 0; i < rb->n_consumers; i++) {
@@ -165,6 +398,7 @@ int ringbuffer_queue(struct ringbuffer *rb, uint8_t *data, size_t len)
 
 		rc = ringbuffer_consumer_ensure_space(rbc, len);
 		if (rc) {
+			rb->n_dropped++;
 			ringbuffer_consumer_unregister(rbc);
 			i--;
 			continue;
@@ -189,7 +423,7 @@ int ringbuffer_queue(struct ringbuffer *rb, uint8_t *data, size_t len)
 		enum ringbuffer_poll_ret prc;
 
 		rbc = rb->consumers[i];
-		prc = rbc->poll_fn(rbc->poll_data, 0);
+		prc = ringbuffer_consumer_poll(rbc, 0);
 		if (prc == RINGBUFFER_POLL_REMOVE) {
 			ringbuffer_consumer_unregister(rbc);
 			i--;
@@ -203,6 +437,7 @@ size_t ringbuffer_dequeue_peek(struct ringbuffer_consumer *rbc, size_t offset,
 			       uint8_t **data)
 {
 	struct ringbuffer *rb = rbc->rb;
+	size_t spill_len;
 	size_t pos;
 	size_t len;
 
@@ -210,6 +445,13 @@ size_t ringbuffer_dequeue_peek(struct ringbuffer_consumer *rbc, size_t offset,
 		return 0;
 	}
 
+	/* spilled data precedes anything still in the ringbuffer */
+	spill_len = ringbuffer_spill_len(rbc);
+	if (offset < spill_len) {
+		return ringbuffer_spill_peek(rbc, offset, data);
+	}
+	offset -= spill_len;
+
 	pos = (rbc->pos + offset) % rb->size;
 	if (pos <= rb->tail) {
 		len = rb->tail - pos;
@@ -223,7 +465,131 @@ size_t ringbuffer_dequeue_peek(struct ringbuffer_consumer *rbc, size_t offset,
 
 int ringbuffer_dequeue_commit(struct ringbuffer_consumer *rbc, size_t len)
 {
+	size_t spill_len;
+
 	assert(len <= ringbuffer_len(rbc));
+
+	spill_len = min(len, ringbuffer_spill_len(rbc));
+	if (spill_len) {
+		ringbuffer_spill_commit(rbc->spill, spill_len);
+		len -= spill_len;
+	}
+
 	rbc->pos = (rbc->pos + len) % rbc->rb->size;
 	return 0;
 }
+
+/* Fill iov with the consumer's pending data, returning the entry count */
+static int ringbuffer_consumer_iov(struct ringbuffer_consumer *rbc,
+				   struct iovec *iov, size_t *lenp)
+{
+	struct ringbuffer *rb = rbc->rb;
+	size_t spill_len;
+	uint8_t *buf;
+	size_t len;
+	int n = 0;
+
+	*lenp = 0;
+
+	spill_len = ringbuffer_spill_len(rbc);
+	if (spill_len) {
+		len = ringbuffer_spill_peek(rbc, 0, &buf);
+		if (!len) {
+			return 0;
+		}
+
+		iov[n].iov_base = buf;
+		iov[n++].iov_len = len;
+		*lenp += len;
+
+		/* the ring's data follows all of the spilled data */
+		if (len < spill_len) {
+			return n;
+		}
+	}
+
+	if (rbc->pos > rb->tail) {
+		iov[n].iov_base = rb->buf + rbc->pos;
+		iov[n++].iov_len = rb->size - rbc->pos;
+		*lenp += rb->size - rbc->pos;
+		if (rb->tail) {
+			iov[n].iov_base = rb->buf;
+			iov[n++].iov_len = rb->tail;
+			*lenp += rb->tail;
+		}
+	} else if (rbc->pos < rb->tail) {
+		iov[n].iov_base = rb->buf + rbc->pos;
+		iov[n++].iov_len = rb->tail - rbc->pos;
+		*lenp += rb->tail - rbc->pos;
+	}
+
+	return n;
+}
+
+ssize_t ringbuffer_dequeue_iov(struct ringbuffer_consumer *rbc,
+			       size_t force_len, ringbuffer_push_fn_t fn,
+			       void *data)
+{
+	struct iovec iov[RINGBUFFER_IOV_MAX];
+	size_t total = 0;
+	size_t force;
+	size_t len;
+	ssize_t rc;
+	int iovcnt;
+
+	/* Only a spill file holds more than we can offer in one call, so we
+	 * go around again while the consumer keeps up with it. Each call is
+	 * only forced to take what it was offered. */
+	do {
+		iovcnt = ringbuffer_consumer_iov(rbc, iov, &len);
+		force = force_len > total ? force_len - total : 0;
+		if (force > len) {
+			force = len;
+		}
+		rc = fn(data, iov, iovcnt, force);
+		if (rc < 0) {
+			return -1;
+		}
+
+		assert((size_t)rc <= len);
+		ringbuffer_dequeue_commit(rbc, rc);
+		total += rc;
+	} while (rc && (size_t)rc == len && ringbuffer_len(rbc));
+
+	return (ssize_t)total;
+}
+
+int ringbuffer_iov_slice(struct iovec *dst, const struct iovec *iov,
+			 int iovcnt, size_t offset, size_t len)
+{
+	size_t seg_len;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		seg_len = min(iov[i].iov_len - offset, len);
+		dst[n].iov_base = (uint8_t *)iov[i].iov_base + offset;
+		dst[n++].iov_len = seg_len;
+		len -= seg_len;
+		offset = 0;
+	}
+
+	return n;
+}
+
+size_t ringbuffer_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	return len;
+}
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -30,18 +31,51 @@
 #include <sys/un.h>
 #include <systemd/sd-daemon.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "console-server.h"
 
 #define SOCKET_HANDLER_PKT_SIZE 512
 /* Set poll() timeout to 4000 uS, or 4 mS */
 #define SOCKET_HANDLER_PKT_US_TIMEOUT 4000
 
+/*
+ * Compressed clients trade ratio for CPU: a fast level, and a window that
+ * bounds the per-client compressor state.
+ */
+#define SOCKET_HANDLER_ZSTD_LEVEL      1
+#define SOCKET_HANDLER_ZSTD_WINDOW_LOG 17
+
+static const char *default_spill_dir = LOCALSTATEDIR "/tmp";
+static const size_t default_spill_max_size = 16ul * 1024ul * 1024ul;
+static const size_t default_spill_total_size = 64ul * 1024ul * 1024ul;
+
 struct client {
 	struct socket_handler *sh;
 	struct poller *poller;
 	struct ringbuffer_consumer *rbc;
 	int fd;
 	bool blocked;
+
+	/* charged to the console's memory accounting */
+	size_t mem;
+	/* reserved from the console's spill allowance */
+	size_t spill;
+
+#ifdef HAVE_ZSTD
+	/*
+	 * For compressed clients, compressed data that we have yet to send,
+	 * and whether the compressor holds data that it hasn't yet output.
+	 */
+	ZSTD_CStream *zstd;
+	uint8_t *zbuf;
+	size_t zbuf_size;
+	size_t zbuf_pos;
+	size_t zbuf_len;
+	bool zpending;
+#endif
 };
 
 struct socket_handler {
@@ -52,6 +86,12 @@ struct socket_handler {
 
 	struct client **clients;
 	int n_clients;
+
+	const char *spill_dir;
+	size_t spill_max_size;
+	/* disk allowance for all clients' spill files, and what's reserved */
+	size_t spill_total_size;
+	size_t spill_reserved;
 };
 
 static struct timeval const socket_handler_timeout = {
@@ -86,6 +126,13 @@ static void client_close(struct client *client)
 
 	assert(idx < sh->n_clients);
 
+	console_mem_uncharge(sh->console, client->mem);
+	sh->spill_reserved -= client->spill;
+	console_interactive_put(sh->console);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCStream(client->zstd);
+	free(client->zbuf);
+#endif
 	free(client);
 	client = NULL;
 
@@ -120,27 +167,32 @@ static void client_set_blocked(struct client *client, bool blocked)
 	console_poller_set_events(client->sh->console, client->poller, events);
 }
 
-static ssize_t send_all(struct client *client, void *buf, size_t len,
-			bool block)
+/* Send up to limit bytes of iov, returning the number of bytes sent */
+static ssize_t send_iov(struct client *client, const struct iovec *iov,
+			int iovcnt, size_t limit, bool block)
 {
-	int fd;
+	struct iovec vec[RINGBUFFER_IOV_MAX];
+	struct msghdr msg;
 	int flags;
 	ssize_t rc;
 	size_t pos;
 
-	if (len > SSIZE_MAX) {
-		return -EINVAL;
-	}
-
-	fd = client->fd;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
 
 	flags = MSG_NOSIGNAL;
 	if (!block) {
 		flags |= MSG_DONTWAIT;
 	}
 
-	for (pos = 0; pos < len; pos += rc) {
-		rc = send(fd, (char *)buf + pos, len - pos, flags);
+	for (pos = 0;; pos += rc) {
+		msg.msg_iovlen = ringbuffer_iov_slice(vec, iov, iovcnt, pos,
+						      limit - pos);
+		if (!msg.msg_iovlen) {
+			break;
+		}
+
+		rc = sendmsg(client->fd, &msg, flags);
 		if (rc < 0) {
 			if (!block &&
 			    (errno == EAGAIN || errno == EWOULDBLOCK)) {
@@ -149,6 +201,7 @@ static ssize_t send_all(struct client *client, void *buf, size_t len,
 			}
 
 			if (errno == EINTR) {
+				rc = 0;
 				continue;
 			}
 
@@ -162,45 +215,112 @@ static ssize_t send_all(struct client *client, void *buf, size_t len,
 	return (ssize_t)pos;
 }
 
-/* Drain the queue to the socket and update the queue buffer. If force_len is
- * set, send at least that many bytes from the queue, possibly while blocking
+#ifdef HAVE_ZSTD
+/*
+ * Send any compressed data we have buffered. Returns 1 if it has all been
+ * sent, 0 if the socket would block, or -1 on error.
  */
-static int client_drain_queue(struct client *client, size_t force_len)
+static int client_send_compressed(struct client *client, bool block)
 {
-	uint8_t *buf;
+	struct iovec iov;
 	ssize_t wlen;
-	size_t len;
+
+	if (!client->zbuf_len) {
+		return 1;
+	}
+
+	iov.iov_base = client->zbuf + client->zbuf_pos;
+	iov.iov_len = client->zbuf_len;
+	wlen = send_iov(client, &iov, 1, SIZE_MAX, block);
+	if (wlen < 0) {
+		return -1;
+	}
+
+	client->zbuf_pos += wlen;
+	client->zbuf_len -= wlen;
+	if (client->zbuf_len) {
+		return 0;
+	}
+
+	client->zbuf_pos = 0;
+	return 1;
+}
+
+/*
+ * The compressed equivalent of client_drain_queue(): feed the queue through
+ * the compressor, sending its output as we go. The compressor holds on to
+ * data until we flush it, which we do when the coalescing timeout expires,
+ * so a client sees output at the same latency as an uncompressed client.
+ */
+static ssize_t client_drain_compressed(struct client *client,
+				       const struct iovec *iov, int iovcnt,
+				       size_t force_len, bool flush)
+{
+	ZSTD_EndDirective mode;
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer in;
 	size_t total_len;
+	size_t off;
+	size_t len;
+	size_t rc;
 	bool block;
+	int sent;
+	int i;
 
 	total_len = 0;
-	wlen = 0;
 	block = !!force_len;
 
-	/* if we're already blocked, no need for the write */
 	if (!block && client->blocked) {
 		return 0;
 	}
 
-	for (;;) {
-		len = ringbuffer_dequeue_peek(client->rbc, total_len, &buf);
-		if (!len) {
+	for (i = 0, off = 0;;) {
+		sent = client_send_compressed(client, block);
+		if (sent <= 0) {
 			break;
 		}
 
-		wlen = send_all(client, buf, len, block);
-		if (wlen <= 0) {
-			break;
+		while (i < iovcnt && off == iov[i].iov_len) {
+			i++;
+			off = 0;
 		}
+		len = i < iovcnt ? iov[i].iov_len - off : 0;
 
-		total_len += wlen;
+		if (force_len && total_len >= force_len && !flush) {
+			break;
+		}
 
-		if (force_len && total_len >= force_len) {
+		if (!len && !(flush && client->zpending)) {
 			break;
 		}
+
+		in.src = len ? (uint8_t *)iov[i].iov_base + off : NULL;
+		in.size = len;
+		in.pos = 0;
+		out.dst = client->zbuf;
+		out.size = client->zbuf_size;
+		out.pos = 0;
+
+		mode = flush && !len ? ZSTD_e_flush : ZSTD_e_continue;
+		rc = ZSTD_compressStream2(client->zstd, &out, &in, mode);
+		if (ZSTD_isError(rc)) {
+			warnx("Compression failed: %s", ZSTD_getErrorName(rc));
+			return -1;
+		}
+
+		off += in.pos;
+		total_len += in.pos;
+		client->zbuf_len = out.pos;
+
+		if (mode == ZSTD_e_flush) {
+			/* rc is the amount the compressor has left to flush */
+			client->zpending = rc != 0;
+		} else if (in.pos) {
+			client->zpending = true;
+		}
 	}
 
-	if (wlen < 0) {
+	if (sent < 0) {
 		return -1;
 	}
 
@@ -208,42 +328,133 @@ static int client_drain_queue(struct client *client, size_t force_len)
 		return -1;
 	}
 
-	ringbuffer_dequeue_commit(client->rbc, total_len);
+	/* make sure what we've compressed goes out at the next timeout */
+	if (client->zpending) {
+		console_poller_set_timeout(client->sh->console, client->poller,
+					   &socket_handler_timeout);
+	}
+
+	return (ssize_t)total_len;
+}
+
+static ssize_t client_flush_compressed(void *arg, const struct iovec *iov,
+				       int iovcnt, size_t force_len)
+{
+	return client_drain_compressed(arg, iov, iovcnt, force_len, true);
+}
+
+static int client_enable_compression(struct client *client)
+{
+	size_t rc;
+
+	client->zstd = ZSTD_createCStream();
+	if (!client->zstd) {
+		return -ENOMEM;
+	}
+
+	rc = ZSTD_CCtx_setParameter(client->zstd, ZSTD_c_compressionLevel,
+				    SOCKET_HANDLER_ZSTD_LEVEL);
+	if (!ZSTD_isError(rc)) {
+		rc = ZSTD_CCtx_setParameter(client->zstd, ZSTD_c_windowLog,
+					    SOCKET_HANDLER_ZSTD_WINDOW_LOG);
+	}
+	if (ZSTD_isError(rc)) {
+		warnx("Can't configure compression: %s",
+		      ZSTD_getErrorName(rc));
+		return -EINVAL;
+	}
+
+	client->zbuf_size = ZSTD_CStreamOutSize();
+	client->zbuf = malloc(client->zbuf_size);
+	if (!client->zbuf) {
+		return -ENOMEM;
+	}
+
+	/*
+	 * The compressor allocates its state lazily, so account for the
+	 * worst case for our parameters up front.
+	 */
+	if (console_mem_charge(client->sh->console,
+			       client->zbuf_size +
+				       (2ul << SOCKET_HANDLER_ZSTD_WINDOW_LOG))) {
+		warnx("Memory limit reached, can't enable compression");
+		return -ENOMEM;
+	}
+	client->mem += client->zbuf_size +
+		       (2ul << SOCKET_HANDLER_ZSTD_WINDOW_LOG);
+
 	return 0;
 }
+#endif
 
-static enum ringbuffer_poll_ret client_ringbuffer_poll(void *arg,
-						       size_t force_len)
+/* Send the pending data in iov to the socket, returning the number of bytes
+ * sent. If force_len is set, send at least that many bytes, possibly while
+ * blocking */
+static ssize_t client_drain_queue(void *arg, const struct iovec *iov,
+				  int iovcnt, size_t force_len)
 {
 	struct client *client = arg;
-	size_t len;
-	int rc;
+	ssize_t wlen;
+	bool block;
+
+#ifdef HAVE_ZSTD
+	if (client->zstd) {
+		return client_drain_compressed(client, iov, iovcnt, force_len,
+					       false);
+	}
+#endif
+
+	block = !!force_len;
+
+	/* if we're already blocked, no need for the write */
+	if (!block && client->blocked) {
+		return 0;
+	}
 
-	len = ringbuffer_len(client->rbc);
-	if (!force_len && (len < SOCKET_HANDLER_PKT_SIZE)) {
+	/* send as little as possible while blocking */
+	wlen = send_iov(client, iov, iovcnt, block ? force_len : SIZE_MAX,
+			block);
+	if (wlen < 0) {
+		return -1;
+	}
+
+	if (force_len && (size_t)wlen < force_len) {
+		return -1;
+	}
+
+	return wlen;
+}
+
+static ssize_t client_ringbuffer_push(void *arg, const struct iovec *iov,
+				      int iovcnt, size_t force_len)
+{
+	struct client *client = arg;
+	ssize_t rc;
+
+	if (!force_len && ringbuffer_len(client->rbc) < SOCKET_HANDLER_PKT_SIZE &&
+	    !console_low_latency(client->sh->console)) {
 		/* Do nothing until many small requests have accumulated, or
 		 * the UART is idle for awhile (as determined by the timeout
 		 * value supplied to the poll function call in console_server.c. */
 		console_poller_set_timeout(client->sh->console, client->poller,
 					   &socket_handler_timeout);
-		return RINGBUFFER_POLL_OK;
+		return 0;
 	}
 
-	rc = client_drain_queue(client, force_len);
-	if (rc) {
+	rc = client_drain_queue(client, iov, iovcnt, force_len);
+	if (rc < 0) {
 		client->rbc = NULL;
 		client_close(client);
-		return RINGBUFFER_POLL_REMOVE;
 	}
 
-	return RINGBUFFER_POLL_OK;
+	return rc;
 }
 
 static enum poller_ret
 client_timeout(struct handler *handler __attribute__((unused)), void *data)
 {
 	struct client *client = data;
-	int rc = 0;
+	ringbuffer_push_fn_t drain;
 
 	if (client->blocked) {
 		/* nothing to do here, we'll call client_drain_queue when
@@ -251,8 +462,13 @@ client_timeout(struct handler *handler __attribute__((unused)), void *data)
 		return POLLER_OK;
 	}
 
-	rc = client_drain_queue(client, 0);
-	if (rc) {
+	drain = client_drain_queue;
+#ifdef HAVE_ZSTD
+	if (client->zstd) {
+		drain = client_flush_compressed;
+	}
+#endif
+	if (ringbuffer_dequeue_iov(client->rbc, 0, drain, client) < 0) {
 		client_close(client);
 		return POLLER_REMOVE;
 	}
@@ -405,8 +621,8 @@ static enum poller_ret client_poll(struct handler *handler, int events,
 
 	if (events & POLLOUT) {
 		client_set_blocked(client, false);
-		rc = client_drain_queue(client, 0);
-		if (rc) {
+		if (ringbuffer_dequeue_iov(client->rbc, 0, client_drain_queue,
+					   client) < 0) {
 			goto err_close;
 		}
 	}
@@ -419,6 +635,34 @@ err_close:
 	return POLLER_REMOVE;
 }
 
+/*
+ * Charge a new client against the memory limits: our own state for the
+ * client, plus the kernel's send buffer for its socket, which is where a
+ * slow client's backlog accumulates.
+ */
+static int client_charge(struct client *client)
+{
+	socklen_t optlen = sizeof(int);
+	int sndbuf = 0;
+	size_t size;
+
+	if (getsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen)) {
+		sndbuf = 0;
+	}
+
+	size = sizeof(*client) + sizeof(struct poller) +
+	       sizeof(struct pollfd) + sizeof(struct ringbuffer_consumer) +
+	       (size_t)sndbuf;
+
+	if (console_mem_charge(client->sh->console, size)) {
+		return -ENOMEM;
+	}
+
+	client->mem = size;
+
+	return 0;
+}
+
 static enum poller_ret socket_poll(struct handler *handler, int events,
 				   void __attribute__((unused)) * data)
 {
@@ -441,11 +685,19 @@ static enum poller_ret socket_poll(struct handler *handler, int events,
 
 	client->sh = sh;
 	client->fd = fd;
+
+	if (client_charge(client)) {
+		warnx("Memory limit reached, rejecting client");
+		close(fd);
+		free(client);
+		return POLLER_OK;
+	}
+
 	client->poller = console_poller_register(sh->console, handler,
 						 client_poll, client_timeout,
 						 client->fd, POLLIN, client);
-	client->rbc = console_ringbuffer_consumer_register(
-		sh->console, client_ringbuffer_poll, client);
+	client->rbc = console_ringbuffer_consumer_register_push(
+		sh->console, &sh->handler, NULL, client_ringbuffer_push, client);
 
 	n = sh->n_clients++;
 	/*
@@ -457,15 +709,46 @@ static enum poller_ret socket_poll(struct handler *handler, int events,
 		reallocarray(sh->clients, sh->n_clients, sizeof(*sh->clients));
 	/* NOLINTEND(bugprone-sizeof-expression) */
 	sh->clients[n] = client;
+	console_interactive_get(sh->console);
 
 	return POLLER_OK;
 }
 
+static int client_enable_spill(struct client *client)
+{
+	struct socket_handler *sh = client->sh;
+	int fd;
+
+	/* each spill file may grow to the maximum, so reserve that much */
+	if (sh->spill_reserved + sh->spill_max_size > sh->spill_total_size) {
+		warnx("Spill allowance reached, rejecting client");
+		return -ENOSPC;
+	}
+
+	fd = open(sh->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		warn("Can't create spill file in %s", sh->spill_dir);
+		return -errno;
+	}
+
+	if (ringbuffer_consumer_enable_spill(client->rbc, fd,
+					     sh->spill_max_size)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	client->spill = sh->spill_max_size;
+	sh->spill_reserved += client->spill;
+
+	return 0;
+}
+
 /* Create socket pair and register one end as poller/consumer and return
  * the other end to the caller.
  * Return file descriptor on success and negative value on error.
  */
-int dbus_create_socket_consumer(struct console *console)
+int dbus_create_socket_consumer(struct console *console,
+				const struct socket_consumer_options *opts)
 {
 	struct socket_handler *sh = NULL;
 	struct client *client;
@@ -502,15 +785,46 @@ int dbus_create_socket_consumer(struct console *console)
 
 	client->sh = sh;
 	client->fd = fds[0];
+
+	rc = client_charge(client);
+	if (rc) {
+		warnx("Memory limit reached, rejecting client");
+		goto free_client;
+	}
+
 	client->poller = console_poller_register(sh->console, &sh->handler,
 						 client_poll, client_timeout,
 						 client->fd, POLLIN, client);
-	client->rbc = console_ringbuffer_consumer_register(
-		sh->console, client_ringbuffer_poll, client);
+	errno = 0;
+	client->rbc = console_ringbuffer_consumer_register_push(
+		sh->console, &sh->handler, opts ? opts->transform : NULL,
+		client_ringbuffer_push, client);
 	if (client->rbc == NULL) {
+		rc = errno == EUSERS ? -EUSERS : -ENOMEM;
 		warnx("Failed to register a consumer.\n");
-		rc = -ENOMEM;
-		goto free_client;
+		goto unregister_poller;
+	}
+
+	if (opts && opts->spill) {
+		rc = client_enable_spill(client);
+		if (rc) {
+			goto unregister_client;
+		}
+	}
+
+	if (opts && opts->compression && strcmp(opts->compression, "none")) {
+		if (strcmp(opts->compression, "zstd")) {
+			rc = -EINVAL;
+		} else {
+#ifdef HAVE_ZSTD
+			rc = client_enable_compression(client);
+#else
+			rc = -EOPNOTSUPP;
+#endif
+		}
+		if (rc) {
+			goto unregister_client;
+		}
 	}
 
 	n = sh->n_clients++;
@@ -524,10 +838,21 @@ int dbus_create_socket_consumer(struct console *console)
 		reallocarray(sh->clients, sh->n_clients, sizeof(*sh->clients));
 	/* NOLINTEND(bugprone-sizeof-expression) */
 	sh->clients[n] = client;
+	console_interactive_get(sh->console);
 
 	/* Return the second FD to caller. */
 	return fds[1];
 
+unregister_client:
+#ifdef HAVE_ZSTD
+	ZSTD_freeCStream(client->zstd);
+	free(client->zbuf);
+#endif
+	ringbuffer_consumer_unregister(client->rbc);
+	sh->spill_reserved -= client->spill;
+unregister_poller:
+	console_poller_unregister(sh->console, client->poller);
+	console_mem_uncharge(sh->console, client->mem);
 free_client:
 	free(client);
 close_fds:
@@ -537,9 +862,11 @@ close_fds:
 }
 
 static int socket_init(struct handler *handler, struct console *console,
-		       struct config *config __attribute__((unused)))
+		       struct config *config)
 {
 	struct socket_handler *sh = to_socket_handler(handler);
+	const char *spill_size_str;
+	const char *spill_total_str;
 	struct sockaddr_un addr;
 	size_t addrlen;
 	ssize_t len;
@@ -549,6 +876,34 @@ static int socket_init(struct handler *handler, struct console *console,
 	sh->clients = NULL;
 	sh->n_clients = 0;
 
+	sh->spill_dir = config_get_value(config, "spill-dir");
+	if (!sh->spill_dir) {
+		sh->spill_dir = default_spill_dir;
+	}
+
+	sh->spill_max_size = default_spill_max_size;
+	spill_size_str = config_get_value(config, "spill-max-size");
+	if (spill_size_str) {
+		rc = config_parse_bytesize(spill_size_str, &sh->spill_max_size);
+		if (rc) {
+			warnx("Invalid spill-max-size. Default to %zukB",
+			      sh->spill_max_size >> 10);
+		}
+	}
+
+	sh->spill_reserved = 0;
+	sh->spill_total_size = default_spill_total_size;
+	spill_total_str = config_get_value(config, "spill-total-size");
+	if (spill_total_str) {
+		rc = config_parse_bytesize(spill_total_str,
+					   &sh->spill_total_size);
+		if (rc) {
+			sh->spill_total_size = default_spill_total_size;
+			warnx("Invalid spill-total-size. Default to %zukB",
+			      sh->spill_total_size >> 10);
+		}
+	}
+
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
 	len = console_socket_path(addr.sun_path, console->console_id);
@@ -38,6 +38,8 @@ struct test {
 	} esc_state;
 	const char *in[4];
 	size_t n_in;
+	/* the server has stalled, and our queue for it is full */
+	bool full;
 	const char *exp_out;
 	int exp_rc;
 };
@@ -45,9 +47,7 @@ struct test {
 struct test_ctx {
 	struct console_client client;
 	struct test *test;
-	uint8_t out[4096];
 	size_t cur_in;
-	size_t cur_out;
 };
 
 struct test tests[] = {
@@ -152,21 +152,38 @@ struct test tests[] = {
 		.exp_out = "acb",
 		.exp_rc = PROCESS_EXIT,
 	},
+	{
+		/* ssh escape, with the queue full */
+		.esc_type = ESC_TYPE_SSH,
+		.in = { "a\r~." },
+		.n_in = 1,
+		.full = true,
+		.exp_out = "",
+		.exp_rc = PROCESS_ESC,
+	},
+	{
+		/* str escape, split over reads, with the queue full */
+		.esc_type = ESC_TYPE_STR,
+		.esc_state = { .str = { .str = (const uint8_t *)"bc" } },
+		.in = { "ab", "cd" },
+		.n_in = 2,
+		.full = true,
+		.exp_out = "",
+		.exp_rc = PROCESS_ESC,
+	},
 };
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 struct test_ctx ctxs[ARRAY_SIZE(tests)];
 
-int write_buf_to_fd(int fd, const uint8_t *buf, size_t len)
+/* process_tty() only buffers output for the server, so never writes */
+int write_buf_to_fd(int fd __attribute__((unused)),
+		    const uint8_t *buf __attribute__((unused)),
+		    size_t len __attribute__((unused)))
 {
-	struct test_ctx *ctx = &ctxs[fd];
-
-	assert(ctx->cur_out + len <= sizeof(ctx->out));
-	memcpy(ctx->out + ctx->cur_out, buf, len);
-	ctx->cur_out += len;
-
-	return 0;
+	assert(false);
+	return -1;
 }
 
 static ssize_t __read(int fd, void *buf, size_t len)
@@ -195,6 +212,7 @@ static ssize_t __read(int fd, void *buf, size_t len)
 void run_one_test(size_t idx, struct test *test, struct test_ctx *ctx)
 {
 	size_t exp_out_len;
+	size_t fill = 0;
 	int rc;
 
 	/* we store the index into the context array as a FD, so we
@@ -208,6 +226,12 @@ void run_one_test(size_t idx, struct test *test, struct test_ctx *ctx)
 	       sizeof(test->esc_state));
 	ctx->test = test;
 
+	if (test->full) {
+		fill = sizeof(ctx->client.to_server.data);
+		memset(ctx->client.to_server.data, 'x', fill);
+		ctx->client.to_server.len = fill;
+	}
+
 	for (;;) {
 		rc = process_tty(&ctx->client);
 		if (rc != PROCESS_OK) {
@@ -218,13 +242,17 @@ void run_one_test(size_t idx, struct test *test, struct test_ctx *ctx)
 	exp_out_len = strlen(test->exp_out);
 
 #ifdef DEBUG
-	printf("got: rc %d %s(%d), exp: rc %d %s(%ld)\n", rc, ctx->out,
-	       ctx->cur_out, test->exp_rc, test->exp_out, exp_out_len);
+	printf("got: rc %d %.*s(%zu), exp: rc %d %s(%ld)\n", rc,
+	       (int)ctx->client.to_server.len, ctx->client.to_server.data,
+	       ctx->client.to_server.len, test->exp_rc, test->exp_out,
+	       exp_out_len);
 	fflush(stdout);
 #endif
 	assert(rc == test->exp_rc);
-	assert(exp_out_len == ctx->cur_out);
-	assert(!memcmp(ctx->out, test->exp_out, exp_out_len));
+	assert(fill + exp_out_len == ctx->client.to_server.len);
+	assert(!memcmp(ctx->client.to_server.data +
+			       ctx->client.to_server.start + fill,
+		       test->exp_out, exp_out_len));
 }
 
 int main(void)
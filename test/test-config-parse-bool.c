@@ -0,0 +1,50 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+
+struct test_parse_bool {
+	const char *test_str;
+	bool expected_val;
+	int expected_rc;
+};
+
+void test_config_parse_bool(void)
+{
+	const struct test_parse_bool test_data[] = {
+		{ NULL, false, -1 },  { "", false, -1 },
+		{ "true", true, 0 },  { "TRUE", true, 0 },
+		{ "yes", true, 0 },   { "on", true, 0 },
+		{ "1", true, 0 },     { "false", false, 0 },
+		{ "No", false, 0 },   { "off", false, 0 },
+		{ "0", false, 0 },    { "2", false, -1 },
+		{ "truth", false, -1 }, /* Invalid */
+	};
+	size_t i;
+	bool val;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(test_data); i++) {
+		val = !test_data[i].expected_val;
+		rc = config_parse_bool(&val, test_data[i].test_str);
+
+		assert(rc == test_data[i].expected_rc);
+		if (!rc) {
+			assert(val == test_data[i].expected_val);
+		}
+	}
+}
+
+int main(void)
+{
+	test_config_parse_bool();
+	return EXIT_SUCCESS;
+}
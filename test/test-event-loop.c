@@ -0,0 +1,569 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR
+#endif
+
+#include "config.c"
+#include "console-socket.c"
+#include "ringbuffer.c"
+#include "throughput.c"
+#include "trace.c"
+#include "transform.c"
+#include "util.c"
+#define main __main
+#include "console-server.c"
+#undef main
+#include "socket-handler.c"
+
+/*
+ * Drive the event loop in virtual time. The fds are real, but the clock
+ * only moves when the loop would otherwise sleep: if nothing is ready, the
+ * wait runs to its timeout at once. So timing is exact, and the tests don't
+ * depend on how busy the machine is.
+ */
+static struct timeval vnow;
+
+static int virtual_now(struct timeval *tv)
+{
+	*tv = vnow;
+	return 0;
+}
+
+static void advance(long ms)
+{
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+	timeradd(&vnow, &tv, &vnow);
+}
+
+static int virtual_wait(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	int rc;
+
+	rc = poll(fds, nfds, 0);
+	if (rc) {
+		return rc;
+	}
+
+	/* nothing is ready, and nothing is due: we'd sleep forever */
+	assert(timeout >= 0);
+	advance(timeout);
+
+	return 0;
+}
+
+static const struct console_clock virtual_clock = {
+	.now = virtual_now,
+	.wait = virtual_wait,
+};
+
+/* milliseconds since setup() */
+static long elapsed(void)
+{
+	return (vnow.tv_sec - 100) * 1000 + vnow.tv_usec / 1000;
+}
+
+int sd_bus_get_events(sd_bus *bus __attribute__((unused)))
+{
+	return 0;
+}
+
+int sd_bus_process(sd_bus *bus __attribute__((unused)),
+		   sd_bus_message **r __attribute__((unused)))
+{
+	return 0;
+}
+
+sd_bus *sd_bus_unref(sd_bus *bus __attribute__((unused)))
+{
+	return NULL;
+}
+
+int sd_listen_fds(int unset_environment __attribute__((unused)))
+{
+	return 0;
+}
+
+int sd_is_socket_unix(int fd __attribute__((unused)),
+		      int type __attribute__((unused)),
+		      int listening __attribute__((unused)),
+		      const char *path __attribute__((unused)),
+		      size_t length __attribute__((unused)))
+{
+	return 0;
+}
+
+void dbus_init(struct console *console __attribute__((unused)),
+	       struct config *config __attribute__((unused)))
+{
+}
+
+int console_mem_init(struct console *console __attribute__((unused)),
+		     struct config *config __attribute__((unused)))
+{
+	return 0;
+}
+
+void console_mem_fini(struct console *console __attribute__((unused)))
+{
+}
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size __attribute__((unused)))
+{
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size __attribute__((unused)))
+{
+}
+
+static struct console *console;
+static struct config *config;
+/* the host's end of the tty */
+static int host_fd;
+
+static void setup_config(const char *config_str)
+{
+	char *buf;
+	int fds[2];
+
+	vnow.tv_sec = 100;
+	vnow.tv_usec = 0;
+	console_set_clock(&virtual_clock);
+
+	console = calloc(1, sizeof(*console));
+	console->pollfds =
+		calloc(MAX_INTERNAL_POLLFD, sizeof(*console->pollfds));
+	console->rb = ringbuffer_init(default_buffer_size);
+	console->console_id = "test-event-loop";
+
+	/* a socketpair stands in for the tty */
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(!fcntl(fds[0], F_SETFL, O_NONBLOCK));
+	console->tty.fd = fds[0];
+	console->pollfds[POLLFD_HOSTTTY].fd = fds[0];
+	console->pollfds[POLLFD_HOSTTTY].events = POLLIN;
+	console->pollfds[POLLFD_DBUS].fd = -1;
+	host_fd = fds[1];
+
+	/* config_parse() modifies its buffer */
+	buf = strdup(config_str);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+	console_transform_init(console, config);
+	handlers_init(console, config);
+}
+
+static void setup(void)
+{
+	setup_config("");
+}
+
+static void teardown(void)
+{
+	handlers_fini(console);
+	console_transform_reap(console);
+	config_fini(config);
+	close(console->tty.fd);
+	close(host_fd);
+	ringbuffer_fini(console->rb);
+	free(console->pollers);
+	free(console->pollfds);
+	free(console);
+	console_set_clock(NULL);
+}
+
+static void host_write(const char *str)
+{
+	assert(write(host_fd, str, strlen(str)) == (ssize_t)strlen(str));
+}
+
+static int client_connect_opts(const struct socket_consumer_options *opts)
+{
+	int fd;
+
+	fd = dbus_create_socket_consumer(console, opts);
+	assert(fd >= 0);
+	assert(!fcntl(fd, F_SETFL, O_NONBLOCK));
+	return fd;
+}
+
+static int client_connect(void)
+{
+	return client_connect_opts(NULL);
+}
+
+/* Returns how much the client has received, or 0 if nothing yet */
+static size_t client_read(int fd, char *buf, size_t len)
+{
+	ssize_t rc;
+
+	rc = read(fd, buf, len);
+	if (rc < 0) {
+		assert(errno == EAGAIN);
+		return 0;
+	}
+
+	return rc;
+}
+
+/* Timer-only pollers, recording when they fire */
+static struct handler timer_handler = { .name = "timer" };
+static const char *fired[4];
+static long fired_at[4];
+static int n_fired;
+
+static enum poller_ret timer_fire(struct handler *handler
+				  __attribute__((unused)),
+				  void *data)
+{
+	fired[n_fired] = data;
+	fired_at[n_fired] = elapsed();
+	n_fired++;
+	return POLLER_OK;
+}
+
+static struct poller *timer_add(const char *name, long ms)
+{
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+	struct poller *poller;
+
+	poller = console_poller_register(console, &timer_handler, NULL,
+					 timer_fire, -1, 0, (void *)name);
+	console_poller_set_timeout(console, poller, &tv);
+	return poller;
+}
+
+void test_poll_timeout(void)
+{
+	struct timeval tv = { 0, 2500 };
+	struct poller *poller;
+
+	setup();
+
+	/* nothing to wait for */
+	assert(get_poll_timeout(console, &vnow) == -1);
+
+	poller = timer_add("a", 25);
+	assert(get_poll_timeout(console, &vnow) == 25);
+
+	/* a part-millisecond wait rounds up, rather than spinning */
+	console_poller_set_timeout(console, poller, &tv);
+	assert(get_poll_timeout(console, &vnow) == 3);
+
+	advance(3);
+	assert(get_poll_timeout(console, &vnow) == 0);
+
+	console_poller_unregister(console, poller);
+	teardown();
+}
+
+/* Timers fire in deadline order, each on time, one wait apiece */
+void test_timer_order(void)
+{
+	struct poller *a;
+	struct poller *b;
+
+	setup();
+	n_fired = 0;
+
+	a = timer_add("a", 30);
+	b = timer_add("b", 10);
+
+	assert(!run_console_once(console));
+	assert(n_fired == 1);
+	assert(!strcmp(fired[0], "b") && fired_at[0] == 10);
+
+	assert(!run_console_once(console));
+	assert(n_fired == 2);
+	assert(!strcmp(fired[1], "a") && fired_at[1] == 30);
+
+	console_poller_unregister(console, a);
+	console_poller_unregister(console, b);
+	teardown();
+}
+
+/* Small writes are held until the tty has been idle for the timeout */
+void test_coalesce(void)
+{
+	char buf[1024];
+	int fd;
+
+	setup();
+	fd = client_connect();
+
+	host_write("login");
+	assert(!run_console_once(console));
+	assert(!client_read(fd, buf, sizeof(buf)));
+
+	/* more output restarts the timeout */
+	advance(2);
+	host_write(": ");
+	assert(!run_console_once(console));
+	assert(!client_read(fd, buf, sizeof(buf)));
+
+	assert(!run_console_once(console));
+	assert(elapsed() == 2 + SOCKET_HANDLER_PKT_US_TIMEOUT / 1000);
+	assert(client_read(fd, buf, sizeof(buf)) == 7);
+	assert(!memcmp(buf, "login: ", 7));
+
+	close(fd);
+	teardown();
+}
+
+/* A full packet goes out at once */
+void test_coalesce_full(void)
+{
+	char buf[1024];
+	int fd;
+
+	setup();
+	fd = client_connect();
+
+	memset(buf, 'x', SOCKET_HANDLER_PKT_SIZE);
+	buf[SOCKET_HANDLER_PKT_SIZE] = '\0';
+	host_write(buf);
+	assert(!run_console_once(console));
+	assert(!elapsed());
+	assert(client_read(fd, buf, sizeof(buf)) == SOCKET_HANDLER_PKT_SIZE);
+
+	close(fd);
+	teardown();
+}
+
+/* In low-latency mode, the echo of client input isn't held back */
+void test_low_latency(void)
+{
+	char buf[64];
+	int fd;
+
+	setup();
+	console->low_latency = true;
+	fd = client_connect();
+
+	assert(write(fd, "l", 1) == 1);
+	assert(!run_console_once(console));
+	assert(read(host_fd, buf, sizeof(buf)) == 1);
+
+	host_write("l");
+	assert(!run_console_once(console));
+	assert(!elapsed());
+	assert(client_read(fd, buf, sizeof(buf)) == 1);
+
+	/* once the window has passed, we coalesce again */
+	advance(LOW_LATENCY_WINDOW_MS);
+	host_write("s");
+	assert(!run_console_once(console));
+	assert(!client_read(fd, buf, sizeof(buf)));
+
+	close(fd);
+	teardown();
+}
+
+/* Only handlers that implement both ops can be suspended */
+void test_suspend_unsupported(void)
+{
+	setup();
+
+	assert(console_handler_set_suspended(console, "nonexistent", true) ==
+	       -ENOENT);
+	assert(console_handler_set_suspended(console, "socket", true) ==
+	       -EOPNOTSUPP);
+
+	teardown();
+}
+
+/* Spilling clients share a disk allowance */
+void test_spill_allowance(void)
+{
+	struct socket_consumer_options opts = { .spill = true };
+	int a;
+	int b;
+
+	setup_config("spill-max-size = 1M\nspill-total-size = 2M\n");
+
+	a = client_connect_opts(&opts);
+	b = client_connect_opts(&opts);
+	assert(dbus_create_socket_consumer(console, &opts) == -ENOSPC);
+
+	/* the allowance is returned once a client goes */
+	close(a);
+	assert(!run_console_once(console));
+	a = client_connect_opts(&opts);
+
+	close(a);
+	close(b);
+	teardown();
+}
+
+/* Transforms are limited, and go as soon as their last client does */
+void test_transform_limit(void)
+{
+	struct socket_consumer_options crlf = { .transform = "crlf" };
+	struct socket_consumer_options utf8 = { .transform = "utf8" };
+	int a;
+	int b;
+
+	setup_config("transform-max-chains = 1\n");
+
+	a = client_connect_opts(&crlf);
+	b = client_connect_opts(&crlf);
+	assert(console->n_transforms == 1);
+	assert(dbus_create_socket_consumer(console, &utf8) == -EUSERS);
+
+	close(a);
+	assert(!run_console_once(console));
+	assert(console->n_transforms == 1);
+	close(b);
+	assert(!run_console_once(console));
+	assert(console->n_transforms == 0);
+	assert(!console->rb->n_dropped);
+
+	a = client_connect_opts(&utf8);
+	assert(console->n_transforms == 1);
+
+	close(a);
+	teardown();
+}
+
+/* Write len bytes of a pattern the reader can check, continuing from pos */
+static void host_write_pattern(size_t pos, size_t len)
+{
+	char buf[1024];
+	size_t i;
+
+	assert(len <= sizeof(buf));
+	for (i = 0; i < len; i++) {
+		buf[i] = (char)((pos + i) % 251);
+	}
+	assert(write(host_fd, buf, len) == (ssize_t)len);
+}
+
+/* Read len bytes of the pattern, slowly, in a child process */
+static pid_t slow_reader(int fd, size_t len)
+{
+	char buf[512];
+	size_t pos;
+	ssize_t rc;
+	pid_t pid;
+	ssize_t i;
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid) {
+		return pid;
+	}
+
+	/* let go of the server's fds, so it's gone once we see EOF */
+	if (dup2(fd, STDIN_FILENO) < 0 || close_range(3, ~0u, 0) ||
+	    fcntl(STDIN_FILENO, F_SETFL, 0)) {
+		_exit(1);
+	}
+	for (pos = 0; pos < len; pos += rc) {
+		usleep(100);
+		rc = read(STDIN_FILENO, buf, sizeof(buf));
+		if (rc <= 0) {
+			_exit(1);
+		}
+		for (i = 0; i < rc; i++) {
+			if (buf[i] != (char)((pos + i) % 251)) {
+				_exit(1);
+			}
+		}
+	}
+	_exit(0);
+}
+
+/* A client that falls behind far enough to fill its spill file is forced to
+ * catch up, one spill window at a time, and survives if it keeps reading */
+void test_spill_full(void)
+{
+	struct socket_consumer_options opts = { .spill = true };
+	struct ringbuffer_consumer *rbc;
+	struct socket_handler *sh;
+	struct pollfd pollfd;
+	const size_t total = 64 * 1024;
+	size_t pos;
+	int status;
+	pid_t pid;
+	int sndbuf;
+	int fd;
+
+	setup_config("spill-max-size = 8k\n");
+
+	/* a small ringbuffer, so we reach the spill file quickly */
+	ringbuffer_fini(console->rb);
+	console->rb = ringbuffer_init(16 * 1024);
+
+	fd = client_connect_opts(&opts);
+	sh = to_socket_handler(console->handlers[0]);
+	assert(sh->n_clients == 1);
+	rbc = sh->clients[0]->rbc;
+	sndbuf = 4096;
+	assert(!setsockopt(sh->clients[0]->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			   sizeof(sndbuf)));
+
+	/* fill the socket, the ringbuffer and half the spill file, stopping
+	 * short of a forced drain, as nobody is reading yet */
+	for (pos = 0; ringbuffer_spill_len(rbc) < 4096; pos += 1024) {
+		assert(pos < total);
+		host_write_pattern(pos, 1024);
+		assert(!run_console_once(console));
+	}
+	assert(!console->rb->n_forced);
+
+	pid = slow_reader(fd, total);
+	close(fd);
+
+	/* the spill file fills, and each write forces the client to take
+	 * more than the spill file offers at once */
+	for (; pos < total; pos += 1024) {
+		host_write_pattern(pos, 1024);
+		assert(!run_console_once(console));
+	}
+	assert(console->rb->n_forced);
+
+	while (sh->n_clients && ringbuffer_len(rbc)) {
+		pollfd.fd = sh->clients[0]->fd;
+		pollfd.events = POLLOUT;
+		assert(poll(&pollfd, 1, -1) == 1);
+		assert(!run_console_once(console));
+	}
+
+	assert(sh->n_clients == 1);
+	assert(!console->rb->n_dropped);
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+	teardown();
+}
+
+int main(void)
+{
+	test_poll_timeout();
+	test_timer_order();
+	test_coalesce();
+	test_coalesce_full();
+	test_low_latency();
+	test_suspend_unsupported();
+	test_spill_allowance();
+	test_transform_limit();
+	test_spill_full();
+	return EXIT_SUCCESS;
+}
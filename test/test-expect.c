@@ -0,0 +1,403 @@
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+#include "ringbuffer.c"
+#include "util.c"
+#include "expect-handler.c"
+
+/* A method call, carrying its arguments */
+struct sd_bus_message {
+	uint64_t mark;
+	const char *pattern;
+	uint32_t timeout;
+	const char *data;
+};
+
+static struct ringbuffer *rb;
+static struct poller timer;
+static struct timeval now;
+
+/* What we've replied with */
+static int n_replies;
+static char reply[256];
+static size_t reply_len;
+static uint64_t reply_mark;
+static const char *reply_error;
+
+static char sent[64];
+static size_t sent_len;
+
+int sd_bus_add_object_vtable(sd_bus *bus __attribute__((unused)),
+			     sd_bus_slot **slot __attribute__((unused)),
+			     const char *path __attribute__((unused)),
+			     const char *interface __attribute__((unused)),
+			     const sd_bus_vtable *vtable __attribute__((unused)),
+			     void *userdata __attribute__((unused)))
+{
+	return 0;
+}
+
+int sd_bus_message_read(sd_bus_message *m, const char *types, ...)
+{
+	va_list ap;
+
+	va_start(ap, types);
+	*va_arg(ap, uint64_t *) = m->mark;
+	if (!strcmp(types, "tsu")) {
+		*va_arg(ap, const char **) = m->pattern;
+		*va_arg(ap, uint32_t *) = m->timeout;
+	}
+	va_end(ap);
+
+	return 1;
+}
+
+int sd_bus_message_read_array(sd_bus_message *m,
+			      char type __attribute__((unused)),
+			      const void **ptr, size_t *size)
+{
+	*ptr = m->data;
+	*size = strlen(m->data);
+	return 1;
+}
+
+int sd_bus_message_new_method_return(sd_bus_message *call,
+				     sd_bus_message **m)
+{
+	*m = call;
+	return 0;
+}
+
+int sd_bus_message_append_array(sd_bus_message *m __attribute__((unused)),
+				char type __attribute__((unused)),
+				const void *ptr, size_t size)
+{
+	assert(size < sizeof(reply));
+	memcpy(reply, ptr, size);
+	reply_len = size;
+	return 0;
+}
+
+int sd_bus_send(sd_bus *bus __attribute__((unused)),
+		sd_bus_message *m __attribute__((unused)),
+		uint64_t *cookie __attribute__((unused)))
+{
+	n_replies++;
+	return 0;
+}
+
+sd_bus_message *sd_bus_message_ref(sd_bus_message *m)
+{
+	return m;
+}
+
+sd_bus_message *sd_bus_message_unref(sd_bus_message *m __attribute__((unused)))
+{
+	return NULL;
+}
+
+int sd_bus_reply_method_return(sd_bus_message *call __attribute__((unused)),
+			       const char *types, ...)
+{
+	va_list ap;
+
+	if (types && !strcmp(types, "t")) {
+		va_start(ap, types);
+		reply_mark = va_arg(ap, uint64_t);
+		va_end(ap);
+	}
+	n_replies++;
+	return 0;
+}
+
+int sd_bus_error_set_const(sd_bus_error *e, const char *name,
+			   const char *message)
+{
+	e->name = name;
+	e->message = message;
+	return -EINVAL;
+}
+
+int sd_bus_reply_method_error(sd_bus_message *call __attribute__((unused)),
+			      const sd_bus_error *e)
+{
+	reply_error = e->message;
+	n_replies++;
+	return 0;
+}
+
+int console_data_out(struct console *console __attribute__((unused)),
+		     const uint8_t *data, size_t len)
+{
+	memcpy(sent + sent_len, data, len);
+	sent_len += len;
+	return 0;
+}
+
+struct poller *
+console_poller_register(struct console *console __attribute__((unused)),
+			struct handler *handler,
+			poller_event_fn_t poller_fn __attribute__((unused)),
+			poller_timeout_fn_t timeout_fn, int fd,
+			int events __attribute__((unused)), void *data)
+{
+	assert(fd == -1);
+	timer.handler = handler;
+	timer.timeout_fn = timeout_fn;
+	timer.data = data;
+	return &timer;
+}
+
+void console_poller_unregister(struct console *console __attribute__((unused)),
+			       struct poller *poller __attribute__((unused)))
+{
+}
+
+void console_poller_set_timeout(struct console *console __attribute__((unused)),
+				struct poller *poller,
+				const struct timeval *tv)
+{
+	timeradd(&now, tv, &poller->timeout);
+}
+
+int get_current_time(struct timeval *tv)
+{
+	*tv = now;
+	return 0;
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *console __attribute__((unused)),
+	struct handler *handler __attribute__((unused)),
+	const char *spec __attribute__((unused)),
+	ringbuffer_push_fn_t push_fn, void *data)
+{
+	return ringbuffer_consumer_register_push(rb, push_fn, data);
+}
+
+void console_interactive_get(struct console *console __attribute__((unused)))
+{
+}
+
+void console_interactive_put(struct console *console __attribute__((unused)))
+{
+}
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size __attribute__((unused)))
+{
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size __attribute__((unused)))
+{
+}
+
+static struct expect_handler *setup(const char *config_str)
+{
+	struct expect_handler *eh = &expect_handler;
+	struct config *config;
+	char *buf;
+	int rc;
+
+	rb = ringbuffer_init(256);
+	timerclear(&now);
+	timerclear(&timer.timeout);
+	n_replies = 0;
+	reply_error = NULL;
+	sent_len = 0;
+
+	/* config_parse() modifies its buffer */
+	buf = strdup(config_str);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	rc = eh->handler.init(&eh->handler, NULL, config);
+	assert(!rc);
+	config_fini(config);
+
+	return eh;
+}
+
+static void teardown(struct expect_handler *eh)
+{
+	eh->handler.fini(&eh->handler);
+	ringbuffer_fini(rb);
+}
+
+static void output(const char *str)
+{
+	assert(!ringbuffer_queue(rb, (uint8_t *)str, strlen(str)));
+}
+
+static uint64_t mark(struct expect_handler *eh)
+{
+	struct sd_bus_message msg = { 0 };
+
+	method_mark(&msg, eh, NULL);
+	return reply_mark;
+}
+
+static void wait_for(struct expect_handler *eh, uint64_t from,
+		     const char *pattern, uint32_t timeout)
+{
+	struct sd_bus_message msg = {
+		.mark = from,
+		.pattern = pattern,
+		.timeout = timeout,
+	};
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	method_wait_for(&msg, eh, &err);
+}
+
+static void check_reply(const char *exp)
+{
+	assert(!reply_error);
+	assert(reply_len == strlen(exp));
+	assert(!memcmp(reply, exp, reply_len));
+}
+
+/* The pattern is already in the output since the mark */
+void test_expect_immediate(void)
+{
+	struct expect_handler *eh = setup("expect = true\n");
+	uint64_t m;
+
+	output("old login: ");
+	m = mark(eh);
+	assert(m == 11);
+
+	output("root\r\nPassword: ");
+	wait_for(eh, m, "Password:", 1000);
+	assert(n_replies == 2);
+	check_reply("root\r\nPassword:");
+	assert(!eh->n_waiters);
+
+	teardown(eh);
+}
+
+/* The pattern arrives later, split across writes */
+void test_expect_async(void)
+{
+	struct expect_handler *eh = setup("expect = true\n");
+	uint64_t m;
+
+	m = mark(eh);
+	wait_for(eh, m, "login:", 1000);
+	assert(n_replies == 1);
+	assert(eh->n_waiters == 1);
+	assert(timerisset(&timer.timeout));
+
+	output("Welcome\r\nhost log");
+	assert(n_replies == 1);
+	output("in: ");
+	assert(n_replies == 2);
+	check_reply("Welcome\r\nhost login:");
+	assert(!eh->n_waiters);
+	assert(!timerisset(&timer.timeout));
+
+	teardown(eh);
+}
+
+void test_expect_timeout(void)
+{
+	struct expect_handler *eh = setup("expect = true\n");
+
+	wait_for(eh, mark(eh), "# ", 500);
+	output("still booting\r\n");
+	assert(eh->n_waiters == 1);
+	assert(timer.timeout.tv_usec == 500000);
+
+	now.tv_sec = 1;
+	timer.timeout_fn(timer.handler, timer.data);
+	assert(n_replies == 2);
+	assert(reply_error);
+	assert(!eh->n_waiters);
+
+	teardown(eh);
+}
+
+/* Output beyond the window discards the start of a capture */
+void test_expect_discard(void)
+{
+	struct expect_handler *eh = setup("expect = true\nexpect-buffer-size = 16\n");
+	struct sd_bus_message msg = { 0 };
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+	uint64_t m;
+
+	m = mark(eh);
+	wait_for(eh, m, "never", 1000);
+	output("0123456789");
+	output("0123456789");
+	output("0123456789");
+	assert(n_replies == 1);
+
+	/* the buffer is full, so we move the last 16 bytes down */
+	output("0123456789");
+	assert(n_replies == 2);
+	assert(reply_error);
+	assert(!eh->n_waiters);
+
+	reply_error = NULL;
+	msg.mark = 24;
+	method_capture(&msg, eh, &err);
+	check_reply("4567890123456789");
+
+	msg.mark = 23;
+	method_capture(&msg, eh, &err);
+	assert(reply_error);
+
+	teardown(eh);
+}
+
+void test_expect_send(void)
+{
+	struct expect_handler *eh = setup("expect = true\n");
+	struct sd_bus_message msg = { .data = "reboot\r" };
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	method_send(&msg, eh, &err);
+	assert(sent_len == 7);
+	assert(!memcmp(sent, "reboot\r", 7));
+
+	teardown(eh);
+}
+
+/* Without the expect key, we don't keep a window at all */
+void test_expect_disabled(void)
+{
+	struct expect_handler *eh = &expect_handler;
+	struct config *config;
+
+	rb = ringbuffer_init(256);
+	config = calloc(1, sizeof(*config));
+	assert(eh->handler.init(&eh->handler, NULL, config));
+	assert(!rb->n_consumers);
+	config_fini(config);
+	ringbuffer_fini(rb);
+}
+
+int main(void)
+{
+	test_expect_disabled();
+	test_expect_immediate();
+	test_expect_async();
+	test_expect_timeout();
+	test_expect_discard();
+	test_expect_send();
+	return EXIT_SUCCESS;
+}
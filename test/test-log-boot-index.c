@@ -0,0 +1,294 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR
+#endif
+
+#include "config.c"
+#include "ringbuffer.c"
+#include "util.c"
+#include "log-handler.c"
+
+static struct ringbuffer *rb;
+
+/* The D-Bus interface isn't under test */
+int sd_bus_add_object_vtable(sd_bus *bus __attribute__((unused)),
+			     sd_bus_slot **slot __attribute__((unused)),
+			     const char *path __attribute__((unused)),
+			     const char *interface __attribute__((unused)),
+			     const sd_bus_vtable *vtable __attribute__((unused)),
+			     void *userdata __attribute__((unused)))
+{
+	return 0;
+}
+
+int sd_bus_message_read(sd_bus_message *m __attribute__((unused)),
+			const char *types __attribute__((unused)), ...)
+{
+	return -EINVAL;
+}
+
+int sd_bus_reply_method_return(sd_bus_message *call __attribute__((unused)),
+			       const char *types __attribute__((unused)), ...)
+{
+	return -EINVAL;
+}
+
+int sd_bus_error_set_const(sd_bus_error *e __attribute__((unused)),
+			   const char *name __attribute__((unused)),
+			   const char *message __attribute__((unused)))
+{
+	return -EINVAL;
+}
+
+int sd_bus_reply_method_error(sd_bus_message *call __attribute__((unused)),
+			      const sd_bus_error *e __attribute__((unused)))
+{
+	return -EINVAL;
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *console __attribute__((unused)),
+	struct handler *handler __attribute__((unused)),
+	const char *spec __attribute__((unused)),
+	ringbuffer_push_fn_t push_fn, void *data)
+{
+	return ringbuffer_consumer_register_push(rb, push_fn, data);
+}
+
+static struct poller timer;
+
+struct poller *
+console_poller_register(struct console *console __attribute__((unused)),
+			struct handler *handler,
+			poller_event_fn_t poller_fn __attribute__((unused)),
+			poller_timeout_fn_t timeout_fn, int fd,
+			int events __attribute__((unused)), void *data)
+{
+	assert(fd == -1);
+	timer.handler = handler;
+	timer.timeout_fn = timeout_fn;
+	timer.data = data;
+	return &timer;
+}
+
+void console_poller_unregister(struct console *console __attribute__((unused)),
+			       struct poller *poller __attribute__((unused)))
+{
+}
+
+void console_poller_set_timeout(struct console *console __attribute__((unused)),
+				struct poller *poller,
+				const struct timeval *tv)
+{
+	poller->timeout = *tv;
+}
+
+/* Batching while idle isn't under test */
+bool console_idle(struct console *console __attribute__((unused)))
+{
+	return false;
+}
+
+static char dir[] = "/tmp/test-log-boot-index.XXXXXX";
+
+static struct log_handler *setup(void)
+{
+	struct log_handler *lh = &log_handler;
+	struct config *config;
+	char *buf;
+	int rc;
+
+	rb = ringbuffer_init(4096);
+	assert(mkdtemp(dir));
+	rc = asprintf(&buf,
+		      "logfile = %s/console.log\n"
+		      "logsize = 5k\n"
+		      "boot-marker = BOOT>|Linux version\n",
+		      dir);
+	assert(rc > 0);
+
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	rc = lh->handler.init(&lh->handler, NULL, config);
+	assert(!rc);
+	config_fini(config);
+
+	return lh;
+}
+
+static void teardown(struct log_handler *lh)
+{
+	unlink(lh->log_filename);
+	unlink(lh->rotate_filename);
+	unlink(lh->index_filename);
+	lh->handler.fini(&lh->handler);
+
+	rmdir(dir);
+	ringbuffer_fini(rb);
+}
+
+static void log_str(struct log_handler *lh, const char *str)
+{
+	assert(!log_data(lh, (uint8_t *)str, strlen(str)));
+}
+
+/* Queue str for the handler, as the console would */
+static void log_queue(const char *str)
+{
+	assert(!ringbuffer_queue(rb, (uint8_t *)str, strlen(str)));
+}
+
+static void log_fill(struct log_handler *lh, char c, size_t len)
+{
+	char *buf = malloc(len + 1);
+
+	memset(buf, c, len);
+	buf[len] = '\0';
+	log_str(lh, buf);
+	free(buf);
+}
+
+static void check_boot(struct log_handler *lh, unsigned int n,
+		       const char *exp, size_t exp_len)
+{
+	struct stat statbuf;
+	char *buf;
+	int fd;
+
+	fd = log_handler_boot_log(&lh->handler, n);
+	assert(fd >= 0);
+	assert(!fstat(fd, &statbuf));
+	assert((size_t)statbuf.st_size == exp_len);
+
+	buf = malloc(exp_len);
+	assert(read(fd, buf, exp_len) == (ssize_t)exp_len);
+	assert(!memcmp(buf, exp, exp_len));
+
+	free(buf);
+	close(fd);
+}
+
+/* Check a boot consisting of prefix, then fill_len bytes of each of fills */
+static void check_boot_fill(struct log_handler *lh, unsigned int n,
+			    const char *prefix, const char *fills,
+			    size_t fill_len)
+{
+	size_t prefix_len = strlen(prefix);
+	size_t len;
+	char *exp;
+	size_t i;
+
+	len = prefix_len + strlen(fills) * fill_len;
+	exp = malloc(len);
+	memcpy(exp, prefix, prefix_len);
+	for (i = 0; fills[i]; i++) {
+		memset(exp + prefix_len + i * fill_len, fills[i], fill_len);
+	}
+
+	check_boot(lh, n, exp, len);
+	free(exp);
+}
+
+static void check_index_file(struct log_handler *lh)
+{
+	struct log_index_header hdr;
+	struct log_boot boot;
+	struct stat statbuf;
+	size_t i;
+	int fd;
+
+	fd = open(lh->index_filename, O_RDONLY);
+	assert(fd >= 0);
+	assert(!fstat(fd, &statbuf));
+	assert((size_t)statbuf.st_size ==
+	       sizeof(hdr) + lh->n_boots * sizeof(boot));
+
+	assert(read(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+	assert(le32toh(hdr.magic) == LOG_INDEX_MAGIC);
+	assert(le32toh(hdr.version) == LOG_INDEX_VERSION);
+	assert(le64toh(hdr.rotate_base) == lh->rotate_base);
+	assert(le64toh(hdr.current_base) == lh->current_base);
+
+	for (i = 0; i < lh->n_boots; i++) {
+		assert(read(fd, &boot, sizeof(boot)) == sizeof(boot));
+		assert(le64toh(boot.offset) == lh->boots[i].offset);
+	}
+
+	close(fd);
+}
+
+int main(void)
+{
+	struct log_handler *lh;
+	int fd;
+
+	lh = setup();
+
+	/* markers split across writes, and a second pattern */
+	log_str(lh, "junk BO");
+	log_str(lh, "OT>one\n");
+	log_str(lh, "[    0.000000] Linux vers");
+	log_str(lh, "ion 6.6\n");
+	assert(lh->n_boots == 2);
+	assert(lh->boots[0].offset == 5);
+	assert(lh->boots[1].offset == 29);
+
+	check_boot_fill(lh, 0, "Linux version 6.6\n", "", 0);
+	check_boot_fill(lh, 1, "BOOT>one\n[    0.000000] ", "", 0);
+	assert(log_handler_boot_log(&lh->handler, 2) == -ENOENT);
+	check_index_file(lh);
+
+	/* a boot that spans the rotate file and the current log */
+	log_fill(lh, 'a', 3000);
+	log_str(lh, "BOOT>three");
+	log_fill(lh, 'b', 3000);
+	assert(lh->current_base == 3057);
+	check_boot_fill(lh, 0, "BOOT>three", "b", 3000);
+	check_boot_fill(lh, 1, "Linux version 6.6\n", "a", 3000);
+	check_index_file(lh);
+
+	/* rotate again: the boot in progress is clamped to the rotate file */
+	log_fill(lh, 'c', 3000);
+	assert(lh->rotate_base == 3057);
+	assert(lh->n_boots == 1);
+	assert(lh->boots[0].offset == 3057);
+	check_boot_fill(lh, 0, "", "bc", 3000);
+	assert(log_handler_boot_log(&lh->handler, 1) == -ENOENT);
+	check_index_file(lh);
+
+	/* a failed write drops the consumer, and a suspend and resume brings
+	 * it back, without a marker spanning the gap */
+	fd = lh->fd;
+	lh->fd = open("/dev/null", O_RDONLY);
+	assert(lh->fd >= 0);
+	log_queue("junk BO");
+	assert(!lh->rbc);
+	close(lh->fd);
+	lh->fd = fd;
+
+	lh->handler.suspend(&lh->handler);
+	assert(!lh->handler.resume(&lh->handler));
+	assert(!lh->handler.resume(&lh->handler));
+	assert(rb->n_consumers == 1);
+
+	log_queue("OT>no BOOT>four\n");
+	assert(lh->n_boots == 2);
+	check_boot_fill(lh, 0, "BOOT>four\n", "", 0);
+
+	teardown(lh);
+
+	return EXIT_SUCCESS;
+}
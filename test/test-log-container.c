@@ -0,0 +1,328 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+#include "ringbuffer.c"
+#include "util.c"
+#include "log-container-handler.c"
+
+struct poller *
+console_poller_register(struct console *console __attribute__((unused)),
+			struct handler *handler, poller_event_fn_t poller_fn,
+			poller_timeout_fn_t timeout_fn, int fd,
+			int events __attribute__((unused)), void *data)
+{
+	struct poller *poller;
+
+	assert(fd >= 0);
+	poller = calloc(1, sizeof(*poller));
+	poller->handler = handler;
+	poller->event_fn = poller_fn;
+	poller->timeout_fn = timeout_fn;
+	poller->data = data;
+	return poller;
+}
+
+void console_poller_unregister(struct console *console __attribute__((unused)),
+			       struct poller *poller)
+{
+	free(poller);
+}
+
+void console_poller_set_events(struct console *console __attribute__((unused)),
+			       struct poller *poller __attribute__((unused)),
+			       int events __attribute__((unused)))
+{
+}
+
+void console_poller_set_timeout(struct console *console __attribute__((unused)),
+				struct poller *poller,
+				const struct timeval *tv)
+{
+	poller->timeout = *tv;
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *console, struct handler *handler __attribute__((unused)),
+	const char *spec __attribute__((unused)), ringbuffer_push_fn_t push_fn,
+	void *data)
+{
+	return ringbuffer_consumer_register_push(console->rb, push_fn, data);
+}
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size __attribute__((unused)))
+{
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size __attribute__((unused)))
+{
+}
+
+/* A server, with its own console and instance of the handler */
+struct server {
+	struct console console;
+	struct log_container lc;
+};
+
+static char dir[32];
+static char path[64];
+
+static void server_init(struct server *server, const char *id)
+{
+	struct config *config;
+	char *buf;
+	int rc;
+
+	memset(server, 0, sizeof(*server));
+	server->console.console_id = id;
+	server->console.rb = ringbuffer_init(4096);
+	server->lc.handler = log_container.handler;
+
+	rc = asprintf(&buf, "log-container = %s\n", path);
+	assert(rc > 0);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	rc = server->lc.handler.init(&server->lc.handler, &server->console,
+				     config);
+	assert(!rc);
+	config_fini(config);
+}
+
+static void server_fini(struct server *server)
+{
+	server->lc.handler.fini(&server->lc.handler);
+	ringbuffer_fini(server->console.rb);
+}
+
+static void output(struct server *server, const char *str)
+{
+	assert(!ringbuffer_queue(server->console.rb, (uint8_t *)str,
+				 strlen(str)));
+}
+
+/* Run the writer's poller, as run_console() would */
+static void receive(struct server *server)
+{
+	struct poller *poller = server->lc.poller;
+
+	poller->event_fn(poller->handler, POLLIN, poller->data);
+}
+
+static void flush(struct server *server)
+{
+	struct poller *poller = server->lc.poller;
+
+	assert(timerisset(&poller->timeout));
+	timerclear(&poller->timeout);
+	poller->timeout_fn(poller->handler, poller->data);
+}
+
+/* Check the container holds exactly these records, as "id:data" */
+static void check_records(const char *const *exp)
+{
+	struct log_record rec;
+	uint8_t buf[8192];
+	size_t off = 0;
+	ssize_t len;
+	char str[64];
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	assert(fd >= 0);
+	len = read(fd, buf, sizeof(buf));
+	assert(len >= 0);
+	close(fd);
+
+	for (; *exp; exp++) {
+		assert(off + sizeof(rec) <= (size_t)len);
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+		assert(le32toh(rec.magic) == LOG_RECORD_MAGIC);
+		assert(rec.time_us);
+
+		snprintf(str, sizeof(str), "%.*s:%.*s", le16toh(rec.id_len),
+			 buf + off, le16toh(rec.data_len),
+			 buf + off + le16toh(rec.id_len));
+		assert(!strcmp(str, *exp));
+		off += le16toh(rec.id_len) + le16toh(rec.data_len);
+	}
+
+	assert(off == (size_t)len);
+}
+
+static void setup(void)
+{
+	strcpy(dir, "/tmp/test-lc.XXXXXX");
+	assert(mkdtemp(dir));
+	snprintf(path, sizeof(path), "%s/console.log", dir);
+}
+
+static void teardown(void)
+{
+	char rotated[80];
+
+	snprintf(rotated, sizeof(rotated), "%s.1", path);
+	unlink(rotated);
+	unlink(path);
+	rmdir(dir);
+}
+
+/* The first server writes, and batches the others' records with its own */
+void test_log_container_batch(void)
+{
+	const char *exp[] = { "a:one", "b:two", "a:three", NULL };
+	struct server a;
+	struct server b;
+
+	setup();
+	server_init(&a, "a");
+	server_init(&b, "b");
+	assert(a.lc.writer);
+	assert(!b.lc.writer);
+
+	output(&a, "one");
+	output(&b, "two");
+	receive(&a);
+	output(&a, "three");
+
+	/* nothing is written until the batch is flushed */
+	check_records((const char *const[]){ NULL });
+	flush(&a);
+	check_records(exp);
+
+	server_fini(&b);
+	server_fini(&a);
+	teardown();
+}
+
+/* When the writer exits, another server takes over */
+void test_log_container_handover(void)
+{
+	const char *exp[] = { "a:one", "b:two", "b:three", NULL };
+	struct server a;
+	struct server b;
+
+	setup();
+	server_init(&a, "a");
+	server_init(&b, "b");
+
+	output(&a, "one");
+	output(&b, "two");
+	server_fini(&a);
+
+	output(&b, "three");
+	assert(b.lc.writer);
+	server_fini(&b);
+	check_records(exp);
+
+	teardown();
+}
+
+/* A suspended server stops recording, but the writer still writes */
+void test_log_container_suspend(void)
+{
+	const char *exp[] = { "a:one", "b:two", "a:three", NULL };
+	struct server a;
+	struct server b;
+
+	setup();
+	server_init(&a, "a");
+	server_init(&b, "b");
+
+	output(&a, "one");
+	b.lc.handler.suspend(&b.lc.handler);
+	output(&b, "missed");
+	assert(!b.lc.handler.resume(&b.lc.handler));
+	output(&b, "two");
+
+	a.lc.handler.suspend(&a.lc.handler);
+	assert(a.lc.writer);
+	output(&a, "lost");
+	receive(&a);
+	assert(!a.lc.handler.resume(&a.lc.handler));
+	output(&a, "three");
+
+	flush(&a);
+	check_records(exp);
+
+	server_fini(&b);
+	server_fini(&a);
+	teardown();
+}
+
+/* Anyone can send to the container's socket; only our user is heard */
+void test_log_container_creds(void)
+{
+	const char *exp[] = { "a:one", "x:mine", NULL };
+	struct ucred cred = { .pid = getpid(), .uid = 65534, .gid = 65534 };
+	uint8_t cbuf[CMSG_SPACE(sizeof(cred))];
+	uint8_t buf[LOG_RECORD_MAX];
+	struct log_record rec;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct server a;
+	int sd;
+
+	setup();
+	server_init(&a, "a");
+	output(&a, "one");
+
+	sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	assert(sd >= 0);
+	assert(!connect(sd, (struct sockaddr *)&a.lc.addr, a.lc.addrlen));
+
+	lc_record_init(&rec, 1, 4);
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), "xmine", 5);
+	assert(send(sd, buf, sizeof(rec) + 5, 0) == (ssize_t)sizeof(rec) + 5);
+
+	/* only root can claim to be someone else */
+	if (!geteuid()) {
+		memcpy(buf + sizeof(rec), "yfake", 5);
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(rec) + 5;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_CREDENTIALS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+		memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+		assert(sendmsg(sd, &msg, 0) == (ssize_t)iov.iov_len);
+	}
+
+	receive(&a);
+	flush(&a);
+	check_records(exp);
+
+	close(sd);
+	server_fini(&a);
+	teardown();
+}
+
+int main(void)
+{
+	test_log_container_batch();
+	test_log_container_handover();
+	test_log_container_suspend();
+	test_log_container_creds();
+	return EXIT_SUCCESS;
+}
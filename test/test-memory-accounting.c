@@ -0,0 +1,110 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#define MEM_SHM_NAME "/obmc-console-memory-test"
+
+#include "config.c"
+#include "memory.c"
+
+static void console_init_config(struct console *console, const char *str)
+{
+	struct config *config;
+	char *buf;
+
+	memset(console, 0, sizeof(*console));
+
+	config = calloc(1, sizeof(*config));
+	buf = strdup(str);
+	config_parse(config, buf);
+	free(buf);
+
+	assert(!console_mem_init(console, config));
+	config_fini(config);
+}
+
+static void test_memory_unlimited(void)
+{
+	struct console console;
+
+	console_init_config(&console, "");
+	assert(!console_mem_charge(&console, SIZE_MAX / 2));
+	assert(console.mem.used == SIZE_MAX / 2);
+	console_mem_uncharge(&console, SIZE_MAX / 2);
+	assert(console.mem.used == 0);
+	console_mem_fini(&console);
+}
+
+static void test_memory_limit(void)
+{
+	struct console console;
+
+	console_init_config(&console, "memory-limit = 4k");
+	assert(console.mem.limit == 4096);
+	assert(!console_mem_charge(&console, 4000));
+	assert(console_mem_charge(&console, 97) == -ENOMEM);
+	assert(console.mem.used == 4000);
+	assert(!console_mem_charge(&console, 96));
+	console_mem_uncharge(&console, 4000);
+	assert(!console_mem_charge(&console, 1000));
+	assert(console.mem.used == 1096);
+	console_mem_fini(&console);
+}
+
+static void test_memory_invalid_limit(void)
+{
+	struct console console = { 0 };
+	struct config *config;
+	char *buf;
+
+	config = calloc(1, sizeof(*config));
+	buf = strdup("memory-limit = lots");
+	config_parse(config, buf);
+	free(buf);
+
+	assert(console_mem_init(&console, config));
+	config_fini(config);
+}
+
+static void test_memory_global_limit(void)
+{
+	struct console a;
+	struct console b;
+
+	shm_unlink(MEM_SHM_NAME);
+
+	console_init_config(&a, "global-memory-limit = 8k");
+	console_init_config(&b, "global-memory-limit = 8k");
+	assert(a.mem.slot && b.mem.slot && a.mem.slot != b.mem.slot);
+
+	assert(!console_mem_charge(&a, 5000));
+	assert(console_mem_global_used(&b) == 5000);
+	assert(console_mem_charge(&b, 4000) == -ENOMEM);
+	assert(!console_mem_charge(&b, 3000));
+	assert(console_mem_global_used(&a) == 8000);
+
+	/* a console going away releases its share */
+	console_mem_fini(&a);
+	assert(console_mem_global_used(&b) == 3000);
+	assert(!console_mem_charge(&b, 5000));
+
+	console_mem_fini(&b);
+	shm_unlink(MEM_SHM_NAME);
+}
+
+int main(void)
+{
+	test_memory_unlimited();
+	test_memory_limit();
+	test_memory_invalid_limit();
+	test_memory_global_limit();
+	return EXIT_SUCCESS;
+}
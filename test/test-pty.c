@@ -0,0 +1,223 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR
+#endif
+
+#include "config.c"
+#include "ringbuffer.c"
+#include "util.c"
+#include "pty-handler.c"
+
+static struct ringbuffer *rb;
+static struct console console;
+
+static struct poller pollers[2];
+static int n_interactive;
+
+static char typed[64];
+static size_t typed_len;
+
+struct poller *
+console_poller_register(struct console *c __attribute__((unused)),
+			struct handler *handler, poller_event_fn_t poller_fn,
+			poller_timeout_fn_t timeout_fn __attribute__((unused)),
+			int fd, int events __attribute__((unused)), void *data)
+{
+	struct poller *poller;
+
+	/* the inotify fd is registered first, then the pty master */
+	poller = fd == pty_handler.inotify_fd ? &pollers[0] : &pollers[1];
+	assert(!poller->event_fn);
+	poller->handler = handler;
+	poller->event_fn = poller_fn;
+	poller->data = data;
+	return poller;
+}
+
+void console_poller_unregister(struct console *c __attribute__((unused)),
+			       struct poller *poller)
+{
+	poller->event_fn = NULL;
+}
+
+void console_poller_set_events(struct console *c __attribute__((unused)),
+			       struct poller *poller __attribute__((unused)),
+			       int events __attribute__((unused)))
+{
+}
+
+int console_data_out(struct console *c __attribute__((unused)),
+		     const uint8_t *data, size_t len)
+{
+	assert(typed_len + len <= sizeof(typed));
+	memcpy(typed + typed_len, data, len);
+	typed_len += len;
+	return 0;
+}
+
+struct ringbuffer_consumer *console_ringbuffer_consumer_register_push(
+	struct console *c __attribute__((unused)),
+	struct handler *handler __attribute__((unused)),
+	const char *spec __attribute__((unused)),
+	ringbuffer_push_fn_t push_fn, void *data)
+{
+	return ringbuffer_consumer_register_push(rb, push_fn, data);
+}
+
+void console_interactive_get(struct console *c __attribute__((unused)))
+{
+	n_interactive++;
+}
+
+void console_interactive_put(struct console *c __attribute__((unused)))
+{
+	n_interactive--;
+}
+
+static char dir[32];
+static char link_path[64];
+
+static struct pty_handler *setup(void)
+{
+	struct pty_handler *ph = &pty_handler;
+	struct config *config;
+	char *buf;
+	int rc;
+
+	rb = ringbuffer_init(4096);
+	strcpy(dir, "/tmp/test-pty.XXXXXX");
+	assert(mkdtemp(dir));
+	snprintf(link_path, sizeof(link_path), "%s/console", dir);
+
+	rc = asprintf(&buf, "local-pty = true\nlocal-pty-link = %s\n",
+		      link_path);
+	assert(rc > 0);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	rc = ph->handler.init(&ph->handler, &console, config);
+	assert(!rc);
+	config_fini(config);
+
+	return ph;
+}
+
+static void teardown(struct pty_handler *ph)
+{
+	ph->handler.fini(&ph->handler);
+	assert(access(link_path, F_OK));
+	ringbuffer_fini(rb);
+	rmdir(dir);
+}
+
+/* Run the poller for an fd, as run_console() would */
+static enum poller_ret run_poller(struct poller *poller, int fd)
+{
+	struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+	enum poller_ret prc;
+
+	assert(poll(&pollfd, 1, 1000) == 1);
+	prc = poller->event_fn(poller->handler, pollfd.revents, poller->data);
+	if (prc == POLLER_REMOVE) {
+		poller->event_fn = NULL;
+	}
+
+	return prc;
+}
+
+static int open_slave(struct pty_handler *ph)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	/* the link points at the slave */
+	assert(realpath(link_path, path));
+	assert(!strcmp(path, ph->slave_path));
+
+	fd = open(link_path, O_RDWR | O_NOCTTY);
+	assert(fd >= 0);
+
+	assert(run_poller(&pollers[0], ph->inotify_fd) == POLLER_OK);
+	assert(ph->poller == &pollers[1]);
+	assert(n_interactive == 1);
+
+	return fd;
+}
+
+static void close_slave(struct pty_handler *ph, int fd)
+{
+	close(fd);
+
+	assert(run_poller(&pollers[1], ph->fd) == POLLER_REMOVE);
+	assert(!ph->poller);
+	assert(!ph->rbc);
+	assert(!n_interactive);
+}
+
+void test_pty_attach(void)
+{
+	struct pty_handler *ph = setup();
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	/* nobody's attached, so we don't consume output */
+	assert(!ringbuffer_queue(rb, (uint8_t *)"lost", 4));
+	assert(!ph->rbc);
+	assert(!n_interactive);
+
+	fd = open_slave(ph);
+
+	assert(!ringbuffer_queue(rb, (uint8_t *)"login: ", 7));
+	len = read(fd, buf, sizeof(buf));
+	assert(len == 7);
+	assert(!memcmp(buf, "login: ", 7));
+
+	assert(write(fd, "root\r", 5) == 5);
+	assert(run_poller(&pollers[1], ph->fd) == POLLER_OK);
+	assert(typed_len == 5);
+	assert(!memcmp(typed, "root\r", 5));
+
+	close_slave(ph, fd);
+	teardown(ph);
+}
+
+/* Users come and go without disturbing the pty */
+void test_pty_reattach(void)
+{
+	struct pty_handler *ph = setup();
+	char buf[64];
+	int fd;
+
+	fd = open_slave(ph);
+	close_slave(ph, fd);
+
+	assert(!ringbuffer_queue(rb, (uint8_t *)"missed", 6));
+
+	fd = open_slave(ph);
+	assert(!ringbuffer_queue(rb, (uint8_t *)"seen", 4));
+	assert(read(fd, buf, sizeof(buf)) == 4);
+	assert(!memcmp(buf, "seen", 4));
+	close_slave(ph, fd);
+
+	teardown(ph);
+}
+
+int main(void)
+{
+	test_pty_attach();
+	test_pty_reattach();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#define MEM_SHM_NAME "/obmc-console-ringbuffer-memory-test"
+
+#include "config.c"
+#include "memory.c"
+#include "ringbuffer.c"
+#include "ringbuffer-test-utils.c"
+
+#define RB_SIZE 64
+#define RBC_SIZE sizeof(struct ringbuffer_consumer)
+
+static void console_init_config(struct console *console, const char *str)
+{
+	struct config *config;
+	char *buf;
+
+	memset(console, 0, sizeof(*console));
+
+	config = calloc(1, sizeof(*config));
+	buf = strdup(str);
+	config_parse(config, buf);
+	free(buf);
+
+	assert(!console_mem_init(console, config));
+	config_fini(config);
+
+	/* as console-server charges for its ringbuffer */
+	console->rb = ringbuffer_init(RB_SIZE);
+	assert(!console_mem_charge(console, console->rb->size));
+}
+
+static void console_fini(struct console *console)
+{
+	console_mem_uncharge(console, console->rb->size);
+	ringbuffer_fini(console->rb);
+	assert(!console->mem.used);
+	console_mem_fini(console);
+}
+
+/* Register a consumer charged to the console, as the handlers do */
+static int consumer_register(struct console *console, struct rb_test_ctx *ctx)
+{
+	if (console_mem_charge(console, RBC_SIZE)) {
+		return -1;
+	}
+
+	ctx->rbc = ringbuffer_consumer_register(console->rb,
+						ringbuffer_poll_append_all, ctx);
+	assert(ctx->rbc);
+
+	return 0;
+}
+
+static void consumer_unregister(struct console *console,
+				struct rb_test_ctx *ctx)
+{
+	ringbuffer_consumer_unregister(ctx->rbc);
+	console_mem_uncharge(console, RBC_SIZE);
+	ctx->rbc = NULL;
+}
+
+/* The console's share of the shared segment always matches its own count */
+static void check_used(struct console *console, size_t used)
+{
+	assert(console->mem.used == used);
+	assert(__atomic_load_n(&console->mem.slot->used, __ATOMIC_ACQUIRE) ==
+	       used);
+}
+
+/* Memory is accounted by capacity: queueing, forced drains and dequeues
+ * leave it alone, while consumers charge for themselves until removed */
+void test_memory_consumers(void)
+{
+	uint8_t in_buf[RB_SIZE / 2];
+	struct rb_test_ctx ctx_a;
+	struct rb_test_ctx ctx_b;
+	struct console console;
+	size_t used;
+	int i;
+
+	shm_unlink(MEM_SHM_NAME);
+
+	console_init_config(&console, "memory-limit = 1k\n"
+				      "global-memory-limit = 1k\n");
+	check_used(&console, RB_SIZE);
+
+	ringbuffer_test_context_init(&ctx_a);
+	ringbuffer_test_context_init(&ctx_b);
+
+	assert(!consumer_register(&console, &ctx_a));
+	check_used(&console, RB_SIZE + RBC_SIZE);
+	assert(!consumer_register(&console, &ctx_b));
+	used = RB_SIZE + 2 * RBC_SIZE;
+	check_used(&console, used);
+	assert(console_mem_global_used(&console) == used);
+
+	/* b only drains when forced, so it lags behind a */
+	ctx_b.force_only = true;
+	memset(in_buf, 'x', sizeof(in_buf));
+	for (i = 0; i < 8; i++) {
+		assert(!ringbuffer_queue(console.rb, in_buf, sizeof(in_buf)));
+		check_used(&console, used);
+	}
+	assert(ctx_a.len == 8 * sizeof(in_buf));
+	assert(ctx_b.count);
+	assert(ringbuffer_len(ctx_b.rbc));
+
+	/* dequeueing the rest of b's backlog frees nothing either */
+	assert(!ringbuffer_dequeue_commit(ctx_b.rbc,
+					  ringbuffer_len(ctx_b.rbc)));
+	assert(!ringbuffer_len(ctx_b.rbc));
+	check_used(&console, used);
+
+	/* the limit holds consumers back */
+	while (console.mem.used + RBC_SIZE <= console.mem.limit) {
+		assert(!console_mem_charge(&console, RBC_SIZE));
+		used += RBC_SIZE;
+	}
+	assert(consumer_register(&console, &ctx_a) < 0);
+	check_used(&console, used);
+
+	/* removing a consumer returns its charge */
+	consumer_unregister(&console, &ctx_a);
+	used -= RBC_SIZE;
+	check_used(&console, used);
+	assert(console_mem_global_used(&console) == used);
+
+	consumer_unregister(&console, &ctx_b);
+	used -= RBC_SIZE;
+	console_mem_uncharge(&console, used - RB_SIZE);
+	check_used(&console, RB_SIZE);
+
+	console_fini(&console);
+	ringbuffer_test_context_fini(&ctx_a);
+	ringbuffer_test_context_fini(&ctx_b);
+	shm_unlink(MEM_SHM_NAME);
+}
+
+/* Consoles see each other's consumers come and go, and leave the shared
+ * segment empty behind them */
+void test_memory_shared(void)
+{
+	struct mem_shared *shared;
+	struct rb_test_ctx ctx;
+	struct console a;
+	struct console b;
+	int fd;
+	int i;
+
+	shm_unlink(MEM_SHM_NAME);
+
+	console_init_config(&a, "global-memory-limit = 1k\n");
+	console_init_config(&b, "global-memory-limit = 1k\n");
+	assert(console_mem_global_used(&b) == 2 * RB_SIZE);
+
+	ringbuffer_test_context_init(&ctx);
+	assert(!consumer_register(&a, &ctx));
+	assert(console_mem_global_used(&b) == 2 * RB_SIZE + RBC_SIZE);
+	consumer_unregister(&a, &ctx);
+	assert(console_mem_global_used(&b) == 2 * RB_SIZE);
+
+	console_fini(&a);
+	assert(console_mem_global_used(&b) == RB_SIZE);
+	console_fini(&b);
+
+	/* the segment outlives us for the next server, but holds nothing */
+	fd = shm_open(MEM_SHM_NAME, O_RDONLY, 0);
+	assert(fd >= 0);
+	shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+	assert(shared != MAP_FAILED);
+	close(fd);
+	for (i = 0; i < MEM_MAX_SLOTS; i++) {
+		assert(!shared->slots[i].pid);
+		assert(!shared->slots[i].used);
+	}
+	munmap(shared, sizeof(*shared));
+
+	ringbuffer_test_context_fini(&ctx);
+	shm_unlink(MEM_SHM_NAME);
+}
+
+int main(void)
+{
+	test_memory_consumers();
+	test_memory_shared();
+	return EXIT_SUCCESS;
+}
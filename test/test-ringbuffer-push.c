@@ -0,0 +1,223 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ringbuffer.c"
+
+struct push_ctx {
+	struct ringbuffer_consumer *rbc;
+	/* consume at most this much per push, or everything if zero */
+	size_t limit;
+	int count;
+	int last_iovcnt;
+	size_t forced;
+	uint8_t data[64];
+	size_t len;
+};
+
+static ssize_t push_append(void *arg, const struct iovec *iov, int iovcnt,
+			   size_t force_len)
+{
+	struct push_ctx *ctx = arg;
+	struct iovec vec[RINGBUFFER_IOV_MAX];
+	size_t len;
+	int n;
+	int i;
+
+	ctx->count++;
+	ctx->last_iovcnt = iovcnt;
+	if (force_len) {
+		ctx->forced = force_len;
+	}
+
+	len = ringbuffer_iov_len(iov, iovcnt);
+	if (ctx->limit && len > ctx->limit && len > force_len) {
+		len = ctx->limit > force_len ? ctx->limit : force_len;
+	}
+
+	n = ringbuffer_iov_slice(vec, iov, iovcnt, 0, len);
+	for (i = 0; i < n; i++) {
+		assert(ctx->len + vec[i].iov_len <= sizeof(ctx->data));
+		memcpy(ctx->data + ctx->len, vec[i].iov_base, vec[i].iov_len);
+		ctx->len += vec[i].iov_len;
+	}
+
+	return (ssize_t)len;
+}
+
+static ssize_t push_fail(void *arg __attribute__((unused)),
+			 const struct iovec *iov __attribute__((unused)),
+			 int iovcnt __attribute__((unused)),
+			 size_t force_len __attribute__((unused)))
+{
+	return -1;
+}
+
+static int spill_fd(void)
+{
+	FILE *f;
+	int fd;
+
+	f = tmpfile();
+	assert(f);
+	fd = dup(fileno(f));
+	assert(fd >= 0);
+	fclose(f);
+
+	return fd;
+}
+
+/* Data that wraps the end of the ring arrives as two iovec entries */
+void test_push_boundary(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f' };
+	struct push_ctx ctx = { 0 };
+	struct ringbuffer *rb;
+	int rc;
+
+	rb = ringbuffer_init(10);
+	ctx.rbc = ringbuffer_consumer_register_push(rb, push_append, &ctx);
+
+	rc = ringbuffer_queue(rb, in_buf, sizeof(in_buf));
+	assert(!rc);
+	assert(ctx.count == 1);
+	assert(ctx.last_iovcnt == 1);
+
+	in_buf[0] = 'A';
+	rc = ringbuffer_queue(rb, in_buf, sizeof(in_buf));
+	assert(!rc);
+	assert(ctx.count == 2);
+	assert(ctx.last_iovcnt == 2);
+	assert(ctx.len == 2 * sizeof(in_buf));
+	assert(!memcmp(ctx.data + sizeof(in_buf), in_buf, sizeof(in_buf)));
+	assert(ringbuffer_len(ctx.rbc) == 0);
+
+	ringbuffer_fini(rb);
+}
+
+/* Only what the consumer reports as consumed is committed */
+void test_push_partial(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f' };
+	struct push_ctx ctx = { 0 };
+	struct ringbuffer *rb;
+	ssize_t len;
+	int rc;
+
+	rb = ringbuffer_init(10);
+	ctx.rbc = ringbuffer_consumer_register_push(rb, push_append, &ctx);
+	ctx.limit = 2;
+
+	rc = ringbuffer_queue(rb, in_buf, sizeof(in_buf));
+	assert(!rc);
+	assert(ctx.len == 2);
+	assert(ringbuffer_len(ctx.rbc) == 4);
+
+	/* a consumer-initiated drain sees the remainder */
+	ctx.limit = 0;
+	len = ringbuffer_dequeue_iov(ctx.rbc, 0, push_append, &ctx);
+	assert(len == 4);
+	assert(ctx.len == sizeof(in_buf));
+	assert(!memcmp(ctx.data, in_buf, sizeof(in_buf)));
+
+	/* with nothing pending, we still get a call */
+	len = ringbuffer_dequeue_iov(ctx.rbc, 0, push_append, &ctx);
+	assert(len == 0);
+	assert(ctx.last_iovcnt == 0);
+
+	ringbuffer_fini(rb);
+}
+
+/* A full consumer is forced to make space for new data */
+void test_push_force(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+	struct push_ctx ctx = { 0 };
+	struct ringbuffer *rb;
+	int rc;
+
+	rb = ringbuffer_init(10);
+	ctx.rbc = ringbuffer_consumer_register_push(rb, push_append, &ctx);
+	ctx.limit = 1;
+
+	rc = ringbuffer_queue(rb, in_buf, 8);
+	assert(!rc);
+	assert(ringbuffer_len(ctx.rbc) == 7);
+
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+
+	/* the forced push asked for the two bytes we were short by, then
+	 * we were offered the new data as usual */
+	assert(ctx.forced == 2);
+	assert(ctx.count == 3);
+	assert(ctx.len == 4);
+	assert(ringbuffer_len(ctx.rbc) == 8);
+	assert(!memcmp(ctx.data, in_buf, 4));
+
+	ringbuffer_fini(rb);
+}
+
+/* Spilled data is offered ahead of the ring's */
+void test_push_spill(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+	struct push_ctx ctx = { 0 };
+	struct ringbuffer *rb;
+	ssize_t len;
+	int rc;
+
+	rb = ringbuffer_init(5);
+	ctx.rbc = ringbuffer_consumer_register_push(rb, push_append, &ctx);
+	rc = ringbuffer_consumer_enable_spill(ctx.rbc, spill_fd(), 1024);
+	assert(!rc);
+
+	/* stall the consumer, so the oldest data spills */
+	ctx.limit = 1;
+	ctx.len = 0;
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+	rc = ringbuffer_queue(rb, in_buf + 4, 4);
+	assert(!rc);
+	assert(ringbuffer_spill_len(ctx.rbc) > 0);
+
+	ctx.limit = 0;
+	len = ringbuffer_dequeue_iov(ctx.rbc, 0, push_append, &ctx);
+	assert(len == (ssize_t)sizeof(in_buf) - 2);
+	assert(ctx.len == sizeof(in_buf));
+	assert(!memcmp(ctx.data, in_buf, sizeof(in_buf)));
+	assert(ringbuffer_len(ctx.rbc) == 0);
+
+	ringbuffer_fini(rb);
+}
+
+/* A failing push consumer is removed */
+void test_push_remove(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c' };
+	struct ringbuffer *rb;
+	int rc;
+
+	rb = ringbuffer_init(10);
+	ringbuffer_consumer_register_push(rb, push_fail, NULL);
+	assert(rb->n_consumers == 1);
+
+	rc = ringbuffer_queue(rb, in_buf, sizeof(in_buf));
+	assert(!rc);
+	assert(rb->n_consumers == 0);
+
+	ringbuffer_fini(rb);
+}
+
+int main(void)
+{
+	test_push_boundary();
+	test_push_partial();
+	test_push_force();
+	test_push_spill();
+	test_push_remove();
+	return EXIT_SUCCESS;
+}
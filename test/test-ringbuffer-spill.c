@@ -0,0 +1,189 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ringbuffer.c"
+#include "ringbuffer-test-utils.c"
+
+static int spill_fd(void)
+{
+	FILE *f;
+	int fd;
+
+	f = tmpfile();
+	assert(f);
+	fd = dup(fileno(f));
+	assert(fd >= 0);
+	fclose(f);
+
+	return fd;
+}
+
+void test_spill_replay(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+	struct rb_test_ctx _ctx;
+	struct rb_test_ctx *ctx = &_ctx;
+	struct ringbuffer *rb;
+	int rc;
+
+	ringbuffer_test_context_init(ctx);
+
+	rb = ringbuffer_init(5);
+
+	ctx->rbc = ringbuffer_consumer_register(rb, ringbuffer_poll_append_all,
+						ctx);
+	rc = ringbuffer_consumer_enable_spill(ctx->rbc, spill_fd(), 1024);
+	assert(!rc);
+
+	/* a stalled consumer never consumes, not even when forced */
+	ctx->ignore_poll = true;
+
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+	rc = ringbuffer_queue(rb, in_buf + 4, 3);
+	assert(!rc);
+
+	/* the oldest data has moved to the spill file, nothing is lost */
+	assert(ringbuffer_spill_len(ctx->rbc) == 3);
+	assert(ringbuffer_len(ctx->rbc) == 7);
+
+	/* catch up: we should see the spilled data followed by the rest */
+	ctx->ignore_poll = false;
+	rc = ringbuffer_queue(rb, in_buf + 7, 1);
+	assert(!rc);
+
+	assert(ctx->len == sizeof(in_buf));
+	assert(!memcmp(in_buf, ctx->data, ctx->len));
+	assert(ringbuffer_len(ctx->rbc) == 0);
+	assert(ringbuffer_spill_len(ctx->rbc) == 0);
+
+	ringbuffer_fini(rb);
+	ringbuffer_test_context_fini(ctx);
+}
+
+void test_spill_full(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f' };
+	struct rb_test_ctx _ctx;
+	struct rb_test_ctx *ctx = &_ctx;
+	struct ringbuffer *rb;
+	int rc;
+
+	ringbuffer_test_context_init(ctx);
+
+	rb = ringbuffer_init(5);
+
+	ctx->rbc = ringbuffer_consumer_register(rb, ringbuffer_poll_append_all,
+						ctx);
+	rc = ringbuffer_consumer_enable_spill(ctx->rbc, spill_fd(), 1);
+	assert(!rc);
+
+	ctx->force_only = true;
+
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+
+	/* no room left in the spill file, so we fall back to a forced poll */
+	rc = ringbuffer_queue(rb, in_buf + 4, 2);
+	assert(!rc);
+
+	assert(ctx->count == 1);
+	assert(ctx->len == 2);
+	assert(!memcmp(in_buf, ctx->data, 2));
+	assert(ringbuffer_spill_len(ctx->rbc) == 0);
+
+	ringbuffer_fini(rb);
+	ringbuffer_test_context_fini(ctx);
+}
+
+/* Once the spill file fills, a forced poll drains it along with the ring */
+void test_spill_full_force(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+	struct rb_test_ctx _ctx;
+	struct rb_test_ctx *ctx = &_ctx;
+	struct ringbuffer *rb;
+	int rc;
+
+	ringbuffer_test_context_init(ctx);
+
+	rb = ringbuffer_init(5);
+
+	ctx->rbc = ringbuffer_consumer_register(rb, ringbuffer_poll_append_all,
+						ctx);
+	rc = ringbuffer_consumer_enable_spill(ctx->rbc, spill_fd(), 3);
+	assert(!rc);
+
+	ctx->ignore_poll = true;
+
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+	rc = ringbuffer_queue(rb, in_buf + 4, 3);
+	assert(!rc);
+	assert(ringbuffer_spill_len(ctx->rbc) == 3);
+
+	/* the spill file is full, so we force the spilled data and a byte of
+	 * the ring, just enough to make room */
+	ctx->ignore_poll = false;
+	ctx->force_only = true;
+	rc = ringbuffer_queue(rb, in_buf + 7, 1);
+	assert(!rc);
+
+	assert(rb->n_consumers == 1);
+	assert(ctx->count == 1);
+	assert(ctx->len == 4);
+	assert(!memcmp(in_buf, ctx->data, 4));
+	assert(ringbuffer_spill_len(ctx->rbc) == 0);
+	assert(ringbuffer_len(ctx->rbc) == 4);
+
+	ringbuffer_fini(rb);
+	ringbuffer_test_context_fini(ctx);
+}
+
+/* A stalled consumer with a full spill file is dropped */
+void test_spill_full_stalled(void)
+{
+	uint8_t in_buf[] = { 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+	struct rb_test_ctx _ctx;
+	struct rb_test_ctx *ctx = &_ctx;
+	struct ringbuffer *rb;
+	int rc;
+
+	ringbuffer_test_context_init(ctx);
+
+	rb = ringbuffer_init(5);
+
+	ctx->rbc = ringbuffer_consumer_register(rb, ringbuffer_poll_append_all,
+						ctx);
+	rc = ringbuffer_consumer_enable_spill(ctx->rbc, spill_fd(), 3);
+	assert(!rc);
+
+	ctx->ignore_poll = true;
+
+	rc = ringbuffer_queue(rb, in_buf, 4);
+	assert(!rc);
+	rc = ringbuffer_queue(rb, in_buf + 4, 3);
+	assert(!rc);
+	rc = ringbuffer_queue(rb, in_buf + 7, 1);
+	assert(!rc);
+
+	assert(rb->n_consumers == 0);
+	assert(rb->n_dropped == 1);
+	assert(ctx->len == 0);
+
+	ringbuffer_fini(rb);
+	ringbuffer_test_context_fini(ctx);
+}
+
+int main(void)
+{
+	test_spill_replay();
+	test_spill_full();
+	test_spill_full_force();
+	test_spill_full_stalled();
+	return EXIT_SUCCESS;
+}
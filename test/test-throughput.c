@@ -0,0 +1,216 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+#include "util.c"
+#include "throughput.c"
+
+static size_t charged;
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size)
+{
+	charged += size;
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size)
+{
+	charged -= size;
+}
+
+static struct timeval vnow;
+
+int get_current_time(struct timeval *tv)
+{
+	*tv = vnow;
+	return 0;
+}
+
+static struct console console;
+static struct ringbuffer rb;
+
+static void setup(const char *config_str)
+{
+	struct config *config;
+	char *buf;
+
+	memset(&console, 0, sizeof(console));
+	memset(&rb, 0, sizeof(rb));
+	console.rb = &rb;
+	vnow.tv_sec = 100;
+	vnow.tv_usec = 0;
+
+	/* config_parse() modifies its buffer */
+	buf = strdup(config_str);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	console_throughput_init(&console, config);
+	config_fini(config);
+}
+
+static void teardown(void)
+{
+	console_throughput_fini(&console);
+	assert(!charged);
+}
+
+/* Move on by some seconds, as the event loop would */
+static void advance(long secs)
+{
+	vnow.tv_sec += secs;
+	console_throughput_update(&console, &vnow);
+}
+
+static uint16_t get_le16(const uint8_t *buf)
+{
+	uint16_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le16toh(val);
+}
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le32toh(val);
+}
+
+static uint64_t get_le64(const uint8_t *buf)
+{
+	uint64_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le64toh(val);
+}
+
+/* Returns the packed history, and its sample count in *count */
+static uint8_t *pack(unsigned int interval, size_t *count)
+{
+	static uint8_t buf[THROUGHPUT_HEADER_SIZE +
+			   60 * 60 * THROUGHPUT_SAMPLE_SIZE];
+	size_t len;
+
+	len = console_throughput_packed_size(&console, interval);
+	assert(len >= THROUGHPUT_HEADER_SIZE && len <= sizeof(buf));
+	console_throughput_pack(&console, interval, &vnow, buf);
+
+	assert(get_le32(buf) == interval);
+	*count = get_le32(buf + 4);
+	assert(len == THROUGHPUT_HEADER_SIZE +
+			      *count * THROUGHPUT_SAMPLE_SIZE);
+	assert(get_le64(buf + 8));
+
+	return buf + THROUGHPUT_HEADER_SIZE;
+}
+
+static void check_sample(const uint8_t *sample, uint32_t in, uint32_t out,
+			 uint16_t clients, uint16_t forced, uint16_t dropped)
+{
+	assert(get_le32(sample) == in);
+	assert(get_le32(sample + 4) == out);
+	assert(get_le16(sample + 8) == clients);
+	assert(get_le16(sample + 10) == forced);
+	assert(get_le16(sample + 12) == dropped);
+	assert(!get_le16(sample + 14));
+}
+
+void test_throughput_disabled(void)
+{
+	setup("throughput-history = false\n");
+	assert(!charged);
+	advance(5);
+	assert(!console_throughput_packed_size(&console, 1));
+	teardown();
+}
+
+/* Each second closes with what happened in it */
+void test_throughput_seconds(void)
+{
+	uint8_t *samples;
+	size_t count;
+
+	setup("");
+	assert(charged);
+
+	/* no history for intervals we don't keep */
+	assert(!console_throughput_packed_size(&console, 10));
+
+	console.throughput.bytes_in += 100;
+	console.throughput.bytes_out += 3;
+	console.n_interactive = 2;
+	rb.n_forced++;
+	advance(1);
+
+	/* a client comes and goes within the second */
+	console.n_interactive = 3;
+	console_throughput_update(&console, &vnow);
+	console.n_interactive = 2;
+	console.throughput.bytes_in += 50;
+	rb.n_dropped++;
+
+	/* we slept through an idle second */
+	advance(2);
+
+	samples = pack(1, &count);
+	assert(count == 3);
+	check_sample(samples, 100, 3, 2, 1, 0);
+	check_sample(samples + THROUGHPUT_SAMPLE_SIZE, 50, 0, 3, 0, 1);
+	check_sample(samples + 2 * THROUGHPUT_SAMPLE_SIZE, 0, 0, 2, 0, 0);
+
+	teardown();
+}
+
+/* The per-second ring wraps after an hour, while minutes accumulate */
+void test_throughput_minutes(void)
+{
+	uint8_t *samples;
+	size_t count;
+	int i;
+
+	setup("");
+
+	for (i = 0; i < 60 * 60 + 90; i++) {
+		console.throughput.bytes_in += 10;
+		advance(1);
+	}
+
+	samples = pack(1, &count);
+	assert(count == 60 * 60);
+	check_sample(samples, 10, 0, 0, 0, 0);
+
+	samples = pack(60, &count);
+	assert(count == 61);
+	check_sample(samples, 600, 0, 0, 0, 0);
+
+	/* a long idle spell only costs us a day of empty samples */
+	advance(7 * 24 * 60 * 60);
+	samples = pack(60, &count);
+	assert(count == 24 * 60);
+	check_sample(samples + (count - 1) * THROUGHPUT_SAMPLE_SIZE, 0, 0, 0, 0,
+		     0);
+
+	teardown();
+}
+
+int main(void)
+{
+	test_throughput_disabled();
+	test_throughput_seconds();
+	test_throughput_minutes();
+	return EXIT_SUCCESS;
+}
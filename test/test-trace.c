@@ -0,0 +1,127 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+#include "util.c"
+#include "trace.c"
+
+static size_t charged;
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size)
+{
+	charged += size;
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size)
+{
+	charged -= size;
+}
+
+static struct console console;
+
+static void setup(const char *config_str)
+{
+	struct config *config;
+	char *buf;
+
+	/* config_parse() modifies its buffer */
+	buf = strdup(config_str);
+	config = calloc(1, sizeof(*config));
+	config_parse(config, buf);
+	free(buf);
+
+	console_trace_init(&console, config);
+	config_fini(config);
+}
+
+static void teardown(void)
+{
+	console_trace_fini(&console);
+	assert(!charged);
+}
+
+static void record(const char *name)
+{
+	struct trace *trace = console_trace(&console);
+	uint64_t start;
+
+	start = trace_start(trace);
+	trace_end(trace, TRACE_EVENT, name, start);
+}
+
+static char *dump(void)
+{
+	static char buf[4096];
+	ssize_t len;
+	int fd;
+
+	fd = console_trace_dump(&console);
+	assert(fd >= 0);
+	len = read(fd, buf, sizeof(buf) - 1);
+	assert(len > 0);
+	buf[len] = '\0';
+	close(fd);
+
+	return buf;
+}
+
+/* Without a buffer we don't trace, and recording is a no-op */
+void test_trace_disabled(void)
+{
+	setup("");
+	assert(!console_trace(&console));
+	assert(!charged);
+	record("nothing");
+	assert(console_trace_dump(&console) == -ENOENT);
+	teardown();
+}
+
+/* The ring keeps the most recent events, and dumps them oldest first */
+void test_trace_wrap(void)
+{
+	char *buf;
+	char *a;
+	char *b;
+
+	setup("trace-buffer-size = 64\n");
+	assert(console_trace(&console));
+	assert(console.trace.size == 64 / sizeof(struct trace_event));
+	assert(charged == console.trace.size * sizeof(struct trace_event));
+
+	record("first");
+	record("second");
+	record("third");
+	record("fourth");
+	record("fifth");
+
+	buf = dump();
+	assert(!strncmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[",
+			39));
+	assert(!strstr(buf, "\"first\""));
+	a = strstr(buf, "\"fourth\"");
+	b = strstr(buf, "\"fifth\"");
+	assert(a && b && a < b);
+	assert(strstr(buf, "\"cat\":\"event\",\"ph\":\"X\""));
+	assert(!strcmp(buf + strlen(buf) - 4, "\n]}\n"));
+
+	teardown();
+}
+
+int main(void)
+{
+	test_trace_disabled();
+	test_trace_wrap();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SYSCONFDIR
+// Bypass compilation error due to -DSYSCONFDIR not provided
+#define SYSCONFDIR
+#endif
+
+#include "config.c"
+#include "ringbuffer.c"
+#include "transform.c"
+#include "ringbuffer-test-utils.c"
+
+int console_mem_charge(struct console *console __attribute__((unused)),
+		       size_t size __attribute__((unused)))
+{
+	return 0;
+}
+
+void console_mem_uncharge(struct console *console __attribute__((unused)),
+			  size_t size __attribute__((unused)))
+{
+}
+
+static void run_transform(const char *spec, const char *const *in,
+			  const char *exp)
+{
+	struct console console = { 0 };
+	struct rb_test_ctx _ctx;
+	struct rb_test_ctx *ctx = &_ctx;
+	struct ringbuffer *rb;
+	int rc;
+
+	ringbuffer_test_context_init(ctx);
+	console.rb = ringbuffer_init(4096 * 4);
+	console.max_transforms = 1;
+
+	rb = console_transform_ringbuffer(&console, spec);
+	assert(rb);
+	ctx->rbc = ringbuffer_consumer_register(rb, ringbuffer_poll_append_all,
+						ctx);
+
+	for (; *in; in++) {
+		rc = ringbuffer_queue(console.rb, (uint8_t *)*in, strlen(*in));
+		assert(!rc);
+	}
+
+	assert(ctx->len == strlen(exp));
+	assert(!memcmp(ctx->data, exp, ctx->len));
+
+	ringbuffer_consumer_unregister(ctx->rbc);
+	ringbuffer_test_context_fini(ctx);
+
+	/* an unused chain just discards its input, until it's torn down */
+	assert(console.n_transforms == 1);
+	rc = ringbuffer_queue(console.rb, (uint8_t *)"x", 1);
+	assert(!rc);
+	assert(console.n_transforms == 1);
+	console_transform_reap(&console);
+	assert(console.n_transforms == 0);
+	assert(console.rb->n_consumers == 0);
+	assert(!console.rb->n_dropped);
+
+	ringbuffer_fini(console.rb);
+}
+
+static void test_transform_strip_ansi(void)
+{
+	const char *in[] = { "\x1b[1;31mred\x1b[0m \x1b]0;title\x07ok\x1b",
+			     "[Kdone\x1b(B\n", NULL };
+
+	run_transform("strip-ansi", in, "red ok" "done\n");
+}
+
+static void test_transform_crlf(void)
+{
+	const char *in[] = { "a\r\nb\r", "\nc\rd\n", NULL };
+
+	run_transform("crlf", in, "a\nb\nc\nd\n");
+}
+
+static void test_transform_utf8(void)
+{
+	const char *in[] = { "a\xc3", "\xa9" "b\xff" "c\xe2\x82", "d\xed\xa0\x80",
+			     NULL };
+
+	run_transform("utf8", in,
+		      "a\xc3\xa9" "b\xef\xbf\xbd" "c\xef\xbf\xbd" "d"
+		      "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd");
+}
+
+static void test_transform_chain(void)
+{
+	const char *in[] = { "\x1b[32mok\x1b[0m\r\n", NULL };
+
+	run_transform(" strip-ansi, crlf ", in, "ok\n");
+}
+
+static void test_transform_grep(void)
+{
+	const char *in[] = { "boot ok\r\nkernel pa", "nic: oops\r\nMCE 3\r\n",
+			     "fine\r\nerr", "or\r\n", "held", NULL };
+
+	run_transform("crlf, grep:kernel panic|MCE|error", in,
+		      "kernel panic: oops\nMCE 3\nerror\n");
+}
+
+/* Long lines are decided on their first TRANSFORM_LINE_MAX bytes */
+static void test_transform_grep_long(void)
+{
+	static char match[TRANSFORM_LINE_MAX + 100];
+	static char nomatch[TRANSFORM_LINE_MAX + 100];
+	const char *in[] = { match, nomatch, NULL };
+
+	memset(match, 'x', sizeof(match) - 2);
+	memcpy(match, "MCE", 3);
+	match[sizeof(match) - 2] = '\n';
+
+	memset(nomatch, 'x', sizeof(nomatch) - 2);
+	memcpy(nomatch + TRANSFORM_LINE_MAX, "MCE", 3);
+	nomatch[sizeof(nomatch) - 2] = '\n';
+
+	run_transform("grep:MCE", in, match);
+}
+
+static void test_transform_shared(void)
+{
+	struct console console = { 0 };
+	struct ringbuffer *rb1;
+	struct ringbuffer *rb2;
+
+	console.rb = ringbuffer_init(4096 * 4);
+	console.max_transforms = 4;
+
+	rb1 = console_transform_ringbuffer(&console, "strip-ansi,crlf");
+	rb2 = console_transform_ringbuffer(&console, "strip-ansi , crlf");
+	assert(rb1 && rb1 == rb2);
+	assert(console.n_transforms == 1);
+
+	rb2 = console_transform_ringbuffer(&console, "crlf,strip-ansi");
+	assert(rb2 && rb1 != rb2);
+	assert(console.n_transforms == 2);
+
+	assert(!console_transform_ringbuffer(&console, "bogus"));
+	assert(!console_transform_ringbuffer(&console, ","));
+	assert(!console_transform_ringbuffer(&console, "grep"));
+	assert(!console_transform_ringbuffer(&console, "grep:"));
+	assert(!console_transform_ringbuffer(&console, "crlf:x"));
+	assert(!console_transform_ringbuffer(&console, ":x"));
+	assert(console.n_transforms == 2);
+
+	/* the same filter shares a chain */
+	rb1 = console_transform_ringbuffer(&console, "grep:panic|MCE");
+	rb2 = console_transform_ringbuffer(&console, " grep:panic|MCE,");
+	assert(rb1 && rb1 == rb2);
+	rb2 = console_transform_ringbuffer(&console, "grep:MCE|panic");
+	assert(rb2 && rb1 != rb2);
+	assert(console.n_transforms == 4);
+
+	/* at the limit, we can only share an existing chain */
+	errno = 0;
+	assert(!console_transform_ringbuffer(&console, "utf8"));
+	assert(errno == EUSERS);
+	assert(console_transform_ringbuffer(&console, "grep:MCE|panic") ==
+	       rb2);
+
+	/* the chains are unused, so are torn down */
+	console_transform_reap(&console);
+	assert(console.n_transforms == 0);
+	assert(console.rb->n_consumers == 0);
+
+	ringbuffer_fini(console.rb);
+}
+
+int main(void)
+{
+	test_transform_strip_ansi();
+	test_transform_crlf();
+	test_transform_utf8();
+	test_transform_chain();
+	test_transform_grep();
+	test_transform_grep_long();
+	test_transform_shared();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,295 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console-server.h"
+
+/*
+ * Throughput history.
+ *
+ * Each second we record the bytes read from the host tty (bytes in), the
+ * bytes written to it by clients (bytes out), the peak number of interactive
+ * consumers (socket clients, an attached pty, local ttys), and the number of
+ * forced ringbuffer drains, and of consumers dropped for failing one. The
+ * seconds are summed into minutes, with the peak client count.
+ *
+ * The history is packed for D-Bus as a header:
+ *
+ *   le32 interval    seconds per sample
+ *   le32 count       number of samples
+ *   le64 end         CLOCK_REALTIME seconds at the end of the newest sample
+ *
+ * followed by the samples, oldest first:
+ *
+ *   le32 bytes_in, le32 bytes_out,
+ *   le16 clients, le16 forced, le16 dropped, le16 reserved
+ *
+ * Counts that overflow a sample are saturated.
+ */
+#define THROUGHPUT_HEADER_SIZE 16
+#define THROUGHPUT_SAMPLE_SIZE 16
+
+static const size_t throughput_n_seconds = 60 * 60;
+static const size_t throughput_n_minutes = 24 * 60;
+
+static uint32_t sat32(uint64_t val)
+{
+	return val > UINT32_MAX ? UINT32_MAX : (uint32_t)val;
+}
+
+static uint16_t sat16(uint64_t val)
+{
+	return val > UINT16_MAX ? UINT16_MAX : (uint16_t)val;
+}
+
+static void throughput_ring_push(struct throughput_ring *ring,
+				 const struct throughput_sample *sample)
+{
+	ring->samples[ring->head] = *sample;
+	ring->head = (ring->head + 1) % ring->size;
+	if (ring->count < ring->size) {
+		ring->count++;
+	}
+}
+
+static void throughput_mark(struct console *console)
+{
+	struct throughput *tp = &console->throughput;
+
+	tp->mark_in = tp->bytes_in;
+	tp->mark_out = tp->bytes_out;
+	tp->mark_forced = console->rb->n_forced;
+	tp->mark_dropped = console->rb->n_dropped;
+	tp->clients = sat16(console->n_interactive);
+}
+
+static void throughput_close_second(struct console *console)
+{
+	struct throughput *tp = &console->throughput;
+	struct throughput_sample *minute = &tp->minute;
+	struct throughput_sample sample;
+
+	sample.bytes_in = sat32(tp->bytes_in - tp->mark_in);
+	sample.bytes_out = sat32(tp->bytes_out - tp->mark_out);
+	sample.clients = tp->clients;
+	sample.forced = sat16(console->rb->n_forced - tp->mark_forced);
+	sample.dropped = sat16(console->rb->n_dropped - tp->mark_dropped);
+	throughput_ring_push(&tp->seconds, &sample);
+	throughput_mark(console);
+
+	minute->bytes_in = sat32((uint64_t)minute->bytes_in + sample.bytes_in);
+	minute->bytes_out =
+		sat32((uint64_t)minute->bytes_out + sample.bytes_out);
+	minute->forced = sat16((uint64_t)minute->forced + sample.forced);
+	minute->dropped = sat16((uint64_t)minute->dropped + sample.dropped);
+	if (sample.clients > minute->clients) {
+		minute->clients = sample.clients;
+	}
+
+	if (++tp->minute_secs == tp->minutes.interval) {
+		throughput_ring_push(&tp->minutes, minute);
+		memset(minute, 0, sizeof(*minute));
+		tp->minute_secs = 0;
+	}
+}
+
+void console_throughput_update(struct console *console,
+			       const struct timeval *now)
+{
+	struct throughput *tp = &console->throughput;
+	time_t limit;
+	time_t gap;
+
+	if (!tp->seconds.samples) {
+		return;
+	}
+
+	if (console->n_interactive > tp->clients) {
+		tp->clients = sat16(console->n_interactive);
+	}
+
+	if (now->tv_sec <= tp->second) {
+		return;
+	}
+
+	/* we may have slept through some idle seconds; past a day of them,
+	 * the whole history is idle */
+	gap = now->tv_sec - tp->second;
+	limit = (time_t)(tp->minutes.size * tp->minutes.interval);
+	if (gap > limit) {
+		gap = limit;
+	}
+
+	while (gap--) {
+		throughput_close_second(console);
+	}
+
+	tp->second = now->tv_sec;
+}
+
+void console_throughput_init(struct console *console, struct config *config)
+{
+	struct throughput *tp = &console->throughput;
+	struct throughput_sample *samples;
+	bool enabled = true;
+	struct timeval now;
+	const char *val;
+	size_t n;
+
+	val = config_get_value(config, "throughput-history");
+	if (val && config_parse_bool(&enabled, val)) {
+		warnx("Invalid throughput-history value: '%s'", val);
+	}
+
+	if (!enabled || get_current_time(&now)) {
+		return;
+	}
+
+	n = throughput_n_seconds + throughput_n_minutes;
+	if (console_mem_charge(console, n * sizeof(*samples))) {
+		warnx("Memory limit reached, throughput history disabled");
+		return;
+	}
+
+	samples = calloc(n, sizeof(*samples));
+	if (!samples) {
+		warn("Can't allocate throughput history");
+		console_mem_uncharge(console, n * sizeof(*samples));
+		return;
+	}
+
+	tp->seconds.samples = samples;
+	tp->seconds.size = throughput_n_seconds;
+	tp->seconds.interval = 1;
+	tp->minutes.samples = samples + throughput_n_seconds;
+	tp->minutes.size = throughput_n_minutes;
+	tp->minutes.interval = 60;
+
+	tp->second = now.tv_sec;
+	throughput_mark(console);
+}
+
+void console_throughput_fini(struct console *console)
+{
+	struct throughput *tp = &console->throughput;
+
+	if (!tp->seconds.samples) {
+		return;
+	}
+
+	console_mem_uncharge(console,
+			     (tp->seconds.size + tp->minutes.size) *
+				     sizeof(*tp->seconds.samples));
+	free(tp->seconds.samples);
+	memset(&tp->seconds, 0, sizeof(tp->seconds));
+	memset(&tp->minutes, 0, sizeof(tp->minutes));
+}
+
+static struct throughput_ring *throughput_ring(struct console *console,
+					       unsigned int interval)
+{
+	struct throughput *tp = &console->throughput;
+
+	if (!tp->seconds.samples) {
+		return NULL;
+	}
+
+	if (interval == tp->seconds.interval) {
+		return &tp->seconds;
+	}
+
+	if (interval == tp->minutes.interval) {
+		return &tp->minutes;
+	}
+
+	return NULL;
+}
+
+size_t console_throughput_packed_size(struct console *console,
+				      unsigned int interval)
+{
+	struct throughput_ring *ring = throughput_ring(console, interval);
+
+	if (!ring) {
+		return 0;
+	}
+
+	return THROUGHPUT_HEADER_SIZE + ring->count * THROUGHPUT_SAMPLE_SIZE;
+}
+
+static uint8_t *put_le16(uint8_t *buf, uint16_t val)
+{
+	val = htole16(val);
+	memcpy(buf, &val, sizeof(val));
+	return buf + sizeof(val);
+}
+
+static uint8_t *put_le32(uint8_t *buf, uint32_t val)
+{
+	val = htole32(val);
+	memcpy(buf, &val, sizeof(val));
+	return buf + sizeof(val);
+}
+
+static uint8_t *put_le64(uint8_t *buf, uint64_t val)
+{
+	val = htole64(val);
+	memcpy(buf, &val, sizeof(val));
+	return buf + sizeof(val);
+}
+
+void console_throughput_pack(struct console *console, unsigned int interval,
+			     const struct timeval *now, uint8_t *buf)
+{
+	struct throughput_ring *ring = throughput_ring(console, interval);
+	struct throughput *tp = &console->throughput;
+	struct throughput_sample *sample;
+	struct timespec realtime;
+	time_t end;
+	size_t idx;
+	size_t i;
+
+	if (!ring) {
+		return;
+	}
+
+	/* the newest sample ended as the current second, or minute, began */
+	end = tp->second;
+	if (ring == &tp->minutes) {
+		end -= tp->minute_secs;
+	}
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	end = realtime.tv_sec - (now->tv_sec - end);
+
+	buf = put_le32(buf, ring->interval);
+	buf = put_le32(buf, ring->count);
+	buf = put_le64(buf, (uint64_t)end);
+
+	idx = (ring->head + ring->size - ring->count) % ring->size;
+	for (i = 0; i < ring->count; i++) {
+		sample = &ring->samples[(idx + i) % ring->size];
+		buf = put_le32(buf, sample->bytes_in);
+		buf = put_le32(buf, sample->bytes_out);
+		buf = put_le16(buf, sample->clients);
+		buf = put_le16(buf, sample->forced);
+		buf = put_le16(buf, sample->dropped);
+		buf = put_le16(buf, 0);
+	}
+}
@@ -0,0 +1,165 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "console-server.h"
+
+/*
+ * Event loop tracing.
+ *
+ * Spans are recorded by the inline trace_start() and trace_end() in
+ * console-server.h, into a ring that keeps the most recent events. Here we
+ * set up the ring, and dump it in the Chrome trace event format, which
+ * chrome://tracing and Perfetto can load. Each span is a complete ("X")
+ * event, with the type of work as its category, and the handler as its
+ * name.
+ */
+
+static const char *const trace_type_names[] = {
+	[TRACE_POLL] = "poll",
+	[TRACE_TTY_READ] = "tty-read",
+	[TRACE_EVENT] = "event",
+	[TRACE_TIMEOUT] = "timeout",
+	[TRACE_RINGBUFFER] = "ringbuffer",
+	[TRACE_FORCE] = "force",
+	[TRACE_LOG_WRITE] = "log-write",
+};
+
+void console_trace_init(struct console *console, struct config *config)
+{
+	struct trace *trace = &console->trace;
+	const char *val;
+	size_t size;
+	size_t n;
+
+	val = config_get_value(config, "trace-buffer-size");
+	if (!val) {
+		return;
+	}
+
+	if (config_parse_bytesize(val, &size)) {
+		warnx("Invalid trace-buffer-size: '%s'", val);
+		return;
+	}
+
+	n = size / sizeof(*trace->events);
+	if (!n) {
+		return;
+	}
+
+	if (console_mem_charge(console, n * sizeof(*trace->events))) {
+		warnx("Memory limit reached, tracing disabled");
+		return;
+	}
+
+	trace->events = calloc(n, sizeof(*trace->events));
+	if (!trace->events) {
+		warn("Can't allocate trace buffer");
+		console_mem_uncharge(console, n * sizeof(*trace->events));
+		return;
+	}
+
+	trace->size = n;
+	trace->head = 0;
+	trace->count = 0;
+}
+
+void console_trace_fini(struct console *console)
+{
+	struct trace *trace = &console->trace;
+
+	if (!trace->events) {
+		return;
+	}
+
+	console_mem_uncharge(console, trace->size * sizeof(*trace->events));
+	free(trace->events);
+	trace->events = NULL;
+}
+
+struct trace *console_trace(struct console *console)
+{
+	return console->trace.events ? &console->trace : NULL;
+}
+
+int console_trace_dump(struct console *console)
+{
+	struct trace *trace = console_trace(console);
+	struct trace_event *event;
+	pid_t pid = getpid();
+	size_t idx;
+	size_t i;
+	FILE *fp;
+	int fd;
+	int rc;
+
+	if (!trace) {
+		return -ENOENT;
+	}
+
+	fd = memfd_create("obmc-console-trace", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	fp = fdopen(dup(fd), "w");
+	if (!fp) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	/* oldest first */
+	idx = (trace->head + trace->size - trace->count) % trace->size;
+	for (i = 0; i < trace->count; i++) {
+		event = &trace->events[(idx + i) % trace->size];
+		fprintf(fp,
+			"%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"pid\":%d,\"tid\":%d,"
+			"\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u}",
+			i ? "," : "", event->name ? event->name : "",
+			trace_type_names[event->type], pid, pid,
+			event->start_ns / 1000,
+			(unsigned int)(event->start_ns % 1000),
+			event->dur_ns / 1000,
+			(unsigned int)(event->dur_ns % 1000));
+	}
+
+	fprintf(fp, "\n]}\n");
+
+	if (ferror(fp) | fclose(fp)) {
+		close(fd);
+		return -EIO;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	return fd;
+}
@@ -0,0 +1,755 @@
+/**
+ * Copyright © 2024 NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console-server.h"
+
+/*
+ * Output transforms.
+ *
+ * A transform is a chain of stages, described by a comma-separated list of
+ * stage names, e.g. "strip-ansi,crlf". Some stages take an argument after a
+ * colon, e.g. "grep:panic|MCE", which runs to the next comma. Each distinct
+ * chain is a single
+ * consumer of the console ringbuffer, and writes its output into its own
+ * ringbuffer. Any number of consumers can then read from that, so the cost of
+ * a transform doesn't depend on how many consumers use it.
+ *
+ * A chain is torn down by the event loop once it has no consumers left. Each
+ * chain holds a ringbuffer the size of the console's, so the number of live
+ * chains is limited by the transform-max-chains configuration key.
+ */
+
+#define TRANSFORM_MAX_STAGES 4
+#define TRANSFORM_CHUNK_SIZE 4096
+/* The longest line the grep stage holds while deciding whether to pass it */
+#define TRANSFORM_LINE_MAX 1024
+
+static const int default_max_transforms = 8;
+
+enum ansi_state {
+	ANSI_GROUND = 0,
+	ANSI_ESCAPE,
+	ANSI_ESCAPE_INTERMEDIATE,
+	ANSI_CSI,
+	ANSI_STRING,
+	ANSI_STRING_ESCAPE,
+};
+
+enum grep_mode {
+	GREP_HOLD = 0,
+	GREP_PASS,
+	GREP_SKIP,
+};
+
+struct transform_stage_state {
+	const struct transform_stage_type *type;
+	/* the stage's argument, within the transform's spec */
+	const char *arg;
+	size_t arg_len;
+	/* type->hold bytes, for input held back until a later chunk */
+	uint8_t *buf;
+	union {
+		enum ansi_state ansi;
+		bool crlf_pending_cr;
+		struct {
+			uint8_t seq[4];
+			size_t len;
+			size_t need;
+			uint8_t lo;
+			uint8_t hi;
+		} utf8;
+		struct {
+			size_t len;
+			enum grep_mode mode;
+		} grep;
+	};
+};
+
+struct transform_stage_type {
+	const char *name;
+	/* worst-case output bytes per input byte */
+	size_t expansion;
+	/* input the stage may hold back, beyond the odd byte */
+	size_t hold;
+	bool arg;
+	size_t (*fn)(struct transform_stage_state *state, const uint8_t *in,
+		     size_t len, uint8_t *out);
+};
+
+struct transform {
+	struct console *console;
+	char *spec;
+	struct transform_stage_state stages[TRANSFORM_MAX_STAGES];
+	int n_stages;
+
+	struct ringbuffer_consumer *rbc;
+	struct ringbuffer *rb;
+
+	size_t chunk_size;
+	size_t buf_size;
+	uint8_t *bufs[2];
+
+	/* charged to the console's memory accounting */
+	size_t mem;
+};
+
+/* Remove ECMA-48 escape and control sequences, as emitted by terminal
+ * applications to move the cursor, set colours, etc. */
+static size_t transform_strip_ansi(struct transform_stage_state *state,
+				   const uint8_t *in, size_t len, uint8_t *out)
+{
+	enum ansi_state s = state->ansi;
+	size_t out_len = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = in[i];
+
+		/* ESC restarts a sequence from any state, CAN and SUB abort */
+		if (c == 0x1b && s != ANSI_STRING) {
+			s = ANSI_ESCAPE;
+			continue;
+		}
+		if ((c == 0x18 || c == 0x1a) && s != ANSI_GROUND) {
+			s = ANSI_GROUND;
+			continue;
+		}
+
+		switch (s) {
+		case ANSI_GROUND:
+			out[out_len++] = c;
+			break;
+		case ANSI_ESCAPE:
+			if (c == '[') {
+				s = ANSI_CSI;
+			} else if (c == ']' || c == 'P' || c == 'X' ||
+				   c == '^' || c == '_') {
+				/* OSC, DCS, SOS, PM and APC strings */
+				s = ANSI_STRING;
+			} else if (c >= 0x20 && c <= 0x2f) {
+				s = ANSI_ESCAPE_INTERMEDIATE;
+			} else if (c < 0x20) {
+				/* controls are executed within sequences */
+				out[out_len++] = c;
+			} else {
+				s = ANSI_GROUND;
+			}
+			break;
+		case ANSI_ESCAPE_INTERMEDIATE:
+			if (c < 0x20) {
+				out[out_len++] = c;
+			} else if (c >= 0x30) {
+				s = ANSI_GROUND;
+			}
+			break;
+		case ANSI_CSI:
+			if (c < 0x20) {
+				out[out_len++] = c;
+			} else if (c >= 0x40 && c <= 0x7e) {
+				s = ANSI_GROUND;
+			}
+			break;
+		case ANSI_STRING:
+			/* terminated by BEL or ST (ESC \) */
+			if (c == 0x07) {
+				s = ANSI_GROUND;
+			} else if (c == 0x1b) {
+				s = ANSI_STRING_ESCAPE;
+			}
+			break;
+		case ANSI_STRING_ESCAPE:
+			s = c == 0x1b ? ANSI_STRING_ESCAPE : ANSI_GROUND;
+			break;
+		}
+	}
+
+	state->ansi = s;
+	return out_len;
+}
+
+/* Normalise CRLF and bare CR line endings to LF */
+static size_t transform_crlf(struct transform_stage_state *state,
+			     const uint8_t *in, size_t len, uint8_t *out)
+{
+	size_t out_len = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (state->crlf_pending_cr) {
+			state->crlf_pending_cr = false;
+			out[out_len++] = '\n';
+			if (in[i] == '\n') {
+				continue;
+			}
+		}
+
+		if (in[i] == '\r') {
+			state->crlf_pending_cr = true;
+		} else {
+			out[out_len++] = in[i];
+		}
+	}
+
+	return out_len;
+}
+
+static const uint8_t utf8_replacement[] = { 0xef, 0xbf, 0xbd };
+
+static size_t utf8_emit_replacement(uint8_t *out)
+{
+	memcpy(out, utf8_replacement, sizeof(utf8_replacement));
+	return sizeof(utf8_replacement);
+}
+
+/* Replace invalid UTF-8 (including overlong encodings and surrogates) with
+ * U+FFFD */
+static size_t transform_utf8(struct transform_stage_state *state,
+			     const uint8_t *in, size_t len, uint8_t *out)
+{
+	size_t out_len = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = in[i];
+
+		if (state->utf8.need) {
+			if (c >= state->utf8.lo && c <= state->utf8.hi) {
+				state->utf8.seq[state->utf8.len++] = c;
+				state->utf8.lo = 0x80;
+				state->utf8.hi = 0xbf;
+				if (!--state->utf8.need) {
+					memcpy(out + out_len, state->utf8.seq,
+					       state->utf8.len);
+					out_len += state->utf8.len;
+				}
+				continue;
+			}
+
+			/* truncated sequence; c starts afresh */
+			state->utf8.need = 0;
+			out_len += utf8_emit_replacement(out + out_len);
+		}
+
+		state->utf8.lo = 0x80;
+		state->utf8.hi = 0xbf;
+
+		if (c < 0x80) {
+			out[out_len++] = c;
+			continue;
+		} else if (c >= 0xc2 && c <= 0xdf) {
+			state->utf8.need = 1;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			state->utf8.need = 2;
+			if (c == 0xe0) {
+				state->utf8.lo = 0xa0;
+			} else if (c == 0xed) {
+				state->utf8.hi = 0x9f;
+			}
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			state->utf8.need = 3;
+			if (c == 0xf0) {
+				state->utf8.lo = 0x90;
+			} else if (c == 0xf4) {
+				state->utf8.hi = 0x8f;
+			}
+		} else {
+			out_len += utf8_emit_replacement(out + out_len);
+			continue;
+		}
+
+		state->utf8.seq[0] = c;
+		state->utf8.len = 1;
+	}
+
+	return out_len;
+}
+
+static bool grep_match(const struct transform_stage_state *state,
+		       const uint8_t *line, size_t len)
+{
+	const char *p = state->arg;
+	const char *end = state->arg + state->arg_len;
+	size_t n;
+
+	for (; p < end; p += n + 1) {
+		n = strcspn(p, "|");
+		if (p + n > end) {
+			n = end - p;
+		}
+		if (n && memmem(line, len, p, n)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Pass only the lines that contain one of the '|'-separated strings in the
+ * argument. We hold each line until it's complete, so the decision is made
+ * once per line. A line that fills the buffer is decided on what we have,
+ * and if it matched, the rest of it passes straight through.
+ */
+static size_t transform_grep(struct transform_stage_state *state,
+			     const uint8_t *in, size_t len, uint8_t *out)
+{
+	size_t out_len = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = in[i];
+
+		switch (state->grep.mode) {
+		case GREP_HOLD:
+			state->buf[state->grep.len++] = c;
+			if (c != '\n' && state->grep.len < TRANSFORM_LINE_MAX) {
+				break;
+			}
+			if (grep_match(state, state->buf, state->grep.len)) {
+				memcpy(out + out_len, state->buf,
+				       state->grep.len);
+				out_len += state->grep.len;
+				state->grep.mode = GREP_PASS;
+			} else {
+				state->grep.mode = GREP_SKIP;
+			}
+			state->grep.len = 0;
+			break;
+		case GREP_PASS:
+			out[out_len++] = c;
+			break;
+		case GREP_SKIP:
+			break;
+		}
+
+		if (c == '\n') {
+			state->grep.mode = GREP_HOLD;
+		}
+	}
+
+	return out_len;
+}
+
+static const struct transform_stage_type transform_stage_types[] = {
+	{ .name = "strip-ansi", .expansion = 1, .fn = transform_strip_ansi },
+	{ .name = "crlf", .expansion = 1, .fn = transform_crlf },
+	/* a three-byte replacement for each invalid byte */
+	{ .name = "utf8", .expansion = 3, .fn = transform_utf8 },
+	{ .name = "grep",
+	  .expansion = 1,
+	  .hold = TRANSFORM_LINE_MAX,
+	  .arg = true,
+	  .fn = transform_grep },
+};
+
+static const struct transform_stage_type *
+transform_stage_type_find(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(transform_stage_types); i++) {
+		if (strlen(transform_stage_types[i].name) == len &&
+		    !strncmp(transform_stage_types[i].name, name, len)) {
+			return &transform_stage_types[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse a transform spec into t->stages, and store the canonical form of the
+ * spec in t->spec, so equivalent chains compare equal.
+ */
+static int transform_parse(struct transform *t, const char *spec)
+{
+	const struct transform_stage_type *type;
+	struct transform_stage_state *stage;
+	const char *arg;
+	const char *p;
+	size_t arg_len;
+	size_t len;
+	char *q;
+
+	t->n_stages = 0;
+
+	/* the canonical form is never longer than the spec */
+	t->spec = malloc(strlen(spec) + 1);
+	if (!t->spec) {
+		return -1;
+	}
+	q = t->spec;
+
+	for (p = spec; *p;) {
+		p += strspn(p, " \t,");
+		len = strcspn(p, " \t,:");
+		if (!len) {
+			if (*p == ':') {
+				warnx("Missing transform stage in '%s'", spec);
+				goto err_free;
+			}
+			continue;
+		}
+
+		type = transform_stage_type_find(p, len);
+		if (!type) {
+			warnx("Unknown transform stage '%.*s'", (int)len, p);
+			goto err_free;
+		}
+
+		arg = NULL;
+		arg_len = 0;
+		if (p[len] == ':') {
+			arg = p + len + 1;
+			arg_len = strcspn(arg, ",");
+		}
+
+		if (type->arg ? !arg_len : !!arg) {
+			warnx("Transform stage '%s' %s an argument", type->name,
+			      type->arg ? "needs" : "doesn't take");
+			goto err_free;
+		}
+
+		if (t->n_stages == TRANSFORM_MAX_STAGES) {
+			warnx("Too many transform stages in '%s'", spec);
+			goto err_free;
+		}
+
+		stage = &t->stages[t->n_stages++];
+		memset(stage, 0, sizeof(*stage));
+		stage->type = type;
+
+		if (q != t->spec) {
+			*q++ = ',';
+		}
+		q = stpcpy(q, type->name);
+		p += len;
+
+		if (arg) {
+			*q++ = ':';
+			memcpy(q, arg, arg_len);
+			stage->arg = q;
+			stage->arg_len = arg_len;
+			q += arg_len;
+			p = arg + arg_len;
+		}
+	}
+
+	*q = '\0';
+
+	if (!t->n_stages) {
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	free(t->spec);
+	t->spec = NULL;
+	return -1;
+}
+
+/* Run the chain over in, returning the output length; output is in
+ * t->bufs[0] */
+static size_t transform_run(struct transform *t, const uint8_t *in,
+			    size_t len)
+{
+	struct transform_stage_state *stage;
+	uint8_t *out;
+	int i;
+
+	for (i = 0; i < t->n_stages; i++) {
+		stage = &t->stages[i];
+		out = t->bufs[i % 2];
+		len = stage->type->fn(stage, in, len, out);
+		in = out;
+	}
+
+	/* ensure the result ends up in bufs[0] */
+	if (in != t->bufs[0]) {
+		memcpy(t->bufs[0], in, len);
+	}
+
+	return len;
+}
+
+static void transform_destroy(struct transform *t)
+{
+	struct console *console = t->console;
+	int i;
+
+	for (i = 0; i < console->n_transforms; i++) {
+		if (console->transforms[i] == t) {
+			break;
+		}
+	}
+
+	assert(i < console->n_transforms);
+
+	console->n_transforms--;
+	/*
+	 * We're managing an array of pointers to aggregates, so don't warn about sizeof() on a
+	 * pointer type.
+	 */
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */
+	memmove(&console->transforms[i], &console->transforms[i + 1],
+		sizeof(*console->transforms) * (console->n_transforms - i));
+	console->transforms =
+		reallocarray(console->transforms, console->n_transforms,
+			     sizeof(*console->transforms));
+	/* NOLINTEND(bugprone-sizeof-expression) */
+
+	ringbuffer_consumer_unregister(t->rbc);
+	console_mem_uncharge(console, t->mem);
+	ringbuffer_fini(t->rb);
+	for (i = 0; i < t->n_stages; i++) {
+		free(t->stages[i].buf);
+	}
+	free(t->bufs[0]);
+	free(t->bufs[1]);
+	free(t->spec);
+	free(t);
+}
+
+static ssize_t transform_ringbuffer_push(void *arg, const struct iovec *iov,
+					 int iovcnt,
+					 size_t force_len
+					 __attribute__((unused)))
+{
+	struct transform *t = arg;
+	const uint8_t *buf;
+	size_t total = 0;
+	size_t out_len;
+	size_t off;
+	size_t len;
+	int rc;
+	int i;
+
+	/* unused until the event loop tears us down */
+	if (!t->rb->n_consumers) {
+		return (ssize_t)ringbuffer_iov_len(iov, iovcnt);
+	}
+
+	/* We're synchronous: anything blocking happens when the derived
+	 * ringbuffer forces its own consumers, so always take everything */
+	for (i = 0; i < iovcnt; i++) {
+		buf = iov[i].iov_base;
+		for (off = 0; off < iov[i].iov_len; off += len) {
+			len = iov[i].iov_len - off;
+			if (len > t->chunk_size) {
+				len = t->chunk_size;
+			}
+
+			out_len = transform_run(t, buf + off, len);
+
+			rc = ringbuffer_queue(t->rb, t->bufs[0], out_len);
+			if (rc) {
+				warnx("Failed to queue transformed data for '%s'",
+				      t->spec);
+			}
+		}
+		total += iov[i].iov_len;
+	}
+
+	return (ssize_t)total;
+}
+
+static struct transform *transform_create(struct console *console,
+					  const char *spec)
+{
+	struct transform *t;
+	size_t expansion = 1;
+	size_t hold = 0;
+	int n;
+	int i;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		return NULL;
+	}
+
+	t->console = console;
+
+	if (transform_parse(t, spec)) {
+		goto err_free;
+	}
+
+	for (i = 0; i < t->n_stages; i++) {
+		expansion *= t->stages[i].type->expansion;
+		hold += t->stages[i].type->hold;
+	}
+
+	/*
+	 * Every chunk, once transformed, must fit in the derived ringbuffer
+	 * in one go. Each stage may also emit a byte's worth of output held
+	 * over from the previous chunk, or all it holds, for those that hold
+	 * more.
+	 */
+	if ((TRANSFORM_MAX_STAGES + hold + 1) * expansion >= console->rb->size) {
+		warnx("The ringbuffer is too small for transform '%s'",
+		      t->spec);
+		goto err_free;
+	}
+	t->chunk_size = TRANSFORM_CHUNK_SIZE;
+	if ((t->chunk_size + TRANSFORM_MAX_STAGES + hold) * expansion >=
+	    console->rb->size) {
+		t->chunk_size = (console->rb->size - 1) / expansion -
+				TRANSFORM_MAX_STAGES - hold;
+	}
+	t->buf_size =
+		(t->chunk_size + TRANSFORM_MAX_STAGES + hold) * expansion;
+
+	t->mem = sizeof(*t) + 2 * t->buf_size + hold + console->rb->size;
+	if (console_mem_charge(console, t->mem)) {
+		warnx("Memory limit reached, can't create transform '%s'",
+		      t->spec);
+		t->mem = 0;
+		goto err_free;
+	}
+
+	t->bufs[0] = malloc(t->buf_size);
+	t->bufs[1] = malloc(t->buf_size);
+	t->rb = ringbuffer_init(console->rb->size);
+	if (!t->bufs[0] || !t->bufs[1] || !t->rb) {
+		goto err_free;
+	}
+
+	for (i = 0; i < t->n_stages; i++) {
+		if (!t->stages[i].type->hold) {
+			continue;
+		}
+		t->stages[i].buf = malloc(t->stages[i].type->hold);
+		if (!t->stages[i].buf) {
+			goto err_free;
+		}
+	}
+
+	t->rbc = ringbuffer_consumer_register_push(
+		console->rb, transform_ringbuffer_push, t);
+	if (!t->rbc) {
+		goto err_free;
+	}
+
+	n = console->n_transforms++;
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */
+	console->transforms =
+		reallocarray(console->transforms, console->n_transforms,
+			     sizeof(*console->transforms));
+	/* NOLINTEND(bugprone-sizeof-expression) */
+	console->transforms[n] = t;
+
+	return t;
+
+err_free:
+	if (t->mem) {
+		console_mem_uncharge(console, t->mem);
+	}
+	if (t->rb) {
+		ringbuffer_fini(t->rb);
+	}
+	for (i = 0; i < t->n_stages; i++) {
+		free(t->stages[i].buf);
+	}
+	free(t->bufs[0]);
+	free(t->bufs[1]);
+	free(t->spec);
+	free(t);
+	return NULL;
+}
+
+struct ringbuffer *console_transform_ringbuffer(struct console *console,
+						const char *spec)
+{
+	struct transform *t;
+	struct transform tmp;
+	int i;
+
+	/* canonicalise the spec so we can find an existing chain */
+	if (transform_parse(&tmp, spec)) {
+		return NULL;
+	}
+
+	for (i = 0; i < console->n_transforms; i++) {
+		t = console->transforms[i];
+		if (!strcmp(t->spec, tmp.spec)) {
+			free(tmp.spec);
+			return t->rb;
+		}
+	}
+
+	if (console->n_transforms >= console->max_transforms) {
+		warnx("Transform limit reached, can't create transform '%s'",
+		      tmp.spec);
+		free(tmp.spec);
+		errno = EUSERS;
+		return NULL;
+	}
+
+	free(tmp.spec);
+
+	t = transform_create(console, spec);
+	if (!t) {
+		return NULL;
+	}
+
+	return t->rb;
+}
+
+void console_transform_reap(struct console *console)
+{
+	struct transform *t;
+	int i;
+
+	for (i = console->n_transforms - 1; i >= 0; i--) {
+		t = console->transforms[i];
+		if (!t->rb->n_consumers) {
+			transform_destroy(t);
+		}
+	}
+}
+
+void console_transform_init(struct console *console, struct config *config)
+{
+	unsigned long parsed;
+	const char *val;
+	char *endp;
+
+	console->max_transforms = default_max_transforms;
+
+	val = config_get_value(config, "transform-max-chains");
+	if (!val) {
+		return;
+	}
+
+	errno = 0;
+	parsed = strtoul(val, &endp, 0);
+	if (errno || endp == val || *endp || parsed > INT_MAX) {
+		warnx("Invalid transform-max-chains value: '%s'", val);
+		return;
+	}
+
+	console->max_transforms = (int)parsed;
+}
@@ -26,33 +26,41 @@
 
 #include "console-server.h"
 
-struct tty_handler {
-	struct handler handler;
-	struct console *console;
+/* One of the local ttys that mirror the console */
+struct tty_mirror {
+	struct tty_handler *th;
 	struct ringbuffer_consumer *rbc;
 	struct poller *poller;
+	char *name;
 	int fd;
 	int fd_flags;
 	bool blocked;
 };
 
+struct tty_handler {
+	struct handler handler;
+	struct console *console;
+	struct tty_mirror *mirrors;
+	int n_mirrors;
+};
+
 static struct tty_handler *to_tty_handler(struct handler *handler)
 {
 	return container_of(handler, struct tty_handler, handler);
 }
 
-static void tty_set_fd_blocking(struct tty_handler *th, bool fd_blocking)
+static void tty_set_fd_blocking(struct tty_mirror *tm, bool fd_blocking)
 {
 	int flags;
 
-	flags = th->fd_flags & ~O_NONBLOCK;
+	flags = tm->fd_flags & ~O_NONBLOCK;
 	if (!fd_blocking) {
 		flags |= O_NONBLOCK;
 	}
 
-	if (flags != th->fd_flags) {
-		fcntl(th->fd, F_SETFL, flags);
-		th->fd_flags = flags;
+	if (flags != tm->fd_flags) {
+		fcntl(tm->fd, F_SETFL, flags);
+		tm->fd_flags = flags;
 	}
 }
 
@@ -65,122 +73,127 @@ static void tty_set_fd_blocking(struct tty_handler *th, bool fd_blocking)
  * POLLOUT indicates that the fd is no longer blocking, so we clear
  * blocked mode and can continue writing.
  */
-static void tty_set_blocked(struct tty_handler *th, bool blocked)
+static void tty_set_blocked(struct tty_mirror *tm, bool blocked)
 {
 	int events;
 
-	if (blocked == th->blocked) {
+	if (blocked == tm->blocked) {
 		return;
 	}
 
-	th->blocked = blocked;
+	tm->blocked = blocked;
 	events = POLLIN;
 
-	if (th->blocked) {
+	if (tm->blocked) {
 		events |= POLLOUT;
 	}
 
-	console_poller_set_events(th->console, th->poller, events);
+	console_poller_set_events(tm->th->console, tm->poller, events);
 }
 
-static int tty_drain_queue(struct tty_handler *th, size_t force_len)
+/* Write pending data to the tty, returning the number of bytes written */
+static ssize_t tty_drain_queue(void *arg, const struct iovec *iov, int iovcnt,
+			       size_t force_len)
 {
-	size_t len;
+	struct iovec vec[RINGBUFFER_IOV_MAX];
+	struct tty_mirror *tm = arg;
 	size_t total_len;
+	size_t limit;
 	ssize_t wlen;
-	uint8_t *buf;
+	int n;
 
 	/* if we're forcing data, we need to clear non-blocking mode */
 	if (force_len) {
-		tty_set_fd_blocking(th, true);
+		tty_set_fd_blocking(tm, true);
 
 		/* no point writing, we'll just see -EAGAIN */
-	} else if (th->blocked) {
+	} else if (tm->blocked) {
 		return 0;
 	}
 
+	/* write as little as possible while blocking */
+	limit = force_len ? force_len : SIZE_MAX;
 	total_len = 0;
 
 	for (;;) {
-		len = ringbuffer_dequeue_peek(th->rbc, total_len, &buf);
-		if (!len) {
+		n = ringbuffer_iov_slice(vec, iov, iovcnt, total_len,
+					 limit - total_len);
+		if (!n) {
 			break;
 		}
 
-		/* write as little as possible while blocking */
-		if (force_len && force_len < total_len + len) {
-			len = force_len - total_len;
-		}
-
-		wlen = write(th->fd, buf, len);
+		wlen = writev(tm->fd, vec, n);
 		if (wlen < 0) {
 			if (errno == EINTR) {
 				continue;
 			}
 			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
 			    !force_len) {
-				tty_set_blocked(th, true);
+				tty_set_blocked(tm, true);
 				break;
 			}
-			warn("failed writing to local tty; disabling");
+			warn("failed writing to local tty %s; disabling",
+			     tm->name);
 			return -1;
 		}
 
-		if (total_len > SIZE_MAX - wlen) {
-			warn("data size too large to write; disabling");
-			return -1;
-		}
 		total_len += wlen;
-
-		if (force_len && total_len >= force_len) {
-			break;
-		}
 	}
 
-	ringbuffer_dequeue_commit(th->rbc, total_len);
-
 	if (force_len) {
-		tty_set_fd_blocking(th, false);
+		tty_set_fd_blocking(tm, false);
 	}
 
-	return 0;
+	return (ssize_t)total_len;
 }
 
-static enum ringbuffer_poll_ret tty_ringbuffer_poll(void *arg, size_t force_len)
+/* Stop mirroring to a tty that has failed */
+static void tty_mirror_disable(struct tty_mirror *tm)
 {
-	struct tty_handler *th = arg;
-	int rc;
+	tm->poller = NULL;
+	tm->rbc = NULL;
+	close(tm->fd);
+	tm->fd = -1;
+	console_interactive_put(tm->th->console);
+}
 
-	rc = tty_drain_queue(th, force_len);
-	if (rc) {
-		console_poller_unregister(th->console, th->poller);
-		return RINGBUFFER_POLL_REMOVE;
+static ssize_t tty_ringbuffer_push(void *arg, const struct iovec *iov,
+				   int iovcnt, size_t force_len)
+{
+	struct tty_mirror *tm = arg;
+	ssize_t rc;
+
+	rc = tty_drain_queue(tm, iov, iovcnt, force_len);
+	if (rc < 0) {
+		/* the ringbuffer unregisters the consumer for us */
+		console_poller_unregister(tm->th->console, tm->poller);
+		tty_mirror_disable(tm);
 	}
 
-	return RINGBUFFER_POLL_OK;
+	return rc;
 }
 
-static enum poller_ret tty_poll(struct handler *handler, int events,
-				void __attribute__((unused)) * data)
+static enum poller_ret
+tty_poll(struct handler *handler __attribute__((unused)), int events, void *data)
 {
-	struct tty_handler *th = to_tty_handler(handler);
+	struct tty_mirror *tm = data;
 	uint8_t buf[4096];
 	ssize_t len;
-	int rc;
+	ssize_t rc;
 
 	if (events & POLLIN) {
-		len = read(th->fd, buf, sizeof(buf));
+		len = read(tm->fd, buf, sizeof(buf));
 		if (len <= 0) {
 			goto err;
 		}
 
-		console_data_out(th->console, buf, len);
+		console_data_out(tm->th->console, buf, len);
 	}
 
 	if (events & POLLOUT) {
-		tty_set_blocked(th, false);
-		rc = tty_drain_queue(th, 0);
-		if (rc) {
+		tty_set_blocked(tm, false);
+		rc = ringbuffer_dequeue_iov(tm->rbc, 0, tty_drain_queue, tm);
+		if (rc < 0) {
 			goto err;
 		}
 	}
@@ -188,41 +201,65 @@ static enum poller_ret tty_poll(struct handler *handler, int events,
 	return POLLER_OK;
 
 err:
-	th->poller = NULL;
-	close(th->fd);
-	ringbuffer_consumer_unregister(th->rbc);
+	ringbuffer_consumer_unregister(tm->rbc);
+	tty_mirror_disable(tm);
 	return POLLER_REMOVE;
 }
 
-static int set_terminal_baud(struct tty_handler *th, const char *tty_name,
-			     speed_t speed)
+static void tty_mirror_start(struct tty_mirror *tm)
+{
+	struct tty_handler *th = tm->th;
+
+	tm->poller = console_poller_register(th->console, &th->handler,
+					     tty_poll, NULL, tm->fd, POLLIN,
+					     tm);
+	tm->rbc = console_ringbuffer_consumer_register_push(
+		th->console, &th->handler, NULL, tty_ringbuffer_push, tm);
+
+	/* someone may be watching the local tty at any time */
+	console_interactive_get(th->console);
+}
+
+/* Detach from the console, but keep the tty open */
+static void tty_mirror_stop(struct tty_mirror *tm)
+{
+	console_poller_unregister(tm->th->console, tm->poller);
+	ringbuffer_consumer_unregister(tm->rbc);
+	tm->poller = NULL;
+	tm->rbc = NULL;
+	tm->blocked = false;
+	tty_set_fd_blocking(tm, false);
+	console_interactive_put(tm->th->console);
+}
+
+static int set_terminal_baud(struct tty_mirror *tm, speed_t speed)
 {
 	struct termios term_options;
 
-	if (tcgetattr(th->fd, &term_options) < 0) {
-		warn("Can't get config for %s", tty_name);
+	if (tcgetattr(tm->fd, &term_options) < 0) {
+		warn("Can't get config for %s", tm->name);
 		return -1;
 	}
 
 	if (cfsetspeed(&term_options, speed) < 0) {
-		warn("Couldn't set speeds for %s", tty_name);
+		warn("Couldn't set speeds for %s", tm->name);
 		return -1;
 	}
 
-	if (tcsetattr(th->fd, TCSAFLUSH, &term_options) < 0) {
-		warn("Couldn't commit terminal options for %s", tty_name);
+	if (tcsetattr(tm->fd, TCSAFLUSH, &term_options) < 0) {
+		warn("Couldn't commit terminal options for %s", tm->name);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int make_terminal_raw(struct tty_handler *th, const char *tty_name)
+static int make_terminal_raw(struct tty_mirror *tm)
 {
 	struct termios term_options;
 
-	if (tcgetattr(th->fd, &term_options) < 0) {
-		warn("Can't get config for %s", tty_name);
+	if (tcgetattr(tm->fd, &term_options) < 0) {
+		warn("Can't get config for %s", tm->name);
 		return -1;
 	}
 
@@ -231,98 +268,268 @@ static int make_terminal_raw(struct tty_handler *th, const char *tty_name)
 	 * generating characters. */
 	cfmakeraw(&term_options);
 
-	if (tcsetattr(th->fd, TCSAFLUSH, &term_options) < 0) {
-		warn("Couldn't commit terminal options for %s", tty_name);
+	if (tcsetattr(tm->fd, TCSAFLUSH, &term_options) < 0) {
+		warn("Couldn't commit terminal options for %s", tm->name);
 		return -1;
 	}
-	printf("Set %s for raw byte handling\n", tty_name);
+	printf("Set %s for raw byte handling\n", tm->name);
 
 	return 0;
 }
 
-static int tty_init(struct handler *handler, struct console *console,
-		    struct config *config __attribute__((unused)))
+static int tty_mirror_init(struct tty_handler *th, struct tty_mirror *tm,
+			   const char *tty_baud)
 {
-	struct tty_handler *th = to_tty_handler(handler);
 	speed_t desired_speed;
-	const char *tty_name;
-	const char *tty_baud;
 	char *tty_path;
 	int rc;
 
-	tty_name = config_get_value(config, "local-tty");
-	if (!tty_name) {
-		return -1;
-	}
-
-	rc = asprintf(&tty_path, "/dev/%s", tty_name);
-	if (!rc) {
+	rc = asprintf(&tty_path, "/dev/%s", tm->name);
+	if (rc < 0) {
 		return -1;
 	}
 
-	th->fd = open(tty_path, O_RDWR | O_NONBLOCK);
-	if (th->fd < 0) {
-		warn("Can't open %s; disabling local tty", tty_name);
+	tm->th = th;
+	tm->fd = open(tty_path, O_RDWR | O_NONBLOCK);
+	if (tm->fd < 0) {
+		warn("Can't open %s; disabling local tty", tm->name);
 		free(tty_path);
 		return -1;
 	}
 
 	free(tty_path);
-	th->fd_flags = fcntl(th->fd, F_GETFL, 0);
+	tm->fd_flags = fcntl(tm->fd, F_GETFL, 0);
 
-	tty_baud = config_get_value(config, "local-tty-baud");
 	if (tty_baud != NULL) {
 		rc = config_parse_baud(&desired_speed, tty_baud);
 		if (rc) {
 			fprintf(stderr, "%s is not a valid baud rate\n",
 				tty_baud);
 		} else {
-			rc = set_terminal_baud(th, tty_name, desired_speed);
+			rc = set_terminal_baud(tm, desired_speed);
 			if (rc) {
 				fprintf(stderr,
 					"Couldn't set baud rate for %s to %s\n",
-					tty_name, tty_baud);
+					tm->name, tty_baud);
 			}
 		}
 	}
 
-	if (make_terminal_raw(th, tty_name) != 0) {
-		fprintf(stderr, "Couldn't make %s a raw terminal\n", tty_name);
+	if (make_terminal_raw(tm) != 0) {
+		fprintf(stderr, "Couldn't make %s a raw terminal\n", tm->name);
 	}
 
-	th->poller = console_poller_register(console, handler, tty_poll, NULL,
-					     th->fd, POLLIN, NULL);
-	th->console = console;
-	th->rbc = console_ringbuffer_consumer_register(console,
-						       tty_ringbuffer_poll, th);
+	tty_mirror_start(tm);
 
 	return 0;
 }
 
+/* Split a list of names or baud rates, separated by commas or whitespace */
+static char **tty_split_list(const char *str, int *n)
+{
+	char **list = NULL;
+	char **tmp;
+	char *copy;
+	char *tok;
+	char *p;
+
+	*n = 0;
+	copy = strdup(str);
+	if (!copy) {
+		return NULL;
+	}
+
+	for (tok = strtok_r(copy, ", \t", &p); tok;
+	     tok = strtok_r(NULL, ", \t", &p)) {
+		/*
+		 * We're managing an array of pointers to strings, so don't
+		 * warn about sizeof() on a pointer type.
+		 */
+		/* NOLINTBEGIN(bugprone-sizeof-expression) */
+		tmp = reallocarray(list, *n + 1, sizeof(*list));
+		/* NOLINTEND(bugprone-sizeof-expression) */
+		if (!tmp) {
+			break;
+		}
+		list = tmp;
+		list[*n] = strdup(tok);
+		if (!list[*n]) {
+			break;
+		}
+		(*n)++;
+	}
+
+	free(copy);
+	return list;
+}
+
+static void tty_free_list(char **list, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(list[i]);
+	}
+	free(list);
+}
+
+/*
+ * local-tty is a list of ttys to mirror the console to, and local-tty-baud
+ * an optional list of their baud rates, in the same order. A single baud
+ * rate applies to all of the ttys.
+ */
+static int tty_init(struct handler *handler, struct console *console,
+		    struct config *config)
+{
+	struct tty_handler *th = to_tty_handler(handler);
+	struct tty_mirror *tm;
+	const char *val;
+	char **bauds = NULL;
+	char **names;
+	int n_bauds = 0;
+	int n_names;
+	int i;
+
+	val = config_get_value(config, "local-tty");
+	if (!val) {
+		return -1;
+	}
+
+	names = tty_split_list(val, &n_names);
+	if (!n_names) {
+		tty_free_list(names, n_names);
+		return -1;
+	}
+
+	val = config_get_value(config, "local-tty-baud");
+	if (val) {
+		bauds = tty_split_list(val, &n_bauds);
+		if (n_bauds != 1 && n_bauds != n_names) {
+			warnx("local-tty-baud should have one baud rate, or one for each local-tty");
+		}
+	}
+
+	th->console = console;
+	th->n_mirrors = 0;
+	th->mirrors = calloc(n_names, sizeof(*th->mirrors));
+	if (!th->mirrors) {
+		goto out_free;
+	}
+
+	for (i = 0; i < n_names; i++) {
+		tm = &th->mirrors[th->n_mirrors];
+		tm->name = names[i];
+		names[i] = NULL;
+
+		val = NULL;
+		if (n_bauds == 1) {
+			val = bauds[0];
+		} else if (i < n_bauds) {
+			val = bauds[i];
+		}
+
+		if (tty_mirror_init(th, tm, val)) {
+			free(tm->name);
+			continue;
+		}
+		th->n_mirrors++;
+	}
+
+	if (!th->n_mirrors) {
+		free(th->mirrors);
+		th->mirrors = NULL;
+	}
+
+out_free:
+	tty_free_list(names, n_names);
+	tty_free_list(bauds, n_bauds);
+
+	return th->n_mirrors ? 0 : -1;
+}
+
 static void tty_fini(struct handler *handler)
 {
 	struct tty_handler *th = to_tty_handler(handler);
-	if (th->poller) {
-		console_poller_unregister(th->console, th->poller);
+	struct tty_mirror *tm;
+	int i;
+
+	for (i = 0; i < th->n_mirrors; i++) {
+		tm = &th->mirrors[i];
+		if (tm->poller) {
+			console_poller_unregister(th->console, tm->poller);
+			ringbuffer_consumer_unregister(tm->rbc);
+			tty_mirror_disable(tm);
+		} else if (tm->fd >= 0) {
+			/* suspended */
+			close(tm->fd);
+		}
+		free(tm->name);
+	}
+
+	free(th->mirrors);
+	th->mirrors = NULL;
+	th->n_mirrors = 0;
+}
+
+/*
+ * While suspended, the local ttys stay open, so their settings survive, but
+ * we neither mirror output to them nor take input from them. Any output
+ * in the meantime is lost to them.
+ */
+static void tty_suspend(struct handler *handler)
+{
+	struct tty_handler *th = to_tty_handler(handler);
+	int i;
+
+	for (i = 0; i < th->n_mirrors; i++) {
+		if (th->mirrors[i].poller) {
+			tty_mirror_stop(&th->mirrors[i]);
+		}
+	}
+}
+
+static int tty_resume(struct handler *handler)
+{
+	struct tty_handler *th = to_tty_handler(handler);
+	struct tty_mirror *tm;
+	int i;
+
+	for (i = 0; i < th->n_mirrors; i++) {
+		tm = &th->mirrors[i];
+		if (tm->fd >= 0 && !tm->poller) {
+			tty_mirror_start(tm);
+		}
 	}
-	close(th->fd);
+
+	return 0;
 }
 
+/* Follow the host tty's baud rate on each of the local ttys */
 static int tty_baudrate(struct handler *handler, speed_t baudrate)
 {
-	const char *tty_name = "local-tty";
 	struct tty_handler *th = to_tty_handler(handler);
+	struct tty_mirror *tm;
+	int rc = 0;
+	int i;
 
 	if (baudrate == 0) {
 		return -1;
 	}
 
-	if (set_terminal_baud(th, tty_name, baudrate) != 0) {
-		fprintf(stderr, "Couldn't set baud rate for %s to %d\n",
-			tty_name, baudrate);
-		return -1;
+	for (i = 0; i < th->n_mirrors; i++) {
+		tm = &th->mirrors[i];
+		if (tm->fd < 0) {
+			continue;
+		}
+
+		if (set_terminal_baud(tm, baudrate) != 0) {
+			fprintf(stderr, "Couldn't set baud rate for %s to %d\n",
+				tm->name, baudrate);
+			rc = -1;
+		}
 	}
-	return 0;
+
+	return rc;
 }
 
 static struct tty_handler tty_handler = {
@@ -331,6 +538,8 @@ static struct tty_handler tty_handler = {
 		.init		= tty_init,
 		.fini		= tty_fini,
 		.baudrate	= tty_baudrate,
+		.suspend	= tty_suspend,
+		.resume		= tty_resume,
 	},
 };
 